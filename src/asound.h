@@ -427,6 +427,26 @@ typedef enum _snd_pcm_audio_tstamp_type {
 	SND_PCM_AUDIO_TSTAMP_TYPE_LAST = SND_PCM_AUDIO_TSTAMP_TYPE_LINK_SYNCHRONIZED
 } snd_pcm_audio_tstamp_type_t;
 
+typedef struct _snd_pcm_audio_tstamp_config {
+	/* 5 of max 16 bits used */
+	unsigned int type_requested:4;
+	unsigned int report_delay:1; /* add total delay to A/D or D/A */
+} snd_pcm_audio_tstamp_config_t;
+
+typedef struct _snd_pcm_audio_tstamp_report {
+	/* 6 of max 16 bits used for bit-fields */
+
+	/* for backwards compatibility */
+	unsigned int valid:1;
+
+	/* actual type if hardware could not support requested timestamp */
+	unsigned int actual_type:4;
+
+	/* accuracy represented in ns units */
+	unsigned int accuracy_report:1; /* 0 if accuracy unknown, 1 if accuracy field is valid */
+	unsigned int accuracy; /* up to 4.29s, will be packed in separate field  */
+} snd_pcm_audio_tstamp_report_t;
+
 #if __TIMESIZE == 32 && SALSA_STRUCT_TIME64
 #define __snd_pcm_mmap_status64		snd_pcm_mmap_status
 #define __snd_pcm_mmap_control64	snd_pcm_mmap_control
@@ -449,6 +469,7 @@ typedef struct snd_pcm_status {
 	snd_pcm_uframes_t avail_max;
 	snd_pcm_uframes_t overrange;
 	int suspended_state;
+	unsigned int audio_tstamp_data;
 	struct __snd_timespec audio_tstamp;
 	struct __snd_timespec driver_tstamp;
 	unsigned int audio_tstamp_accuracy;
@@ -30,6 +30,8 @@
 #include "hcontrol.h"
 #include "local.h"
 
+static int snd_hctl_compare_default(const snd_hctl_elem_t *c1,
+				    const snd_hctl_elem_t *c2);
 
 /*
  * open/close
@@ -63,6 +65,7 @@ int snd_hctl_open_ctl(snd_hctl_t **hctlp, snd_ctl_t *ctl)
 	if (!hctl)
 		return -ENOMEM;
 	hctl->ctl = ctl;
+	hctl->compare = snd_hctl_compare_default;
 	return 0;
 }
 
@@ -97,24 +100,332 @@ int snd_hctl_elem_throw_event(snd_hctl_elem_t *elem,
 }
 
 
+/*
+ * lookup index
+ *
+ * Both tables are chained and grown to keep the load factor below one,
+ * so that the lookup from the event handler doesn't walk the whole list
+ * on cards with hundreds of controls.
+ */
+#define HCTL_HASH_MIN	64
+
+static unsigned int elem_id_hash(const snd_ctl_elem_id_t *id)
+{
+	const unsigned char *p = (const unsigned char *)id->name;
+	const unsigned char *end = p + sizeof(id->name);
+	unsigned int h = 2166136261U;
+
+	h = (h ^ id->iface) * 16777619U;
+	h = (h ^ id->index) * 16777619U;
+	for (; p < end && *p; p++)
+		h = (h ^ *p) * 16777619U;
+	return h;
+}
+
+static inline int elem_id_match(const snd_hctl_elem_t *elem,
+				const snd_ctl_elem_id_t *id)
+{
+	return elem->id.iface == id->iface &&
+		elem->id.index == id->index &&
+		!strcmp((char *)elem->id.name, (char *)id->name);
+}
+
+static void hash_link(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
+{
+	unsigned int mask = hctl->hash_size - 1;
+	snd_hctl_elem_t **p;
+
+	p = &hctl->hash[elem_id_hash(&elem->id) & mask];
+	elem->hash_next = *p;
+	*p = elem;
+	p = &hctl->numid_hash[elem->id.numid & mask];
+	elem->numid_next = *p;
+	*p = elem;
+}
+
+static void hash_unlink(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
+{
+	unsigned int mask = hctl->hash_size - 1;
+	snd_hctl_elem_t **p;
+
+	for (p = &hctl->hash[elem_id_hash(&elem->id) & mask]; *p;
+	     p = &(*p)->hash_next) {
+		if (*p == elem) {
+			*p = elem->hash_next;
+			break;
+		}
+	}
+	for (p = &hctl->numid_hash[elem->id.numid & mask]; *p;
+	     p = &(*p)->numid_next) {
+		if (*p == elem) {
+			*p = elem->numid_next;
+			break;
+		}
+	}
+}
+
+/* (re)build the tables for the given number of elements; on failure,
+ * the old tables are kept (or the lookup falls back to the list walk)
+ */
+static int hash_resize(snd_hctl_t *hctl, unsigned int count)
+{
+	snd_hctl_elem_t **tbl, *elem;
+	unsigned int size;
+
+	for (size = HCTL_HASH_MIN; size < count; size <<= 1)
+		;
+	if (size <= hctl->hash_size)
+		return 0;
+	tbl = calloc(size * 2, sizeof(*tbl));
+	if (!tbl)
+		return -ENOMEM;
+	free(hctl->hash);
+	hctl->hash = tbl;
+	hctl->numid_hash = tbl + size;
+	hctl->hash_size = size;
+	for (elem = hctl->first_elem; elem; elem = elem->next)
+		hash_link(hctl, elem);
+	return 0;
+}
+
+static void hash_free(snd_hctl_t *hctl)
+{
+	free(hctl->hash);
+	hctl->hash = NULL;
+	hctl->numid_hash = NULL;
+	hctl->hash_size = 0;
+}
+
+/*
+ * sorted order
+ *
+ * The elements are kept sorted by the compare function in pelems[], and
+ * the linked list follows the same order as alsa-lib does.
+ */
+#define cmp_val(a, b)	(((a) > (b)) - ((a) < (b)))
+
+static int compare_id(const snd_ctl_elem_id_t *id1,
+		      const snd_ctl_elem_id_t *id2)
+{
+	int d;
+
+	d = cmp_val(id1->iface, id2->iface);
+	if (d)
+		return d;
+	d = strcmp((char *)id1->name, (char *)id2->name);
+	if (d)
+		return d;
+	return cmp_val(id1->index, id2->index);
+}
+
+/* iface, name, index, and numid for the elements with the same id */
+static int snd_hctl_compare_default(const snd_hctl_elem_t *c1,
+				    const snd_hctl_elem_t *c2)
+{
+	int d = compare_id(&c1->id, &c2->id);
+
+	if (d)
+		return d;
+	return cmp_val(c1->id.numid, c2->id.numid);
+}
+
+int snd_hctl_compare_fast(const snd_hctl_elem_t *c1,
+			  const snd_hctl_elem_t *c2)
+{
+	return cmp_val(c1->id.numid, c2->id.numid);
+}
+
+/* qsort() takes no context for the compare function of the hctl, so
+ * sort by hand: a merge sort, or an insertion sort without the memory
+ * for the merge.  Both are quick on the nearly sorted kernel list.
+ */
+static void merge_elems(snd_hctl_compare_t compare, snd_hctl_elem_t **a,
+			snd_hctl_elem_t **tmp, unsigned int n)
+{
+	unsigned int mid = n / 2, i = 0, j = mid, k = 0;
+
+	if (n < 2)
+		return;
+	merge_elems(compare, a, tmp, mid);
+	merge_elems(compare, a + mid, tmp, n - mid);
+	if (compare(a[mid - 1], a[mid]) <= 0)
+		return;
+	while (i < mid && j < n) {
+		if (compare(a[j], a[i]) < 0)
+			tmp[k++] = a[j++];
+		else
+			tmp[k++] = a[i++];
+	}
+	while (i < mid)
+		tmp[k++] = a[i++];
+	memcpy(a, tmp, sizeof(*a) * j);
+}
+
+static void insert_elems(snd_hctl_compare_t compare, snd_hctl_elem_t **a,
+			 unsigned int n)
+{
+	snd_hctl_elem_t *elem;
+	unsigned int i, j;
+
+	for (i = 1; i < n; i++) {
+		elem = a[i];
+		for (j = i; j > 0 && compare(a[j - 1], elem) > 0; j--)
+			a[j] = a[j - 1];
+		a[j] = elem;
+	}
+}
+
+/* rebuild the list links from pelems[] */
+static void relink_elems(snd_hctl_t *hctl)
+{
+	snd_hctl_elem_t *prev = NULL;
+	unsigned int i;
+
+	for (i = 0; i < hctl->count; i++) {
+		hctl->pelems[i]->prev = prev;
+		if (prev)
+			prev->next = hctl->pelems[i];
+		prev = hctl->pelems[i];
+	}
+	if (prev)
+		prev->next = NULL;
+	hctl->first_elem = hctl->count ? hctl->pelems[0] : NULL;
+	hctl->last_elem = prev;
+}
+
+static void sort_elems(snd_hctl_t *hctl)
+{
+	snd_hctl_elem_t **tmp;
+
+	tmp = malloc(sizeof(*tmp) * hctl->count);
+	if (tmp)
+		merge_elems(hctl->compare, hctl->pelems, tmp, hctl->count);
+	else
+		insert_elems(hctl->compare, hctl->pelems, hctl->count);
+	free(tmp);
+	relink_elems(hctl);
+}
+
+static int reserve_elems(snd_hctl_t *hctl, unsigned int count)
+{
+	snd_hctl_elem_t **p;
+	unsigned int num;
+
+	if (count <= hctl->alloc)
+		return 0;
+	for (num = hctl->alloc ? hctl->alloc : 64; num < count; num <<= 1)
+		;
+	p = realloc(hctl->pelems, sizeof(*p) * num);
+	if (!p)
+		return -ENOMEM;
+	hctl->pelems = p;
+	hctl->alloc = num;
+	return 0;
+}
+
+/* the first position where elem can be inserted */
+static unsigned int bisect_elem(snd_hctl_t *hctl, const snd_hctl_elem_t *elem)
+{
+	unsigned int lo = 0, hi = hctl->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hctl->compare(hctl->pelems[mid], elem) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static unsigned int find_elem_pos(snd_hctl_t *hctl,
+				  const snd_hctl_elem_t *elem)
+{
+	unsigned int i;
+
+	for (i = bisect_elem(hctl, elem); i < hctl->count; i++) {
+		if (hctl->pelems[i] == elem)
+			return i;
+		if (hctl->compare(hctl->pelems[i], elem))
+			break;
+	}
+	/* a compare function not giving a total order */
+	for (i = 0; i < hctl->count; i++)
+		if (hctl->pelems[i] == elem)
+			break;
+	return i;
+}
+
+/* bisect by (iface, name, index) in the default order */
+static snd_hctl_elem_t *find_sorted(snd_hctl_t *hctl,
+				    const snd_ctl_elem_id_t *id)
+{
+	unsigned int lo = 0, hi = hctl->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (compare_id(&hctl->pelems[mid]->id, id) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < hctl->count && elem_id_match(hctl->pelems[lo], id))
+		return hctl->pelems[lo];
+	return NULL;
+}
+
 /*
  * add/remove a hcontrol element
  */
-static void add_elem_list(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
+static void add_elem_index(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
+{
+	hctl->count++;
+	if (hctl->count > hctl->hash_size &&
+	    !hash_resize(hctl, hctl->count))
+		return; /* linked the new one, too */
+	if (hctl->hash)
+		hash_link(hctl, elem);
+}
+
+static int add_elem_list(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
 {
-	elem->next = NULL;
-	elem->prev = hctl->last_elem;
-	if (hctl->last_elem)
-		hctl->last_elem->next = elem;
+	snd_hctl_elem_t *next;
+	unsigned int pos;
+	int err;
+
+	err = reserve_elems(hctl, hctl->count + 1);
+	if (err < 0)
+		return err;
+	pos = bisect_elem(hctl, elem);
+	next = pos < hctl->count ? hctl->pelems[pos] : NULL;
+	memmove(hctl->pelems + pos + 1, hctl->pelems + pos,
+		(hctl->count - pos) * sizeof(*hctl->pelems));
+	hctl->pelems[pos] = elem;
+
+	elem->next = next;
+	elem->prev = next ? next->prev : hctl->last_elem;
+	if (elem->prev)
+		elem->prev->next = elem;
 	else
 		hctl->first_elem = elem;
-	hctl->last_elem = elem;
-	hctl->count++;
+	if (next)
+		next->prev = elem;
+	else
+		hctl->last_elem = elem;
+	add_elem_index(hctl, elem);
+	return 0;
 }
 
 static void del_elem_list(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
 {
+	unsigned int pos = find_elem_pos(hctl, elem);
+
+	if (pos < hctl->count)
+		memmove(hctl->pelems + pos, hctl->pelems + pos + 1,
+			(hctl->count - pos - 1) * sizeof(*hctl->pelems));
 	hctl->count--;
+	if (hctl->hash)
+		hash_unlink(hctl, elem);
 	if (elem->prev)
 		elem->prev->next = elem->next;
 	else
@@ -127,9 +438,13 @@ static void del_elem_list(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
 
 static int snd_hctl_elem_add(snd_hctl_t *hctl, snd_hctl_elem_t *elem)
 {
+	int err;
+
 	if (snd_hctl_find_elem(hctl, &elem->id))
 		return -EBUSY;
-	add_elem_list(hctl, elem);
+	err = add_elem_list(hctl, elem);
+	if (err < 0)
+		return err;
 	return snd_hctl_throw_event(hctl, SND_CTL_EVENT_MASK_ADD, elem);
 }
 
@@ -138,7 +453,13 @@ static void snd_hctl_elem_remove(snd_hctl_t *hctl,
 {
 	del_elem_list(hctl, elem);
 	snd_hctl_elem_throw_event(elem, SND_CTL_EVENT_MASK_REMOVE);
-	free(elem);
+#if SALSA_HAS_HCTL_CACHE_SUPPORT
+	free(elem->cache);
+#endif
+	/* the loaded ones are released together at snd_hctl_free() */
+	if (!hctl->arena || elem < hctl->arena ||
+	    elem >= hctl->arena + hctl->arena_count)
+		free(elem);
 }
 
 /*
@@ -148,13 +469,20 @@ int snd_hctl_free(snd_hctl_t *hctl)
 {
 	while (hctl->last_elem)
 		snd_hctl_elem_remove(hctl, hctl->last_elem);
+	hash_free(hctl);
+	free(hctl->pelems);
+	hctl->pelems = NULL;
+	hctl->alloc = 0;
+	free(hctl->arena);
+	hctl->arena = NULL;
+	hctl->arena_count = 0;
 	return 0;
 }
 
-/* placeholder */
-int snd_hctl_compare_fast(const snd_hctl_elem_t *c1,
-			  const snd_hctl_elem_t *c2)
+int snd_hctl_set_compare(snd_hctl_t *hctl, snd_hctl_compare_t compare)
 {
+	hctl->compare = compare ? compare : snd_hctl_compare_default;
+	sort_elems(hctl);
 	return 0;
 }
 
@@ -162,23 +490,97 @@ snd_hctl_elem_t *snd_hctl_find_elem(snd_hctl_t *hctl,
 				    const snd_ctl_elem_id_t *id)
 {
 	snd_hctl_elem_t *elem;
-	for (elem = hctl->first_elem; elem; elem = elem->next) {
-		if (elem->id.iface == id->iface &&
-		    elem->id.index == id->index &&
-		    !strcmp((char *)elem->id.name, (char *)id->name))
-			return elem;
+	unsigned int mask;
+
+	if (!hctl->hash) {
+		if (hctl->compare == snd_hctl_compare_default)
+			return find_sorted(hctl, id);
+		for (elem = hctl->first_elem; elem; elem = elem->next)
+			if (elem_id_match(elem, id))
+				return elem;
+		return NULL;
+	}
+	mask = hctl->hash_size - 1;
+	/* the ids from the kernel events carry numid; take the cheap way */
+	if (id->numid) {
+		for (elem = hctl->numid_hash[id->numid & mask]; elem;
+		     elem = elem->numid_next)
+			if (elem->id.numid == id->numid) {
+				if (elem_id_match(elem, id))
+					return elem;
+				break;
+			}
 	}
+	for (elem = hctl->hash[elem_id_hash(id) & mask]; elem;
+	     elem = elem->hash_next)
+		if (elem_id_match(elem, id))
+			return elem;
 	return NULL;
 }
 
+#define HCTL_LIST_PREALLOC	128
+
+/* append the elements of the loaded list, then index and sort them
+ * all at once
+ */
+static int load_elems(snd_hctl_t *hctl, const snd_ctl_elem_id_t *ids,
+		      unsigned int count)
+{
+	snd_hctl_elem_t *elem, *arena = NULL;
+	unsigned int idx, first;
+	int err;
+
+	err = reserve_elems(hctl, hctl->count + count);
+	if (err < 0)
+		return err;
+	/* all elements in one block, unless loaded again without free */
+	if (!hctl->arena && count) {
+		hctl->arena = calloc(count, sizeof(*hctl->arena));
+		if (!hctl->arena)
+			return -ENOMEM;
+		hctl->arena_count = count;
+		arena = hctl->arena;
+	}
+	/* append all in the kernel order, then sort once */
+	first = hctl->count;
+	for (idx = 0; idx < count; idx++) {
+		if (arena) {
+			elem = arena++;
+		} else {
+			elem = calloc(1, sizeof(*elem));
+			if (!elem) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+		elem->id = ids[idx];
+		elem->hctl = hctl;
+		hctl->pelems[hctl->count++] = elem;
+	}
+	/* a growing table is rebuilt from the list, which doesn't have
+	 * the new ones until sorted; so link them here by hand.  Without
+	 * the table, the lookup falls back to pelems[] or the list.
+	 */
+	if (hash_resize(hctl, hctl->count) < 0)
+		hash_free(hctl);
+	if (hctl->hash)
+		for (idx = first; idx < hctl->count; idx++)
+			hash_link(hctl, hctl->pelems[idx]);
+	sort_elems(hctl);
+	return err;
+}
+
 int snd_hctl_load(snd_hctl_t *hctl)
 {
 	snd_ctl_elem_list_t list;
-	int err = 0;
-	unsigned int idx;
 	snd_hctl_elem_t *elem;
+	int err = 0;
 
 	memset(&list, 0, sizeof(list));
+	/* large enough for most cards to get the whole list at once */
+	err = snd_ctl_elem_list_alloc_space(&list, HCTL_LIST_PREALLOC);
+	if (err < 0)
+		goto _end;
 	err = snd_ctl_elem_list(hctl->ctl, &list);
 	if (err < 0)
 		goto _end;
@@ -190,18 +592,14 @@ int snd_hctl_load(snd_hctl_t *hctl)
 		if (err < 0)
 			goto _end;
 	}
-	for (idx = 0; idx < list.count; idx++) {
-		elem = calloc(1, sizeof(*elem));
-		if (!elem) {
-			err = -ENOMEM;
-			goto _end;
-		}
-		elem->id = list.pids[idx];
-		elem->hctl = hctl;
-		add_elem_list(hctl, elem);
-	}
-	for (elem = hctl->first_elem; elem; elem = elem->next)
-		snd_hctl_throw_event(hctl, SND_CTL_EVENT_MASK_ADD, elem);
+	err = load_elems(hctl, list.pids, list.count);
+	if (err < 0)
+		goto _end;
+	if (hctl->load_callback)
+		hctl->load_callback(hctl, hctl->pelems, hctl->count);
+	else
+		for (elem = hctl->first_elem; elem; elem = elem->next)
+			snd_hctl_throw_event(hctl, SND_CTL_EVENT_MASK_ADD, elem);
 	err = snd_ctl_subscribe_events(hctl->ctl, 1);
  _end:
 	snd_ctl_elem_list_free_space(&list);
@@ -210,6 +608,108 @@ int snd_hctl_load(snd_hctl_t *hctl)
 	return err;
 }
 
+/*
+ * value cache
+ *
+ * The value read at first is kept until a value change event for the
+ * element is handled, or the element is written.  The volatile
+ * elements change without notification, so they're never cached.
+ */
+#if SALSA_HAS_HCTL_CACHE_SUPPORT
+enum {
+	CACHE_UNKNOWN,		/* not checked yet whether volatile */
+	CACHE_INVALID,
+	CACHE_VALID,
+	CACHE_VOLATILE,
+};
+
+static void cache_check_volatile(snd_hctl_elem_t *elem)
+{
+	snd_ctl_elem_info_t info;
+
+	memzero_valgrind(&info, sizeof(info));
+	info.id = elem->id;
+	if (snd_ctl_elem_info(elem->hctl->ctl, &info) < 0 ||
+	    snd_ctl_elem_info_is_volatile(&info))
+		elem->cache_state = CACHE_VOLATILE;
+	else
+		elem->cache_state = CACHE_INVALID;
+}
+
+int snd_hctl_elem_read(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value)
+{
+	snd_hctl_t *hctl = elem->hctl;
+	int err;
+
+	if (!hctl->value_cache) {
+		value->id = elem->id;
+		return snd_ctl_elem_read(hctl->ctl, value);
+	}
+	if (elem->cache_state == CACHE_VALID) {
+		hctl->cache_hits++;
+		*value = *elem->cache;
+		return 0;
+	}
+	hctl->cache_misses++;
+	if (elem->cache_state == CACHE_UNKNOWN)
+		cache_check_volatile(elem);
+	value->id = elem->id;
+	err = snd_ctl_elem_read(hctl->ctl, value);
+	if (err < 0 || elem->cache_state == CACHE_VOLATILE)
+		return err;
+	if (!elem->cache) {
+		elem->cache = malloc(sizeof(*elem->cache));
+		if (!elem->cache)
+			return 0;
+	}
+	*elem->cache = *value;
+	elem->cache_state = CACHE_VALID;
+	return 0;
+}
+
+int snd_hctl_elem_write(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value)
+{
+	/* the driver may adjust the written value; read it again */
+	if (elem->cache_state == CACHE_VALID)
+		elem->cache_state = CACHE_INVALID;
+	value->id = elem->id;
+	return snd_ctl_elem_write(elem->hctl->ctl, value);
+}
+
+static void cache_invalidate(snd_hctl_elem_t *elem, unsigned int mask)
+{
+	if (mask & SND_CTL_EVENT_MASK_INFO)
+		elem->cache_state = CACHE_UNKNOWN;
+	else if (elem->cache_state == CACHE_VALID)
+		elem->cache_state = CACHE_INVALID;
+}
+
+void snd_hctl_set_value_cache(snd_hctl_t *hctl, int enable)
+{
+	snd_hctl_elem_t *elem;
+
+	hctl->value_cache = enable;
+	if (enable)
+		return;
+	for (elem = hctl->first_elem; elem; elem = elem->next) {
+		free(elem->cache);
+		elem->cache = NULL;
+		elem->cache_state = CACHE_UNKNOWN;
+	}
+}
+
+void snd_hctl_get_value_cache_stats(snd_hctl_t *hctl, unsigned long *hits,
+				    unsigned long *misses)
+{
+	if (hits)
+		*hits = hctl->cache_hits;
+	if (misses)
+		*misses = hctl->cache_misses;
+}
+#else
+#define cache_invalidate(elem, mask)	do { } while (0)
+#endif /* SALSA_HAS_HCTL_CACHE_SUPPORT */
+
 static int snd_hctl_handle_event(snd_hctl_t *hctl, snd_ctl_event_t *event)
 {
 	snd_hctl_elem_t *elem;
@@ -239,6 +739,7 @@ static int snd_hctl_handle_event(snd_hctl_t *hctl, snd_ctl_event_t *event)
 		elem = snd_hctl_find_elem(hctl, &event->data.elem.id);
 		if (!elem)
 			return -ENOENT;
+		cache_invalidate(elem, event->data.elem.mask);
 		err = snd_hctl_elem_throw_event(elem, event->data.elem.mask &
 						(SND_CTL_EVENT_MASK_VALUE |
 						 SND_CTL_EVENT_MASK_INFO));
@@ -248,21 +749,77 @@ static int snd_hctl_handle_event(snd_hctl_t *hctl, snd_ctl_event_t *event)
 	return 0;
 }
 
+/*
+ * The events are read in arrays, and VALUE / INFO events for the same
+ * element within a batch are merged into the first one, so that a burst
+ * of changes (e.g. a scene recall) costs a few reads and one callback
+ * per element.
+ */
+#define HCTL_EVENT_BATCH	32
+#define EVENT_MERGED		(-1)	/* event type of a merged event */
+#define EVENT_MERGEABLE		(SND_CTL_EVENT_MASK_VALUE | \
+				 SND_CTL_EVENT_MASK_INFO)
+
+static inline int event_mergeable(const snd_ctl_event_t *ev)
+{
+	return ev->type == SND_CTL_EVENT_ELEM &&
+		!(ev->data.elem.mask & ~EVENT_MERGEABLE);
+}
+
+static void coalesce_events(snd_ctl_event_t *events, unsigned int count)
+{
+	unsigned int i, j;
+
+	for (i = 1; i < count; i++) {
+		snd_ctl_event_t *ev = &events[i];
+
+		if (!event_mergeable(ev))
+			continue;
+		/* the latest event for the same element decides */
+		for (j = i; j-- > 0; ) {
+			snd_ctl_event_t *prev = &events[j];
+
+			if (prev->type != SND_CTL_EVENT_ELEM ||
+			    prev->data.elem.id.numid != ev->data.elem.id.numid)
+				continue;
+			if (event_mergeable(prev)) {
+				prev->data.elem.mask |= ev->data.elem.mask;
+				ev->type = EVENT_MERGED;
+			}
+			break;
+		}
+	}
+}
+
 int snd_hctl_handle_events(snd_hctl_t *hctl)
 {
-	snd_ctl_event_t event;
-	int res;
-	unsigned int count = 0;
-	
-	while ((res = snd_ctl_read(hctl->ctl, &event)) != 0) {
-		if (res == -EAGAIN)
+	snd_ctl_event_t events[HCTL_EVENT_BATCH];
+	ssize_t res;
+	unsigned int i, n, count = 0;
+	int err;
+
+	for (;;) {
+		res = read(hctl->ctl->fd, events, sizeof(events));
+		if (res < 0) {
+			if (errno == EAGAIN)
+				break;
+			return -errno;
+		}
+		n = res / sizeof(*events);
+		if (!n)
+			break;
+		coalesce_events(events, n);
+		for (i = 0; i < n; i++) {
+			if (events[i].type == EVENT_MERGED)
+				continue;
+			err = snd_hctl_handle_event(hctl, &events[i]);
+			if (err < 0)
+				return err;
+		}
+		count += n;
+		/* a short read means that the queue got empty */
+		if (n < HCTL_EVENT_BATCH)
 			break;
-		else if (res < 0)
-			return res;
-		res = snd_hctl_handle_event(hctl, &event);
-		if (res < 0)
-			return res;
-		count++;
 	}
 	return count;
 }
@@ -17,6 +17,10 @@ typedef int (*snd_hctl_callback_t)(snd_hctl_t *hctl,
 				   snd_hctl_elem_t *elem);
 typedef int (*snd_hctl_elem_callback_t)(snd_hctl_elem_t *elem,
 					unsigned int mask);
+/* called once at load with all elements, instead of ADD per element */
+typedef int (*snd_hctl_load_callback_t)(snd_hctl_t *hctl,
+					snd_hctl_elem_t **elems,
+					unsigned int count);
 
 #if SALSA_CHECK_ABI
 int _snd_hctl_open(snd_hctl_t **hctl, const char *name, int mode,
@@ -29,4 +33,13 @@ int snd_hctl_close(snd_hctl_t *hctl);
 snd_hctl_elem_t *snd_hctl_find_elem(snd_hctl_t *hctl, const snd_ctl_elem_id_t *id);
 int snd_hctl_load(snd_hctl_t *hctl);
 int snd_hctl_free(snd_hctl_t *hctl);
+int snd_hctl_set_compare(snd_hctl_t *hctl, snd_hctl_compare_t compare);
 int snd_hctl_handle_events(snd_hctl_t *hctl);
+
+#if SALSA_HAS_HCTL_CACHE_SUPPORT
+int snd_hctl_elem_read(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value);
+int snd_hctl_elem_write(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value);
+void snd_hctl_set_value_cache(snd_hctl_t *hctl, int enable);
+void snd_hctl_get_value_cache_stats(snd_hctl_t *hctl, unsigned long *hits,
+				    unsigned long *misses);
+#endif
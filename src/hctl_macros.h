@@ -21,6 +21,21 @@ struct _snd_hctl {
 	snd_hctl_elem_t *first_elem;
 	snd_hctl_elem_t *last_elem;
 	unsigned int count;
+	snd_hctl_compare_t compare;
+	snd_hctl_elem_t **pelems;	/* sorted by compare */
+	unsigned int alloc;
+	/* lookup index: by (iface, name, index) and by numid */
+	snd_hctl_elem_t **hash;
+	snd_hctl_elem_t **numid_hash;
+	unsigned int hash_size;		/* power of two */
+	snd_hctl_elem_t *arena;		/* elements allocated at load */
+	unsigned int arena_count;
+	snd_hctl_load_callback_t load_callback;
+#if SALSA_HAS_HCTL_CACHE_SUPPORT
+	int value_cache;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+#endif
 };
 
 struct _snd_hctl_elem {
@@ -31,6 +46,12 @@ struct _snd_hctl_elem {
 	void *callback_private;
 	snd_hctl_elem_t *prev;
 	snd_hctl_elem_t *next;
+	snd_hctl_elem_t *hash_next;
+	snd_hctl_elem_t *numid_next;
+#if SALSA_HAS_HCTL_CACHE_SUPPORT
+	snd_ctl_elem_value_t *cache;	/* allocated at the first read */
+	unsigned char cache_state;
+#endif
 };
 
 
@@ -66,12 +87,6 @@ int snd_hctl_nonblock(snd_hctl_t *hctl, int nonblock)
 	return snd_ctl_nonblock(hctl->ctl, nonblock);
 }
 
-__SALSA_EXPORT_FUNC
-int snd_hctl_set_compare(snd_hctl_t *hctl, snd_hctl_compare_t compare)
-{
-	return 0;
-}
-
 __SALSA_EXPORT_FUNC
 int snd_hctl_poll_descriptors_count(snd_hctl_t *hctl)
 {
@@ -96,6 +111,13 @@ void snd_hctl_set_callback(snd_hctl_t *hctl, snd_hctl_callback_t callback)
 	hctl->callback = callback;
 }
 
+__SALSA_EXPORT_FUNC
+void snd_hctl_set_load_callback(snd_hctl_t *hctl,
+				snd_hctl_load_callback_t callback)
+{
+	hctl->load_callback = callback;
+}
+
 __SALSA_EXPORT_FUNC
 void snd_hctl_set_callback_private(snd_hctl_t *hctl, void *callback_private)
 {
@@ -127,6 +149,7 @@ int snd_hctl_elem_info(snd_hctl_elem_t *elem, snd_ctl_elem_info_t *info)
 	return snd_ctl_elem_info(elem->hctl->ctl, info);
 }
 
+#if !SALSA_HAS_HCTL_CACHE_SUPPORT
 __SALSA_EXPORT_FUNC
 int snd_hctl_elem_read(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value)
 {
@@ -140,6 +163,7 @@ int snd_hctl_elem_write(snd_hctl_elem_t *elem, snd_ctl_elem_value_t *value)
 	value->id = elem->id;
 	return snd_ctl_elem_write(elem->hctl->ctl, value);
 }
+#endif
 
 #if SALSA_HAS_TLV_SUPPORT
 __SALSA_EXPORT_FUNC
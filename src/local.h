@@ -11,6 +11,162 @@ int _snd_open_subdev(const char *filename, int fmode,
 int _snd_pcm_mmap(snd_pcm_t *pcm);
 int _snd_pcm_munmap(snd_pcm_t *pcm);
 
+#ifdef __ALSA_PCM_H_INC
+#if SALSA_HAS_PLUG_SUPPORT
+struct snd_pcm_rate;
+
+struct snd_pcm_plug {
+	snd_pcm_format_t hw_format;	/* format of the hw ring buffer */
+	snd_pcm_access_t hw_access;	/* access of the hw ring buffer */
+	unsigned int hw_sample_bits;
+	unsigned int convert:1;		/* hw setup differs from the app */
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	unsigned int hw_rate;
+	snd_pcm_uframes_t hw_period_size;
+	snd_pcm_uframes_t hw_buffer_size;
+	struct snd_pcm_rate *rate;	/* rate converter, if hw_rate differs */
+	snd_pcm_sw_params_t hw_sw_params;	/* sw_params in hw frames */
+#endif
+};
+
+int _snd_pcm_plug_format_supported(snd_pcm_format_t format);
+void _snd_pcm_plug_load(int32_t *dst, const unsigned char *src, int step,
+			unsigned int n, snd_pcm_format_t format);
+void _snd_pcm_plug_store(unsigned char *dst, int step, int32_t *src,
+			 unsigned int n, snd_pcm_format_t format);
+snd_pcm_format_t _snd_pcm_plug_choose_format(snd_pcm_format_t format,
+					     const snd_mask_t *hw_formats);
+int _snd_pcm_plug_convert_areas(const snd_pcm_channel_area_t *dst_areas,
+				snd_pcm_uframes_t dst_offset,
+				snd_pcm_format_t dst_format,
+				const snd_pcm_channel_area_t *src_areas,
+				snd_pcm_uframes_t src_offset,
+				snd_pcm_format_t src_format,
+				unsigned int channels,
+				snd_pcm_uframes_t frames);
+
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+/* PCM_PLUG_RATE_{MIN,MAX}: the app rates accepted for the conversion */
+#define PCM_PLUG_RATE_MIN	4000
+#define PCM_PLUG_RATE_MAX	192000
+
+int _snd_pcm_rate_open(struct snd_pcm_rate **ratep, unsigned int channels,
+		       unsigned int in_rate, unsigned int out_rate);
+void _snd_pcm_rate_close(struct snd_pcm_rate *rate);
+void _snd_pcm_rate_reset(struct snd_pcm_rate *rate);
+long _snd_pcm_rate_pending(const struct snd_pcm_rate *rate);
+void _snd_pcm_rate_convert(struct snd_pcm_rate *rate,
+			   const snd_pcm_channel_area_t *dst_areas,
+			   snd_pcm_uframes_t dst_offset,
+			   snd_pcm_format_t dst_format,
+			   snd_pcm_uframes_t *dst_frames,
+			   const snd_pcm_channel_area_t *src_areas,
+			   snd_pcm_uframes_t src_offset,
+			   snd_pcm_format_t src_format,
+			   snd_pcm_uframes_t *src_frames);
+#endif
+
+#define pcm_plug_convert(pcm)	((pcm)->plug && (pcm)->plug->convert)
+#define pcm_hw_format(pcm) \
+	(pcm_plug_convert(pcm) ? (pcm)->plug->hw_format : (pcm)->format)
+#define pcm_hw_sample_bits(pcm) \
+	(pcm_plug_convert(pcm) ? (pcm)->plug->hw_sample_bits : (pcm)->sample_bits)
+#define pcm_hw_access(pcm) \
+	(pcm_plug_convert(pcm) ? (pcm)->plug->hw_access : (pcm)->_access)
+#else
+#define pcm_plug_convert(pcm)	0
+#define pcm_hw_format(pcm)	(pcm)->format
+#define pcm_hw_sample_bits(pcm)	(pcm)->sample_bits
+#define pcm_hw_access(pcm)	(pcm)->_access
+#endif /* SALSA_HAS_PLUG_SUPPORT */
+
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+#define pcm_plug_rate(pcm)	((pcm)->plug && (pcm)->plug->rate)
+#define pcm_hw_buffer_size(pcm) \
+	(pcm_plug_rate(pcm) ? (pcm)->plug->hw_buffer_size : (pcm)->buffer_size)
+#define pcm_hw_period_size(pcm) \
+	(pcm_plug_rate(pcm) ? (pcm)->plug->hw_period_size : (pcm)->period_size)
+#define pcm_hw_sw_params(pcm) \
+	(pcm_plug_rate(pcm) ? &(pcm)->plug->hw_sw_params : &(pcm)->sw_params)
+/* convert frames between the app and the hw rates, rounding down */
+#define pcm_app_frames(pcm, frames) \
+	(pcm_plug_rate(pcm) ? \
+	 (snd_pcm_uframes_t)((unsigned long long)(frames) * (pcm)->rate / \
+			     (pcm)->plug->hw_rate) : (snd_pcm_uframes_t)(frames))
+#define pcm_hw_frames(pcm, frames) \
+	(pcm_plug_rate(pcm) ? \
+	 (snd_pcm_uframes_t)((unsigned long long)(frames) * \
+			     (pcm)->plug->hw_rate / (pcm)->rate) : \
+	 (snd_pcm_uframes_t)(frames))
+#else
+#define pcm_plug_rate(pcm)	0
+#define pcm_hw_buffer_size(pcm)	(pcm)->buffer_size
+#define pcm_hw_period_size(pcm)	(pcm)->period_size
+#define pcm_hw_sw_params(pcm)	(&(pcm)->sw_params)
+#define pcm_app_frames(pcm, frames)	(frames)
+#define pcm_hw_frames(pcm, frames)	(frames)
+#endif /* SALSA_HAS_PLUG_RATE_SUPPORT */
+
+snd_pcm_uframes_t _snd_pcm_boundary(snd_pcm_uframes_t buffer_size);
+
+#if SALSA_HAS_DMIX_SUPPORT
+struct snd_pcm_dmix;
+
+/* hw setup shared by all dmix clients */
+struct snd_pcm_dmix_setup {
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+};
+
+int _snd_pcm_dmix_open(struct snd_pcm_dmix **dmixp, const char *filename,
+		       snd_pcm_stream_t stream, int card, int dev);
+void _snd_pcm_dmix_close(struct snd_pcm_dmix *dmix);
+const struct snd_pcm_dmix_setup *_snd_pcm_dmix_setup(snd_pcm_t *pcm);
+int _snd_pcm_dmix_hw_refine(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
+int _snd_pcm_dmix_mmap(snd_pcm_t *pcm);
+void _snd_pcm_dmix_munmap(snd_pcm_t *pcm);
+int _snd_pcm_dmix_wait(snd_pcm_t *pcm, int timeout);
+void _snd_pcm_dmix_mix_areas(uint64_t *sum,
+			     const snd_pcm_channel_area_t *dst_areas,
+			     snd_pcm_uframes_t dst_offset,
+			     const snd_pcm_channel_area_t *src_areas,
+			     snd_pcm_uframes_t src_offset,
+			     unsigned int channels,
+			     snd_pcm_uframes_t frames,
+			     snd_pcm_format_t format,
+			     uint32_t lap);
+
+#define pcm_dmix(pcm)		((pcm)->dmix != NULL)
+#else
+#define pcm_dmix(pcm)		0
+#endif /* SALSA_HAS_DMIX_SUPPORT */
+
+#if SALSA_HAS_STATS_SUPPORT
+void _snd_pcm_stats_wakeup(snd_pcm_t *pcm, snd_pcm_sframes_t avail);
+void _snd_pcm_stats_xfer(snd_pcm_t *pcm, snd_pcm_uframes_t frames);
+int _snd_pcm_stats_error(snd_pcm_t *pcm, int err);
+
+#define pcm_stats_wakeup(pcm, avail)	_snd_pcm_stats_wakeup(pcm, avail)
+#define pcm_stats_xfer(pcm, frames)	_snd_pcm_stats_xfer(pcm, frames)
+#define pcm_stats_error(pcm, err)	_snd_pcm_stats_error(pcm, err)
+#else
+#define pcm_stats_wakeup(pcm, avail)	do { } while (0)
+#define pcm_stats_xfer(pcm, frames)	do { } while (0)
+#define pcm_stats_error(pcm, err)	(err)
+#endif /* SALSA_HAS_STATS_SUPPORT */
+
+#if SALSA_HAS_REFINE_CACHE_SUPPORT
+void _snd_pcm_refine_cache_check(snd_pcm_t *pcm);
+void _snd_pcm_refine_cache_flush(snd_pcm_t *pcm);
+#else
+#define _snd_pcm_refine_cache_check(pcm)	do { } while (0)
+#define _snd_pcm_refine_cache_flush(pcm)	do { } while (0)
+#endif /* SALSA_HAS_REFINE_CACHE_SUPPORT */
+#endif /* __ALSA_PCM_H_INC */
+
 #ifdef DELIGHT_VALGRIND
 #define memzero_valgrind(buf, size)	memset(buf, 0, size)
 #else
@@ -32,6 +32,8 @@
 
 static int hctl_event_handler(snd_hctl_t *hctl, unsigned int mask,
 			      snd_hctl_elem_t *elem);
+static int hctl_load_handler(snd_hctl_t *hctl, snd_hctl_elem_t **elems,
+			     unsigned int count);
 
 #if SALSA_CHECK_ABI
 int _snd_mixer_open(snd_mixer_t **mixerp, int mode, unsigned int magic)
@@ -73,6 +75,7 @@ int snd_mixer_attach_hctl(snd_mixer_t *mixer, snd_hctl_t *hctl)
 	if (err < 0)
 		goto error;
 	snd_hctl_set_callback(hctl, hctl_event_handler);
+	snd_hctl_set_load_callback(hctl, hctl_load_handler);
 	snd_hctl_set_callback_private(hctl, mixer);
 	mixer->hctl = hctl;
 	return 0;
@@ -175,9 +178,11 @@ static int add_mixer_elem(snd_mixer_elem_t *elem, snd_mixer_t *mixer)
 		mixer->alloc = num;
 	}
 	mixer->pelems[mixer->count] = elem;
+	elem->index = mixer->count;
 	mixer->count++;
+	if (mixer->loading)
+		return 0; /* sorted and notified at the end of the load */
 	snd_mixer_sort(mixer);
-
 	return snd_mixer_throw_event(mixer, SND_CTL_EVENT_MASK_ADD, elem);
 }
 
@@ -261,6 +266,40 @@ static int hctl_event_handler(snd_hctl_t *hctl, unsigned int mask,
 	return 0;
 }
 
+/* add all elements at load, sort once at the end, and then notify
+ * the new ones in the sorted order, complete with all their controls
+ */
+static int hctl_load_handler(snd_hctl_t *hctl, snd_hctl_elem_t **elems,
+			     unsigned int count)
+{
+	snd_mixer_t *mixer = snd_hctl_get_callback_private(hctl);
+	snd_mixer_elem_t **added;
+	unsigned int i;
+	int first, err;
+
+	first = mixer->count;
+	mixer->loading = 1;
+	for (i = 0; i < count; i++)
+		hctl_event_handler(hctl, SND_CTL_EVENT_MASK_ADD, elems[i]);
+	mixer->loading = 0;
+
+	/* the new ones were appended; sort them like the whole list */
+	count = mixer->count - first;
+	added = alloca(sizeof(*added) * count);
+	memcpy(added, mixer->pelems + first, sizeof(*added) * count);
+	snd_mixer_sort(mixer);
+	if (mixer->compare)
+		qsort(added, count, sizeof(*added),
+		      (int (*)(const void*, const void *))mixer->compare);
+	for (i = 0; i < count; i++) {
+		err = snd_mixer_throw_event(mixer, SND_CTL_EVENT_MASK_ADD,
+					    added[i]);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
 
 /*
  */
@@ -21,6 +21,7 @@ struct _snd_mixer {
 	unsigned int events;
 	snd_mixer_callback_t callback;
 	void *callback_private;
+	int loading;		/* defer sorting during snd_mixer_load() */
 };
 
 typedef struct _snd_selem_item_head {
@@ -19,13 +19,17 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <alloca.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include "pcm.h"
@@ -36,6 +40,8 @@
  */
 static int snd_pcm_hw_mmap_status(snd_pcm_t *pcm);
 static void snd_pcm_hw_munmap_status(snd_pcm_t *pcm);
+static void *pcm_rt_calloc(snd_pcm_t *pcm, size_t nmemb, size_t size);
+static void pcm_rt_free(snd_pcm_t *pcm, void *ptr, size_t nmemb, size_t size);
 
 /*
  * open/close
@@ -62,11 +68,43 @@ int snd_pcm_open(snd_pcm_t **pcmp, const char *name,
 	int card, dev, subdev;
 	int fd, err, fmode, ver;
 	snd_pcm_t *pcm = NULL;
+#if SALSA_HAS_PLUG_SUPPORT
+	int plug = 0;
+#endif
+	int is_dmix = 0;
+#if SALSA_HAS_DMIX_SUPPORT
+	struct snd_pcm_dmix *dmix = NULL;
+#endif
 
 	check_incompatible_abi(magic, SALSA_PCM_MAGIC);
 
 	*pcmp = NULL;
 
+#if SALSA_HAS_PLUG_SUPPORT
+	/* plughw is hw with the format conversion */
+	if (!strcmp(name, "plughw") || !strncmp(name, "plughw:", 7)) {
+		name += 4;
+		plug = 1;
+	}
+#endif
+#if SALSA_HAS_DMIX_SUPPORT
+	/* dmix:x,y mixes the playback streams on hw:x,y, and
+	 * dsnoop:x,y shares its capture stream
+	 */
+	if (!strcmp(name, "dmix") || !strncmp(name, "dmix:", 5)) {
+		if (stream != SND_PCM_STREAM_PLAYBACK)
+			return -EINVAL;
+		snprintf(filename, sizeof(filename), "hw%s", name + 4);
+		name = filename;
+		is_dmix = 1;
+	} else if (!strcmp(name, "dsnoop") || !strncmp(name, "dsnoop:", 7)) {
+		if (stream != SND_PCM_STREAM_CAPTURE)
+			return -EINVAL;
+		snprintf(filename, sizeof(filename), "hw%s", name + 6);
+		name = filename;
+		is_dmix = 1;
+	}
+#endif
 	err = _snd_dev_get_device(name, &card, &dev, &subdev);
 	if (err < 0)
 		return err;
@@ -78,6 +116,14 @@ int snd_pcm_open(snd_pcm_t **pcmp, const char *name,
 	if (mode & SND_PCM_ASYNC)
 		fmode |= O_ASYNC;
 
+#if SALSA_HAS_DMIX_SUPPORT
+	if (is_dmix) {
+		fd = _snd_pcm_dmix_open(&dmix, filename, stream, card, dev);
+		if (fd < 0)
+			return fd;
+		subdev = get_pcm_subdev(fd);
+	} else
+#endif
 	if (subdev >= 0) {
 		fd = _snd_open_subdev(filename, fmode, card, subdev,
 				      SNDRV_CTL_IOCTL_PCM_PREFER_SUBDEVICE);
@@ -97,7 +143,7 @@ int snd_pcm_open(snd_pcm_t **pcmp, const char *name,
 			return -EBUSY;
 		}
 	}
-	if (!(mode & SND_PCM_NONBLOCK)) {
+	if (!(mode & SND_PCM_NONBLOCK) && !is_dmix) {
 		fmode &= ~O_NONBLOCK;
 		fcntl(fd, F_SETFL, fmode);
 	}
@@ -123,6 +169,7 @@ int snd_pcm_open(snd_pcm_t **pcmp, const char *name,
 
 	pcm->card = card;
 	pcm->stream = stream;
+	pcm->mode = mode;
 	pcm->device = dev;
 	pcm->subdevice = subdev;
 	pcm->protocol = ver;
@@ -131,6 +178,35 @@ int snd_pcm_open(snd_pcm_t **pcmp, const char *name,
 	pcm->pollfd.events =
 		(stream == SND_PCM_STREAM_PLAYBACK ? POLLOUT : POLLIN)
 		| POLLERR | POLLNVAL;
+	pcm->timer_fd = -1;
+
+#if SALSA_HAS_PLUG_SUPPORT
+	if (plug) {
+		pcm->plug = calloc(1, sizeof(*pcm->plug));
+		if (!pcm->plug) {
+			err = -ENOMEM;
+			goto error;
+		}
+		pcm->type = SND_PCM_TYPE_PLUG;
+	}
+#endif
+#if SALSA_HAS_DMIX_SUPPORT
+	if (dmix) {
+		/* the status and control records are virtual */
+		pcm->sync_ptr = pcm_rt_calloc(pcm, 1, sizeof(*pcm->sync_ptr));
+		if (!pcm->sync_ptr) {
+			err = -errno;
+			goto error;
+		}
+		pcm->mmap_status = &pcm->sync_ptr->s.status;
+		pcm->mmap_control = &pcm->sync_ptr->c.control;
+		pcm->mmap_status->state = SND_PCM_STATE_OPEN;
+		pcm->mmap_control->avail_min = 1;
+		pcm->dmix = dmix;
+		pcm->type = stream == SND_PCM_STREAM_PLAYBACK ?
+			SND_PCM_TYPE_DMIX : SND_PCM_TYPE_DSNOOP;
+	}
+#endif
 
 	err = snd_pcm_hw_mmap_status(pcm);
 	if (err < 0)
@@ -140,6 +216,19 @@ int snd_pcm_open(snd_pcm_t **pcmp, const char *name,
 	return 0;
 
  error:
+#if SALSA_HAS_PLUG_SUPPORT
+	if (pcm)
+		free(pcm->plug);
+#endif
+#if SALSA_HAS_DMIX_SUPPORT
+	if (pcm)
+		pcm_rt_free(pcm, pcm->sync_ptr, 1, sizeof(*pcm->sync_ptr));
+	if (dmix) {
+		free(pcm);
+		_snd_pcm_dmix_close(dmix);
+		return err;
+	}
+#endif
 	free(pcm);
 	close(fd);
 	return err;
@@ -156,8 +245,21 @@ int snd_pcm_close(snd_pcm_t *pcm)
 #if SALSA_HAS_ASYNC_SUPPORT
 	if (pcm->async)
 		snd_async_del_handler(pcm->async);
+#endif
+#if SALSA_HAS_DMIX_SUPPORT
+	if (pcm->dmix)
+		_snd_pcm_dmix_close(pcm->dmix);
+	else
 #endif
 	close(pcm->fd);
+	if (pcm->timer_fd >= 0)
+		close(pcm->timer_fd);
+#if SALSA_HAS_PLUG_SUPPORT
+	free(pcm->plug);
+#endif
+#if SALSA_HAS_HW_BATCH_SUPPORT
+	snd_pcm_hw_params_batch_abort(pcm);
+#endif
 	free(pcm);
 	return 0;
 }	
@@ -171,9 +273,9 @@ static int correct_pcm_error(snd_pcm_t *pcm, int err)
 {
 	switch (snd_pcm_state(pcm)) {
 	case SND_PCM_STATE_XRUN:
-		return -EPIPE;
+		return pcm_stats_error(pcm, -EPIPE);
 	case SND_PCM_STATE_SUSPENDED:
-		return -ESTRPIPE;
+		return pcm_stats_error(pcm, -ESTRPIPE);
 	case SND_PCM_STATE_DISCONNECTED:
 		return -ENODEV;
 	default:
@@ -185,7 +287,7 @@ static inline int snd_pcm_check_error(snd_pcm_t *pcm, int err)
 {
 	if (err == -EINTR)
 		return correct_pcm_error(pcm, err);
-	return err;
+	return pcm_stats_error(pcm, err);
 }
 
 snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer,
@@ -193,14 +295,17 @@ snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer,
 {
 	struct snd_xferi xferi;
 
+	if (pcm_plug_convert(pcm) || pcm_dmix(pcm))
+		return snd_pcm_mmap_writei(pcm, buffer, size);
 #ifdef DELIGHT_VALGRIND
 	xferi.result = 0;
 #endif
 	xferi.buf = (char*) buffer;
 	xferi.frames = size;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_WRITEI_FRAMES, &xferi) < 0)
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_WRITEI_FRAMES, &xferi) < 0)
 		return snd_pcm_check_error(pcm, -errno);
-	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+	_snd_pcm_appl_moved(pcm);
+	pcm_stats_xfer(pcm, xferi.result);
 	return xferi.result;
 }
 
@@ -209,14 +314,17 @@ snd_pcm_sframes_t snd_pcm_writen(snd_pcm_t *pcm, void **bufs,
 {
 	struct snd_xfern xfern;
 
+	if (pcm_plug_convert(pcm) || pcm_dmix(pcm))
+		return snd_pcm_mmap_writen(pcm, bufs, size);
 #ifdef DELIGHT_VALGRIND
 	xfern.result = 0;
 #endif
 	xfern.bufs = bufs;
 	xfern.frames = size;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_WRITEN_FRAMES, &xfern) < 0)
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_WRITEN_FRAMES, &xfern) < 0)
 		return snd_pcm_check_error(pcm, -errno);
-	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+	_snd_pcm_appl_moved(pcm);
+	pcm_stats_xfer(pcm, xfern.result);
 	return xfern.result;
 }
 
@@ -225,14 +333,17 @@ snd_pcm_sframes_t snd_pcm_readi(snd_pcm_t *pcm, void *buffer,
 {
 	struct snd_xferi xferi;
 
+	if (pcm_plug_convert(pcm) || pcm_dmix(pcm))
+		return snd_pcm_mmap_readi(pcm, buffer, size);
 #ifdef DELIGHT_VALGRIND
 	xferi.result = 0;
 #endif
 	xferi.buf = buffer;
 	xferi.frames = size;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_READI_FRAMES, &xferi) < 0)
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_READI_FRAMES, &xferi) < 0)
 		return snd_pcm_check_error(pcm, -errno);
-	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+	_snd_pcm_appl_moved(pcm);
+	pcm_stats_xfer(pcm, xferi.result);
 	return xferi.result;
 }
 
@@ -241,14 +352,17 @@ snd_pcm_sframes_t snd_pcm_readn(snd_pcm_t *pcm, void **bufs,
 {
 	struct snd_xfern xfern;
 
+	if (pcm_plug_convert(pcm) || pcm_dmix(pcm))
+		return snd_pcm_mmap_readn(pcm, bufs, size);
 #ifdef DELIGHT_VALGRIND
 	xfern.result = 0;
 #endif
 	xfern.bufs = bufs;
 	xfern.frames = size;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_READN_FRAMES, &xfern) < 0)
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_READN_FRAMES, &xfern) < 0)
 		return snd_pcm_check_error(pcm, -errno);
-	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+	_snd_pcm_appl_moved(pcm);
+	pcm_stats_xfer(pcm, xfern.result);
 	return xfern.result;
 }
 
@@ -487,6 +601,11 @@ int snd_pcm_dump_hw_setup(snd_pcm_t *pcm, snd_output_t *out)
 			  snd_pcm_access_name(pcm->_access));
 	snd_output_printf(out, "  format       : %s\n",
 			  snd_pcm_format_name(pcm->format));
+#if SALSA_HAS_PLUG_SUPPORT
+	if (pcm_plug_convert(pcm))
+		snd_output_printf(out, "  hw format    : %s\n",
+				  snd_pcm_format_name(pcm->plug->hw_format));
+#endif
 	snd_output_printf(out, "  subformat    : %s\n",
 			  snd_pcm_subformat_name(pcm->subformat));
 	snd_output_printf(out, "  channels     : %u\n", pcm->channels);
@@ -499,6 +618,16 @@ int snd_pcm_dump_hw_setup(snd_pcm_t *pcm, snd_output_t *out)
 	snd_output_printf(out, "  buffer_size  : %lu\n", pcm->buffer_size);
 	snd_output_printf(out, "  period_size  : %lu\n", pcm->period_size);
 	snd_output_printf(out, "  period_time  : %u\n", pcm->period_time);
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm_plug_rate(pcm)) {
+		snd_output_printf(out, "  hw rate      : %u\n",
+				  pcm->plug->hw_rate);
+		snd_output_printf(out, "  hw buffer_size : %lu\n",
+				  pcm->plug->hw_buffer_size);
+		snd_output_printf(out, "  hw period_size : %lu\n",
+				  pcm->plug->hw_period_size);
+	}
+#endif
 #if 0 /* deprecated */
 	snd_output_printf(out, "  tick_time    : %u\n", pcm->tick_time);
 #endif
@@ -577,6 +706,95 @@ int snd_pcm_dump(snd_pcm_t *pcm, snd_output_t *out)
  * SILENCE AND COPY AREAS
  */
 
+/* strided copy with a fixed sample size; the constant-size memcpy()
+ * is expanded to a single (unaligned-safe) load/store per sample
+ */
+#define DEFINE_AREA_COPY(bytes)						\
+static void area_copy_##bytes(char *dst, int dst_step,			\
+			      const char *src, int src_step,		\
+			      unsigned int samples)			\
+{									\
+	for (; samples >= 4; samples -= 4) {				\
+		memcpy(dst, src, bytes);				\
+		memcpy(dst + dst_step, src + src_step, bytes);		\
+		memcpy(dst + dst_step * 2, src + src_step * 2, bytes);	\
+		memcpy(dst + dst_step * 3, src + src_step * 3, bytes);	\
+		src += src_step * 4;					\
+		dst += dst_step * 4;					\
+	}								\
+	while (samples-- > 0) {						\
+		memcpy(dst, src, bytes);				\
+		src += src_step;					\
+		dst += dst_step;					\
+	}								\
+}
+
+DEFINE_AREA_COPY(1)
+DEFINE_AREA_COPY(2)
+DEFINE_AREA_COPY(3)
+DEFINE_AREA_COPY(4)
+DEFINE_AREA_COPY(8)
+
+#undef DEFINE_AREA_COPY
+
+static void area_copy_bytes(char *dst, int dst_step,
+			    const char *src, int src_step,
+			    unsigned int bytes, unsigned int samples)
+{
+	switch (bytes) {
+	case 1:
+		area_copy_1(dst, dst_step, src, src_step, samples);
+		break;
+	case 2:
+		area_copy_2(dst, dst_step, src, src_step, samples);
+		break;
+	case 3:
+		area_copy_3(dst, dst_step, src, src_step, samples);
+		break;
+	case 4:
+		area_copy_4(dst, dst_step, src, src_step, samples);
+		break;
+	case 8:
+		area_copy_8(dst, dst_step, src, src_step, samples);
+		break;
+	default:
+		while (samples-- > 0) {
+			memcpy(dst, src, bytes);
+			src += src_step;
+			dst += dst_step;
+		}
+		break;
+	}
+}
+
+/* count the channels from the head which are packed next to each other
+ * in the same buffer on both sides, so that they can be copied together
+ * as one block per frame
+ */
+static unsigned int areas_contiguous(const snd_pcm_channel_area_t *dst_areas,
+				     const snd_pcm_channel_area_t *src_areas,
+				     unsigned int channels, unsigned int width)
+{
+	unsigned int c;
+
+	if (!dst_areas->addr || !src_areas->addr ||
+	    (dst_areas->first | dst_areas->step) % 8 ||
+	    (src_areas->first | src_areas->step) % 8)
+		return 1;
+	for (c = 1; c < channels; c++) {
+		if (dst_areas[c].addr != dst_areas->addr ||
+		    src_areas[c].addr != src_areas->addr ||
+		    dst_areas[c].step != dst_areas->step ||
+		    src_areas[c].step != src_areas->step ||
+		    dst_areas[c].first != dst_areas[c - 1].first + width ||
+		    src_areas[c].first != src_areas[c - 1].first + width)
+			break;
+	}
+	if (c * width > dst_areas->step || c * width > src_areas->step)
+		return 1;
+	return c;
+}
+
 #if SALSA_SUPPORT_4BIT_PCM
 static int area_silence_4bit(const snd_pcm_channel_area_t *dst_area,
 			     snd_pcm_uframes_t dst_offset,
@@ -615,6 +833,7 @@ int snd_pcm_area_silence(const snd_pcm_channel_area_t *dst_area,
 {
 	char *dst;
 	unsigned int dst_step;
+	u_int64_t silence;
 	int width;
 
 	if (!dst_area->addr)
@@ -627,11 +846,13 @@ int snd_pcm_area_silence(const snd_pcm_channel_area_t *dst_area,
 		snd_pcm_format_set_silence(format, dst, samples);
 		return 0;
 	}
+	/* store the sample pattern with the stride; the source step 0
+	 * makes the strided copy repeat the same pattern
+	 */
+	silence = snd_pcm_format_silence_64(format);
 	dst_step = dst_area->step / 8;
-	while (samples-- > 0) {
-		snd_pcm_format_set_silence(format, dst, 1);
-		dst += dst_step;
-	}
+	area_copy_bytes(dst, dst_step, (const char *)&silence, 0,
+			width / 8, samples);
 	return 0;
 }
 
@@ -640,10 +861,28 @@ int snd_pcm_areas_silence(const snd_pcm_channel_area_t *dst_areas,
 			  unsigned int channels, snd_pcm_uframes_t frames,
 			  snd_pcm_format_t format)
 {
+	int width = snd_pcm_format_physical_width(format);
+
 	while (channels > 0) {
-		snd_pcm_area_silence(dst_areas, dst_offset, frames, format);
-		dst_areas++;
-		channels--;
+		unsigned int chns = 1;
+
+		/* interleaved channels covering whole frames are filled
+		 * at once
+		 */
+		if (width >= 8 && !(width % 8))
+			chns = areas_contiguous(dst_areas, dst_areas,
+						channels, width);
+		if (chns > 1 && dst_areas->step == chns * width)
+			snd_pcm_format_set_silence(format,
+				snd_pcm_channel_area_addr(dst_areas, dst_offset),
+				frames * chns);
+		else {
+			snd_pcm_area_silence(dst_areas, dst_offset, frames,
+					     format);
+			chns = 1;
+		}
+		dst_areas += chns;
+		channels -= chns;
 	}
 	return 0;
 }
@@ -734,12 +973,7 @@ int snd_pcm_area_copy(const snd_pcm_channel_area_t *dst_area,
 	}
 	src_step = src_area->step / 8;
 	dst_step = dst_area->step / 8;
-	width /= 8;
-	while (samples-- > 0) {
-		memcpy(dst, src, width);
-		src += src_step;
-		dst += dst_step;
-	}
+	area_copy_bytes(dst, dst_step, src, src_step, width / 8, samples);
 	return 0;
 }
 
@@ -750,17 +984,46 @@ int snd_pcm_areas_copy(const snd_pcm_channel_area_t *dst_areas,
 		       unsigned int channels, snd_pcm_uframes_t frames,
 		       snd_pcm_format_t format)
 {
+	int width;
+
 	if (!channels)
 		return -EINVAL;
 	if (!frames)
 		return -EINVAL;
+	width = snd_pcm_format_physical_width(format);
 	while (channels > 0) {
-		snd_pcm_area_copy(dst_areas, dst_offset,
-				  src_areas, src_offset,
-				  frames, format);
-		src_areas++;
-		dst_areas++;
-		channels--;
+		unsigned int chns = 1;
+		unsigned int bytes;
+		const char *src;
+		char *dst;
+
+		if (width >= 8 && !(width % 8))
+			chns = areas_contiguous(dst_areas, src_areas,
+						channels, width);
+		if (chns == 1) {
+			snd_pcm_area_copy(dst_areas, dst_offset,
+					  src_areas, src_offset,
+					  frames, format);
+			goto next;
+		}
+		if (src_areas == dst_areas && src_offset == dst_offset)
+			goto next;
+
+		/* copy the whole channel group frame by frame in one pass */
+		src = snd_pcm_channel_area_addr(src_areas, src_offset);
+		dst = snd_pcm_channel_area_addr(dst_areas, dst_offset);
+		bytes = chns * width / 8;
+		if (src_areas->step == chns * width &&
+		    dst_areas->step == chns * width)
+			memcpy(dst, src, frames * bytes);
+		else
+			area_copy_bytes(dst, dst_areas->step / 8,
+					src, src_areas->step / 8,
+					bytes, frames);
+	next:
+		src_areas += chns;
+		dst_areas += chns;
+		channels -= chns;
 	}
 	return 0;
 }
@@ -780,60 +1043,213 @@ static size_t page_align(size_t size)
 	return size;
 }
 
-int _snd_pcm_mmap(snd_pcm_t *pcm)
+#if SALSA_HAS_RT_SUPPORT
+#define pcm_rt(pcm)	((pcm)->mode & SND_PCM_RT_PREFAULT)
+#else
+#define pcm_rt(pcm)	0
+#endif
+
+/* In the realtime mode, everything touched while streaming is
+ * populated and locked at setup, so that the stream loop takes no
+ * page faults.  The small records get their own locked pages instead
+ * of sharing (and unlocking) the heap pages with others.  On failure,
+ * NULL is returned with errno set, e.g. EPERM or EAGAIN from mlock().
+ */
+static void *pcm_rt_calloc(snd_pcm_t *pcm, size_t nmemb, size_t size)
 {
+	void *ptr;
+
+	if (!pcm_rt(pcm))
+		return calloc(nmemb, size);
+	size = page_align(nmemb * size);
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	if (mlock(ptr, size) < 0) {
+		int err = errno;
+		munmap(ptr, size);
+		errno = err;
+		return NULL;
+	}
+	return ptr;
+}
+
+static void pcm_rt_free(snd_pcm_t *pcm, void *ptr, size_t nmemb, size_t size)
+{
+	if (!pcm_rt(pcm))
+		free(ptr);
+	else if (ptr)
+		munmap(ptr, page_align(nmemb * size));
+}
+
+/* mmap a PCM record; populated and locked in the realtime mode */
+static void *pcm_rt_mmap(snd_pcm_t *pcm, size_t size, int prot, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, prot, MAP_FILE | MAP_SHARED |
+		   (pcm_rt(pcm) ? MAP_POPULATE : 0), pcm->fd, offset);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	if (pcm_rt(pcm) && mlock(ptr, size) < 0) {
+		int err = errno;
+		munmap(ptr, size);
+		errno = err;
+		return NULL;
+	}
+	return ptr;
+}
+
+#if SALSA_HAS_RT_SUPPORT
+/* page fault counts of the calling thread (or the process if the
+ * per-thread usage isn't available); compare two readings around the
+ * stream loop to verify that it doesn't fault
+ */
+int snd_pcm_rt_get_faults(unsigned long *minor, unsigned long *major)
+{
+	struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+	if (getrusage(RUSAGE_THREAD, &ru) < 0)
+#else
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+#endif
+		return -errno;
+	if (minor)
+		*minor = ru.ru_minflt;
+	if (major)
+		*major = ru.ru_majflt;
+	return 0;
+}
+#endif
+
+/* bits of the mmap area covered by the given channel */
+static size_t channel_map_bits(snd_pcm_t *pcm, const snd_pcm_channel_info_t *i)
+{
+	return i->info.first + (size_t)i->info.step *
+		(pcm_hw_buffer_size(pcm) - 1) + pcm_hw_sample_bits(pcm);
+}
+
+/* the usual interleaved layout can be told from the first channel
+ * alone; all channels share a single mapping then
+ */
+static int mmap_interleaved(snd_pcm_t *pcm)
+{
+	snd_pcm_channel_info_t *i = pcm->mmap_channels;
+	unsigned int bits = pcm_hw_sample_bits(pcm);
 	unsigned int c;
 
+	switch (pcm_hw_access(pcm)) {
+	case SND_PCM_ACCESS_MMAP_INTERLEAVED:
+	case SND_PCM_ACCESS_RW_INTERLEAVED:
+		break;
+	default:
+		return 0;
+	}
+	if (i->info.first || i->info.step != bits * pcm->channels)
+		return 0;
+	for (c = 1; c < pcm->channels; c++) {
+		i[c].info = i->info;
+		i[c].info.channel = c;
+		i[c].info.first = c * bits;
+	}
+	return 1;
+}
+
+/* group the channels sharing the same offset; owner[c] is set to the
+ * first channel of the group.  A small open-addressing hash keeps it
+ * linear even with a hundred channels or more.
+ */
+static void mmap_group_channels(snd_pcm_t *pcm, unsigned int *owner)
+{
+	unsigned int c, h, mask, nslots;
+	int *slots;
+
+	for (nslots = 4; nslots < pcm->channels * 2; nslots <<= 1)
+		;
+	mask = nslots - 1;
+	slots = alloca(sizeof(*slots) * nslots);
+	memset(slots, 0xff, sizeof(*slots) * nslots);
+	for (c = 0; c < pcm->channels; c++) {
+		long offset = pcm->mmap_channels[c].info.offset;
+
+		h = ((unsigned long)offset * 2654435761UL) >> 8;
+		for (;; h++) {
+			int o = slots[h & mask];
+			if (o < 0) {
+				slots[h & mask] = c;
+				owner[c] = c;
+				break;
+			}
+			if (pcm->mmap_channels[o].info.offset == offset) {
+				owner[c] = o;
+				break;
+			}
+		}
+	}
+}
+
+int _snd_pcm_mmap(snd_pcm_t *pcm)
+{
+	unsigned int c, *owner;
+	int err;
+
 	/* clear first */
 	_snd_pcm_munmap(pcm);
 
-	pcm->mmap_channels = calloc(pcm->channels, sizeof(*pcm->mmap_channels));
+	pcm->mmap_channels = pcm_rt_calloc(pcm, pcm->channels,
+					   sizeof(*pcm->mmap_channels));
 	if (!pcm->mmap_channels)
-		return -ENOMEM;
-	pcm->running_areas = calloc(pcm->channels, sizeof(*pcm->running_areas));
+		return -errno;
+	pcm->running_areas = pcm_rt_calloc(pcm, pcm->channels,
+					   sizeof(*pcm->running_areas));
 	if (!pcm->running_areas) {
-		free(pcm->mmap_channels);
+		err = -errno;
+		pcm_rt_free(pcm, pcm->mmap_channels, pcm->channels,
+			    sizeof(*pcm->mmap_channels));
 		pcm->mmap_channels = NULL;
-		return -ENOMEM;
+		return err;
 	}
+#if SALSA_HAS_DMIX_SUPPORT
+	if (pcm->dmix)
+		return _snd_pcm_dmix_mmap(pcm);
+#endif
+	owner = alloca(sizeof(*owner) * pcm->channels);
 	for (c = 0; c < pcm->channels; ++c) {
 		snd_pcm_channel_info_t *i = &pcm->mmap_channels[c];
 		i->info.channel = c;
-		if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_CHANNEL_INFO, &i->info) < 0)
+		if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_CHANNEL_INFO,
+				      &i->info) < 0)
 			return -errno;
+		if (!c && mmap_interleaved(pcm)) {
+			memset(owner, 0, sizeof(*owner) * pcm->channels);
+			goto grouped;
+		}
+	}
+	mmap_group_channels(pcm, owner);
+
+ grouped:
+	/* the mapped size of a group covers all its channels */
+	for (c = 0; c < pcm->channels; ++c) {
+		snd_pcm_channel_info_t *o = &pcm->mmap_channels[owner[c]];
+		size_t bits = channel_map_bits(pcm, &pcm->mmap_channels[c]);
+		if (bits > o->size)
+			o->size = bits;
 	}
 	for (c = 0; c < pcm->channels; ++c) {
 		snd_pcm_channel_info_t *i = &pcm->mmap_channels[c];
 		snd_pcm_channel_area_t *a = &pcm->running_areas[c];
-		char *ptr;
-		size_t size;
-		unsigned int c1;
-		if (i->addr)
+		if (owner[c] != c) {
+			i->addr = pcm->mmap_channels[owner[c]].addr;
 			goto copy;
-                size = i->info.first + i->info.step * (pcm->buffer_size - 1) +
-			pcm->sample_bits;
-		for (c1 = c + 1; c1 < pcm->channels; ++c1) {
-			snd_pcm_channel_info_t *i1 = &pcm->mmap_channels[c1];
-			size_t s;
-			if (i1->info.offset != i->info.offset)
-				continue;
-			s = i1->info.first + i1->info.step *
-				(pcm->buffer_size - 1) + pcm->sample_bits;
-			if (s > size)
-				size = s;
 		}
-		size = (size + 7) / 8;
-		size = page_align(size);
-		ptr = mmap(NULL, size, PROT_READ|PROT_WRITE,
-			   MAP_FILE|MAP_SHARED, pcm->fd, i->info.offset);
-		if (ptr == MAP_FAILED)
+		i->size = page_align((i->size + 7) / 8);
+		i->addr = pcm_rt_mmap(pcm, i->size, PROT_READ|PROT_WRITE,
+				      i->info.offset);
+		if (!i->addr) {
+			i->size = 0;
 			return -errno;
-		i->addr = ptr;
-		for (c1 = c + 1; c1 < pcm->channels; ++c1) {
-			snd_pcm_channel_info_t *i1 = &pcm->mmap_channels[c1];
-			if (i1->info.offset != i->info.offset)
-				continue;
-			i1->addr = i->addr;
 		}
 	copy:
 		a->addr = i->addr;
@@ -845,7 +1261,6 @@ int _snd_pcm_mmap(snd_pcm_t *pcm)
 
 int _snd_pcm_munmap(snd_pcm_t *pcm)
 {
-	int err;
 	unsigned int c;
 
 	if (!pcm->mmap_channels)
@@ -853,32 +1268,19 @@ int _snd_pcm_munmap(snd_pcm_t *pcm)
 
 	for (c = 0; c < pcm->channels; ++c) {
 		snd_pcm_channel_info_t *i = &pcm->mmap_channels[c];
-		unsigned int c1;
-		size_t size;
-		if (!i->addr)
-			continue;
-		size = i->info.first + i->info.step *
-			(pcm->buffer_size - 1) + pcm->sample_bits;
-		for (c1 = c + 1; c1 < pcm->channels; ++c1) {
-			snd_pcm_channel_info_t *i1 = &pcm->mmap_channels[c1];
-			size_t s;
-			if (i1->addr != i->addr)
-				continue;
-			i1->addr = NULL;
-			s = i1->info.first + i1->info.step *
-				(pcm->buffer_size - 1) + pcm->sample_bits;
-			if (s > size)
-				size = s;
-		}
-		size = (size + 7) / 8;
-		size = page_align(size);
-		err = munmap(i->addr, size);
-		if (err < 0)
+		if (i->addr && i->size && munmap(i->addr, i->size) < 0)
 			return -errno;
 		i->addr = NULL;
+		i->size = 0;
 	}
-	free(pcm->mmap_channels);
-	free(pcm->running_areas);
+#if SALSA_HAS_DMIX_SUPPORT
+	if (pcm->dmix)
+		_snd_pcm_dmix_munmap(pcm);
+#endif
+	pcm_rt_free(pcm, pcm->mmap_channels, pcm->channels,
+		    sizeof(*pcm->mmap_channels));
+	pcm_rt_free(pcm, pcm->running_areas, pcm->channels,
+		    sizeof(*pcm->running_areas));
 	pcm->mmap_channels = NULL;
 	pcm->running_areas = NULL;
 	return 0;
@@ -890,19 +1292,13 @@ static int snd_pcm_hw_mmap_status(snd_pcm_t *pcm)
 		return 0;
 
 	pcm->mmap_status =
-		mmap(NULL, page_align(sizeof(struct snd_pcm_mmap_status)),
-		     PROT_READ, MAP_FILE|MAP_SHARED, 
-		     pcm->fd, SNDRV_PCM_MMAP_OFFSET_STATUS);
-	if (pcm->mmap_status == MAP_FAILED)
-		pcm->mmap_status = NULL;
+		pcm_rt_mmap(pcm, page_align(sizeof(struct snd_pcm_mmap_status)),
+			    PROT_READ, SNDRV_PCM_MMAP_OFFSET_STATUS);
 	if (!pcm->mmap_status)
 		goto no_mmap;
 	pcm->mmap_control =
-		mmap(NULL, page_align(sizeof(struct snd_pcm_mmap_control)),
-		     PROT_READ|PROT_WRITE, MAP_FILE|MAP_SHARED, 
-		     pcm->fd, SNDRV_PCM_MMAP_OFFSET_CONTROL);
-	if (pcm->mmap_control == MAP_FAILED)
-		pcm->mmap_control = NULL;
+		pcm_rt_mmap(pcm, page_align(sizeof(struct snd_pcm_mmap_control)),
+			    PROT_READ|PROT_WRITE, SNDRV_PCM_MMAP_OFFSET_CONTROL);
 	if (!pcm->mmap_control) {
 		munmap(pcm->mmap_status,
 		       page_align(sizeof(struct snd_pcm_mmap_status)));
@@ -913,9 +1309,9 @@ static int snd_pcm_hw_mmap_status(snd_pcm_t *pcm)
 	return 0;
 
  no_mmap:
-	pcm->sync_ptr = calloc(1, sizeof(*pcm->sync_ptr));
+	pcm->sync_ptr = pcm_rt_calloc(pcm, 1, sizeof(*pcm->sync_ptr));
 	if (!pcm->sync_ptr)
-		return -ENOMEM;
+		return -errno;
 	pcm->mmap_status = &pcm->sync_ptr->s.status;
 	pcm->mmap_control = &pcm->sync_ptr->c.control;
 	pcm->mmap_control->avail_min = 1;
@@ -926,7 +1322,7 @@ static int snd_pcm_hw_mmap_status(snd_pcm_t *pcm)
 static void snd_pcm_hw_munmap_status(snd_pcm_t *pcm)
 {
 	if (pcm->sync_ptr) {
-		free(pcm->sync_ptr);
+		pcm_rt_free(pcm, pcm->sync_ptr, 1, sizeof(*pcm->sync_ptr));
 		pcm->sync_ptr = NULL;
 	} else {
 		munmap(pcm->mmap_status,
@@ -944,7 +1340,7 @@ static void snd_pcm_hw_munmap_status(snd_pcm_t *pcm)
 static snd_pcm_uframes_t snd_pcm_mmap_playback_avail(snd_pcm_t *pcm)
 {
 	snd_pcm_sframes_t avail;
-	avail = get_hw_ptr(pcm) + pcm->buffer_size - get_appl_ptr(pcm);
+	avail = get_hw_ptr(pcm) + pcm_hw_buffer_size(pcm) - get_appl_ptr(pcm);
 	if (avail < 0)
 		avail += pcm->boundary;
 	else if ((snd_pcm_uframes_t) avail >= pcm->boundary)
@@ -971,40 +1367,77 @@ static snd_pcm_uframes_t snd_pcm_mmap_avail(snd_pcm_t *pcm)
 
 static snd_pcm_sframes_t snd_pcm_mmap_hw_avail(snd_pcm_t *pcm)
 {
-	return pcm->buffer_size - snd_pcm_mmap_avail(pcm);
+	return pcm_hw_buffer_size(pcm) - snd_pcm_mmap_avail(pcm);
 }
 
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+snd_pcm_sframes_t snd_pcm_forwardable(snd_pcm_t *pcm)
+{
+	return pcm_app_frames(pcm, snd_pcm_mmap_avail(pcm));
+}
+
+snd_pcm_sframes_t snd_pcm_rewindable(snd_pcm_t *pcm)
+{
+	return pcm_app_frames(pcm, snd_pcm_mmap_hw_avail(pcm));
+}
+#else
 snd_pcm_sframes_t snd_pcm_forwardable(snd_pcm_t *pcm)
 	__attribute__ ((alias("snd_pcm_mmap_avail")));
 
 snd_pcm_sframes_t snd_pcm_rewindable(snd_pcm_t *pcm)
 	__attribute__ ((alias("snd_pcm_mmap_hw_avail")));
+#endif
 
-snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *pcm)
+static snd_pcm_sframes_t avail_update(snd_pcm_t *pcm, int sync_flags)
 {
 	snd_pcm_uframes_t avail;
 
-	_snd_pcm_sync_ptr(pcm, 0);
+	_snd_pcm_sync_ptr(pcm, sync_flags);
 	avail = snd_pcm_mmap_avail(pcm);
-	switch (snd_pcm_state(pcm)) {
+	/* the state was synced together with the pointers above */
+	if (pcm->sync_ptr)
+		pcm->sync_ptr_saved++;
+	switch ((snd_pcm_state_t) pcm->mmap_status->state) {
 	case SND_PCM_STATE_RUNNING:
-		if (avail >= pcm->sw_params.stop_threshold) {
-			if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_XRUN) < 0)
+		if (avail >= pcm_hw_sw_params(pcm)->stop_threshold) {
+			if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_XRUN, 0) < 0)
 				return -errno;
 			/* everything is ok,
 			 * state == SND_PCM_STATE_XRUN at the moment
 			 */
-			return -EPIPE;
+			return pcm_stats_error(pcm, -EPIPE);
 		}
 		break;
 	case SND_PCM_STATE_XRUN:
-		return -EPIPE;
+		return pcm_stats_error(pcm, -EPIPE);
 	default:
 		break;
 	}
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm_plug_rate(pcm)) {
+		avail = pcm_app_frames(pcm, avail);
+		if (avail > pcm->buffer_size)
+			avail = pcm->buffer_size;
+	}
+#endif
 	return avail;
 }
 
+snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *pcm)
+{
+	return avail_update(pcm, 0);
+}
+
+snd_pcm_sframes_t snd_pcm_avail(snd_pcm_t *pcm)
+{
+	/* SYNC_PTR does hwsync by itself */
+	if (pcm->sync_ptr)
+		pcm->sync_ptr_saved++;
+	else if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_HWSYNC, 0) < 0)
+		return -errno;
+	return avail_update(pcm, SNDRV_PCM_SYNC_PTR_HWSYNC);
+}
+
 int snd_pcm_avail_delay(snd_pcm_t *pcm,
 			snd_pcm_sframes_t *availp,
 			snd_pcm_sframes_t *delayp)
@@ -1031,12 +1464,14 @@ int snd_pcm_mmap_begin(snd_pcm_t *pcm,
 	snd_pcm_uframes_t f;
 	snd_pcm_uframes_t avail;
 
+	if (pcm->appl_stale)
+		_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
 	*areas = pcm->running_areas;
-	*offset = pcm->mmap_control->appl_ptr % pcm->buffer_size;
+	*offset = pcm->mmap_control->appl_ptr % pcm_hw_buffer_size(pcm);
 	avail = snd_pcm_mmap_avail(pcm);
-	if (avail > pcm->buffer_size)
-		avail = pcm->buffer_size;
-	cont = pcm->buffer_size - *offset;
+	if (avail > pcm_hw_buffer_size(pcm))
+		avail = pcm_hw_buffer_size(pcm);
+	cont = pcm_hw_buffer_size(pcm) - *offset;
 	f = *frames;
 	if (f > avail)
 		f = avail;
@@ -1046,20 +1481,309 @@ int snd_pcm_mmap_begin(snd_pcm_t *pcm,
 	return 0;
 }
 
-snd_pcm_sframes_t snd_pcm_mmap_commit(snd_pcm_t *pcm,
-				      snd_pcm_uframes_t offset,
-				      snd_pcm_uframes_t frames)
+/* advance appl_ptr locally; with sync_ptr, the push is left to the
+ * next sync
+ */
+static void mmap_appl_forward(snd_pcm_t *pcm, snd_pcm_uframes_t frames)
 {
-	snd_pcm_uframes_t appl_ptr = pcm->mmap_control->appl_ptr;
-	appl_ptr += frames;
+	snd_pcm_uframes_t appl_ptr;
+
+	if (pcm->appl_stale)
+		_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+	appl_ptr = pcm->mmap_control->appl_ptr + frames;
 	if (appl_ptr >= pcm->boundary)
 		appl_ptr -= pcm->boundary;
 	pcm->mmap_control->appl_ptr = appl_ptr;
+	if (pcm->sync_ptr)
+		pcm->appl_dirty = 1;
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_commit(snd_pcm_t *pcm,
+				      snd_pcm_uframes_t offset,
+				      snd_pcm_uframes_t frames)
+{
+	mmap_appl_forward(pcm, frames);
 	_snd_pcm_sync_ptr(pcm, 0);
+	pcm_stats_xfer(pcm, frames);
 	return frames;
 }
 
 
+/*
+ * MMAP READ/WRITE
+ */
+
+static int mmap_xfer_state_error(snd_pcm_t *pcm, snd_pcm_state_t state)
+{
+	switch (state) {
+	case SND_PCM_STATE_PREPARED:
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_PAUSED:
+		return 0;
+	case SND_PCM_STATE_DRAINING:
+		/* remaining data can still be read out */
+		if (pcm->stream == SND_PCM_STREAM_CAPTURE)
+			return 0;
+		return -EBADFD;
+	case SND_PCM_STATE_XRUN:
+		return pcm_stats_error(pcm, -EPIPE);
+	case SND_PCM_STATE_SUSPENDED:
+		return pcm_stats_error(pcm, -ESTRPIPE);
+	case SND_PCM_STATE_DISCONNECTED:
+		return -ENODEV;
+	default:
+		return -EBADFD;
+	}
+}
+
+static void mmap_xfer_copy(snd_pcm_t *pcm,
+			   const snd_pcm_channel_area_t *dst_areas,
+			   snd_pcm_uframes_t dst_offset,
+			   snd_pcm_format_t dst_format,
+			   const snd_pcm_channel_area_t *src_areas,
+			   snd_pcm_uframes_t src_offset,
+			   snd_pcm_format_t src_format,
+			   snd_pcm_uframes_t frames)
+{
+#if SALSA_HAS_PLUG_SUPPORT
+	if (dst_format != src_format) {
+		_snd_pcm_plug_convert_areas(dst_areas, dst_offset, dst_format,
+					    src_areas, src_offset, src_format,
+					    pcm->channels, frames);
+		return;
+	}
+#endif
+	snd_pcm_areas_copy(dst_areas, dst_offset, src_areas, src_offset,
+			   pcm->channels, frames, dst_format);
+}
+
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+/* transfer up to size app frames through the rate converter;
+ * returns the app frames done, the ring may move without them
+ */
+static snd_pcm_uframes_t mmap_xfer_rate(snd_pcm_t *pcm,
+					const snd_pcm_channel_area_t *areas,
+					snd_pcm_uframes_t xfer,
+					snd_pcm_uframes_t size)
+{
+	snd_pcm_uframes_t done = 0;
+
+	while (done < size) {
+		const snd_pcm_channel_area_t *ring;
+		snd_pcm_uframes_t offset, frames = pcm_hw_buffer_size(pcm);
+		snd_pcm_uframes_t app = size - done;
+
+		snd_pcm_mmap_begin(pcm, &ring, &offset, &frames);
+		if (!frames)
+			break;
+		if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+			_snd_pcm_rate_convert(pcm->plug->rate,
+					      ring, offset, pcm_hw_format(pcm),
+					      &frames,
+					      areas, xfer + done, pcm->format,
+					      &app);
+		else
+			_snd_pcm_rate_convert(pcm->plug->rate,
+					      areas, xfer + done, pcm->format,
+					      &app,
+					      ring, offset, pcm_hw_format(pcm),
+					      &frames);
+		if (!frames && !app)
+			break;
+		mmap_appl_forward(pcm, frames);
+		done += app;
+	}
+	return done;
+}
+#endif /* SALSA_HAS_PLUG_RATE_SUPPORT */
+
+/* transfer between the given user-space areas and the mmap ring buffer;
+ * the user areas are addressed from offset 0
+ */
+static snd_pcm_sframes_t mmap_xfer_areas(snd_pcm_t *pcm,
+					 const snd_pcm_channel_area_t *areas,
+					 snd_pcm_uframes_t size)
+{
+	int playback = pcm->stream == SND_PCM_STREAM_PLAYBACK;
+	snd_pcm_uframes_t xfer = 0;
+	snd_pcm_sframes_t avail;
+	snd_pcm_state_t state;
+	int err = 0;
+
+	if (!pcm->running_areas)
+		return -EBADFD;
+	if (!size)
+		return 0;
+
+	if (!playback && snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED &&
+	    size >= pcm->sw_params.start_threshold) {
+		err = snd_pcm_start(pcm);
+		if (err < 0)
+			return err;
+	}
+
+	while (size > 0) {
+		/* the pending appl_ptr push is merged into this sync */
+		if (pcm->appl_dirty)
+			pcm->sync_ptr_saved++;
+		avail = snd_pcm_avail_update(pcm);
+		if (avail < 0) {
+			err = avail;
+			break;
+		}
+		/* the state was already synced by snd_pcm_avail_update() */
+		state = (snd_pcm_state_t) pcm->mmap_status->state;
+		err = mmap_xfer_state_error(pcm, state);
+		if (err < 0)
+			break;
+
+		if (!avail ||
+		    (state == SND_PCM_STATE_RUNNING &&
+		     (snd_pcm_uframes_t)avail < pcm->sw_params.avail_min &&
+		     (snd_pcm_uframes_t)avail < size)) {
+			/* a stream that isn't started yet won't wake us up */
+			if (state != SND_PCM_STATE_RUNNING &&
+			    state != SND_PCM_STATE_PAUSED) {
+				err = -EAGAIN;
+				break;
+			}
+			if (pcm->mode & SND_PCM_NONBLOCK) {
+				err = -EAGAIN;
+				break;
+			}
+			err = snd_pcm_wait(pcm, -1);
+			if (err < 0)
+				break;
+			continue;
+		}
+
+		if ((snd_pcm_uframes_t)avail > size)
+			avail = size;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+		if (pcm_plug_rate(pcm)) {
+			snd_pcm_uframes_t frames;
+
+			frames = mmap_xfer_rate(pcm, areas, xfer, avail);
+			xfer += frames;
+			size -= frames;
+			avail = 0;
+		}
+#endif
+		/* at most two rounds when wrapping at the buffer end */
+		while (avail > 0) {
+			const snd_pcm_channel_area_t *ring;
+			snd_pcm_uframes_t offset, frames = avail;
+
+			snd_pcm_mmap_begin(pcm, &ring, &offset, &frames);
+			if (!frames)
+				break;
+			if (playback)
+				mmap_xfer_copy(pcm, ring, offset,
+					       pcm_hw_format(pcm),
+					       areas, xfer, pcm->format,
+					       frames);
+			else
+				mmap_xfer_copy(pcm, areas, xfer, pcm->format,
+					       ring, offset, pcm_hw_format(pcm),
+					       frames);
+			/* pushed by the next sync in the loop */
+			mmap_appl_forward(pcm, frames);
+			xfer += frames;
+			size -= frames;
+			avail -= frames;
+		}
+
+		if (playback && state == SND_PCM_STATE_PREPARED &&
+		    (snd_pcm_uframes_t)snd_pcm_mmap_hw_avail(pcm) >=
+		    pcm_hw_sw_params(pcm)->start_threshold) {
+			err = snd_pcm_start(pcm);
+			if (err < 0)
+				break;
+		}
+	}
+
+	if (pcm->appl_dirty)
+		_snd_pcm_sync_ptr(pcm, 0);
+	if (xfer > 0)
+		return xfer;
+	return err;
+}
+
+static void mmap_setup_interleaved_areas(snd_pcm_t *pcm,
+					 snd_pcm_channel_area_t *areas,
+					 void *buffer)
+{
+	unsigned int c;
+
+	for (c = 0; c < pcm->channels; c++) {
+		areas[c].addr = buffer;
+		areas[c].first = c * pcm->sample_bits;
+		areas[c].step = pcm->frame_bits;
+	}
+}
+
+static void mmap_setup_noninterleaved_areas(snd_pcm_t *pcm,
+					    snd_pcm_channel_area_t *areas,
+					    void **bufs)
+{
+	unsigned int c;
+
+	for (c = 0; c < pcm->channels; c++) {
+		areas[c].addr = bufs[c];
+		areas[c].first = 0;
+		areas[c].step = pcm->sample_bits;
+	}
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_writei(snd_pcm_t *pcm, const void *buffer,
+				      snd_pcm_uframes_t size)
+{
+	snd_pcm_channel_area_t *areas;
+
+	if (!pcm->setup)
+		return -EBADFD;
+	areas = alloca(pcm->channels * sizeof(*areas));
+	mmap_setup_interleaved_areas(pcm, areas, (void *)buffer);
+	return mmap_xfer_areas(pcm, areas, size);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_readi(snd_pcm_t *pcm, void *buffer,
+				     snd_pcm_uframes_t size)
+{
+	snd_pcm_channel_area_t *areas;
+
+	if (!pcm->setup)
+		return -EBADFD;
+	areas = alloca(pcm->channels * sizeof(*areas));
+	mmap_setup_interleaved_areas(pcm, areas, buffer);
+	return mmap_xfer_areas(pcm, areas, size);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_writen(snd_pcm_t *pcm, void **bufs,
+				      snd_pcm_uframes_t size)
+{
+	snd_pcm_channel_area_t *areas;
+
+	if (!pcm->setup)
+		return -EBADFD;
+	areas = alloca(pcm->channels * sizeof(*areas));
+	mmap_setup_noninterleaved_areas(pcm, areas, bufs);
+	return mmap_xfer_areas(pcm, areas, size);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_readn(snd_pcm_t *pcm, void **bufs,
+				     snd_pcm_uframes_t size)
+{
+	snd_pcm_channel_area_t *areas;
+
+	if (!pcm->setup)
+		return -EBADFD;
+	areas = alloca(pcm->channels * sizeof(*areas));
+	mmap_setup_noninterleaved_areas(pcm, areas, bufs);
+	return mmap_xfer_areas(pcm, areas, size);
+}
+
+
 #if SALSA_HAS_ASYNC_SUPPORT
 /*
  * async handler
@@ -1082,15 +1806,233 @@ int snd_async_add_pcm_handler(snd_async_handler_t **handlerp, snd_pcm_t *pcm,
 }
 #endif /* SALSA_HAS_ASYNC_SUPPORT */
 
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+/*
+ * RATE CONVERSION
+ */
+
+/* scale a signed hw frame count to the app rate */
+static snd_pcm_sframes_t plug_app_delay(snd_pcm_t *pcm,
+					snd_pcm_sframes_t frames)
+{
+	return (long long)frames * pcm->rate / (long long)pcm->plug->hw_rate;
+}
+
+/* the samples held in the converter count for the delay, too */
+snd_pcm_sframes_t _snd_pcm_plug_delay(snd_pcm_t *pcm, snd_pcm_sframes_t delay)
+{
+	long pending;
+
+	if (!pcm_plug_rate(pcm))
+		return delay;
+	pending = _snd_pcm_rate_pending(pcm->plug->rate);
+	if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+		return plug_app_delay(pcm, delay) + pending;
+	else
+		return plug_app_delay(pcm, delay + pending);
+}
+
+void _snd_pcm_plug_status(snd_pcm_t *pcm, snd_pcm_status_t *status)
+{
+	if (!pcm_plug_rate(pcm))
+		return;
+	status->avail = pcm_app_frames(pcm, status->avail);
+	if (status->avail > pcm->buffer_size)
+		status->avail = pcm->buffer_size;
+	status->avail_max = pcm_app_frames(pcm, status->avail_max);
+	if (status->avail_max > pcm->buffer_size)
+		status->avail_max = pcm->buffer_size;
+	status->delay = _snd_pcm_plug_delay(pcm, status->delay);
+}
+
+void _snd_pcm_plug_reset(snd_pcm_t *pcm)
+{
+	if (pcm_plug_rate(pcm))
+		_snd_pcm_rate_reset(pcm->plug->rate);
+}
+
+/* rewind or forward by whole hw frames; the converter restarts */
+snd_pcm_sframes_t _snd_pcm_plug_move(snd_pcm_t *pcm, snd_pcm_uframes_t frames,
+				     int forward)
+{
+	snd_pcm_uframes_t hw_frames = pcm_hw_frames(pcm, frames);
+
+	if (!hw_frames)
+		return 0;
+	if (_snd_pcm_hw_ioctl(pcm, forward ? SNDRV_PCM_IOCTL_FORWARD :
+			      SNDRV_PCM_IOCTL_REWIND, &hw_frames) < 0)
+		return -errno;
+	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+	_snd_pcm_plug_reset(pcm);
+	return pcm_app_frames(pcm, hw_frames);
+}
+#endif /* SALSA_HAS_PLUG_RATE_SUPPORT */
+
 /*
  * HELPERS
  */
 
-int snd_pcm_wait(snd_pcm_t *pcm, int timeout)
+/*
+ * Without period wakeups, the kernel wakes up a poller only at xrun or
+ * stop, so snd_pcm_wait() sleeps on a timerfd instead.  The timer is
+ * armed at the time when avail reaches avail_min, computed from the
+ * current hw_ptr, its timestamp and the measured hw rate.  When it
+ * fires too early due to the clock drift, it's re-armed for the rest.
+ */
+#define pcm_no_period_wakeup(pcm) \
+	((pcm)->hw_params.flags & SNDRV_PCM_HW_PARAMS_NO_PERIOD_WAKEUP && \
+	 (pcm)->hw_params.info & SNDRV_PCM_INFO_NO_PERIOD_WAKEUP)
+
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+#define pcm_hw_rate(pcm) \
+	(pcm_plug_rate(pcm) ? (pcm)->plug->hw_rate : (pcm)->rate)
+#else
+#define pcm_hw_rate(pcm)	(pcm)->rate
+#endif
+
+static long long pcm_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* update the rate estimate from the hw_ptr moved since the last call */
+static void pcm_timer_measure(snd_pcm_t *pcm, long long nsec)
+{
+	unsigned int rate = pcm_hw_rate(pcm) << 8;
+	snd_pcm_sframes_t frames;
+	long long delta;
+	unsigned long long cur;
+
+	if (!pcm->timer_rate)
+		pcm->timer_rate = rate;
+	frames = pcm->mmap_status->hw_ptr - pcm->timer_ptr;
+	if (frames < 0)
+		frames += pcm->boundary;
+	delta = nsec - pcm->timer_nsec;
+	if (pcm->timer_nsec && delta < 20000000LL) /* too short to measure */
+		return;
+	if (pcm->timer_nsec && delta < 10000000000LL &&
+	    (snd_pcm_uframes_t)frames <= pcm_hw_buffer_size(pcm)) {
+		cur = (unsigned long long)frames * 1000000000ULL * 256 / delta;
+		/* ignore the bogus values, e.g. after a stall */
+		if (cur > rate - rate / 32 && cur < rate + rate / 32)
+			pcm->timer_rate += ((long long)cur -
+					    (long long)pcm->timer_rate) / 8;
+	}
+	pcm->timer_ptr = pcm->mmap_status->hw_ptr;
+	pcm->timer_nsec = nsec;
+}
+
+/* arm the timer for avail_min; returns 1 if already reached */
+static int pcm_timer_arm(snd_pcm_t *pcm)
+{
+	struct itimerspec its;
+	snd_pcm_sframes_t avail;
+	snd_pcm_uframes_t need;
+	snd_htimestamp_t tstamp;
+	long long nsec;
+
+	avail = snd_pcm_avail(pcm);
+	if (avail < 0)
+		return avail;
+	if ((snd_pcm_uframes_t)avail >= pcm->sw_params.avail_min)
+		return 1;
+
+	memset(&its, 0, sizeof(its));
+	if (pcm->mmap_status->state != SND_PCM_STATE_RUNNING &&
+	    pcm->mmap_status->state != SND_PCM_STATE_DRAINING) {
+		/* hw_ptr won't move; disarm and wait for the state change */
+		pcm->timer_nsec = 0;
+		goto set;
+	}
+
+	/* the time when hw_ptr was updated, or now right after hwsync */
+	nsec = 0;
+	if (pcm_hw_sw_params(pcm)->tstamp_mode == SND_PCM_TSTAMP_ENABLE &&
+	    pcm_hw_sw_params(pcm)->tstamp_type ==
+	    SND_PCM_TSTAMP_TYPE_MONOTONIC) {
+		__copy_to_snd_htimestamp(&pcm->mmap_status->tstamp, &tstamp);
+		nsec = (long long)tstamp.tv_sec * 1000000000LL +
+			tstamp.tv_nsec;
+	}
+	if (!nsec)
+		nsec = pcm_timer_now();
+	pcm_timer_measure(pcm, nsec);
+
+	need = pcm_hw_frames(pcm, pcm->sw_params.avail_min - avail);
+	if (!need)
+		need = 1;
+	nsec += (long long)((unsigned long long)need * 1000000000ULL * 256 /
+			    pcm->timer_rate);
+	its.it_value.tv_sec = nsec / 1000000000LL;
+	its.it_value.tv_nsec = nsec % 1000000000LL;
+ set:
+	if (timerfd_settime(pcm->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -errno;
+	return 0;
+}
+
+static int pcm_timer_wait(snd_pcm_t *pcm, int timeout)
+{
+	struct pollfd pfd[2];
+	uint64_t expired;
+	long long end = 0;
+	int err;
+
+	if (pcm->timer_fd < 0) {
+		pcm->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					       TFD_NONBLOCK | TFD_CLOEXEC);
+		if (pcm->timer_fd < 0)
+			return -errno;
+	}
+	if (timeout > 0)
+		end = pcm_timer_now() + timeout * 1000000LL;
+
+	/* the PCM fd is polled only for errors and state changes */
+	pfd[0].fd = pcm->pollfd.fd;
+	pfd[0].events = 0;
+	pfd[1].fd = pcm->timer_fd;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		err = pcm_timer_arm(pcm);
+		if (err)
+			return err < 0 ? correct_pcm_error(pcm, err) : 1;
+		err = poll(pfd, 2, timeout);
+		if (err < 0) {
+			if (errno != EINTR)
+				return -errno;
+		} else if (!err) {
+			return 0;
+		} else {
+			if (pfd[0].revents & (POLLERR | POLLNVAL))
+				return correct_pcm_error(pcm, -EIO);
+			if (pfd[1].revents & POLLIN)
+				read(pcm->timer_fd, &expired, sizeof(expired));
+		}
+
+		/* fired early (or a signal); wait only for the rest */
+		if (timeout > 0) {
+			timeout = (end - pcm_timer_now() + 999999) / 1000000;
+			if (timeout <= 0)
+				return 0;
+		}
+	}
+}
+
+static int pcm_wait(snd_pcm_t *pcm, int timeout)
 {
 	struct pollfd pfd;
 	int err;
 	
+#if SALSA_HAS_DMIX_SUPPORT
+	if (pcm->dmix)
+		return _snd_pcm_dmix_wait(pcm, timeout);
+#endif
+	if (pcm_no_period_wakeup(pcm))
+		return pcm_timer_wait(pcm, timeout);
 #if 0 /* FIXME: NEEDED? */
 	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
 	if (snd_pcm_mmap_avail(pcm) >= pcm->sw_params.avail_min)
@@ -1114,6 +2056,15 @@ int snd_pcm_wait(snd_pcm_t *pcm, int timeout)
 	}
 }
 
+int snd_pcm_wait(snd_pcm_t *pcm, int timeout)
+{
+	int err = pcm_wait(pcm, timeout);
+
+	if (err > 0)
+		pcm_stats_wakeup(pcm, snd_pcm_mmap_avail(pcm));
+	return err;
+}
+
 int snd_pcm_recover(snd_pcm_t *pcm, int err, int silent)
 {
 	if (err > 0)
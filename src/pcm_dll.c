@@ -0,0 +1,262 @@
+/*
+ *  SALSA-Lib - PCM clock-drift estimator
+ *
+ *  A delay-locked loop following the hw_ptr (or the audio timestamp)
+ *  against the system time, for the rate ratio and the hw_ptr
+ *  prediction without syscalls.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pcm.h"
+#include "local.h"
+
+#define DLL_DEFAULT_BANDWIDTH	0.1	/* Hz */
+#define DLL_MAX_DEVIATION	0.05	/* max rate deviation from nominal */
+
+enum {
+	DLL_SRC_HW_PTR,		/* positions from hw_ptr */
+	DLL_SRC_AUDIO_TSTAMP,	/* positions from the audio timestamp */
+};
+
+struct _snd_pcm_dll {
+	snd_pcm_t *pcm;
+	double omega;			/* loop bandwidth in rad/s */
+	double nominal;			/* nominal rate in Hz */
+	double rate;			/* estimated rate in Hz */
+	double pos;			/* estimated frames at nsec */
+	long long nsec;			/* system time of the last update */
+	unsigned long long frames;	/* hw_ptr unwrapped from base */
+	snd_pcm_uframes_t base;		/* hw_ptr at frames = 0 */
+	snd_pcm_uframes_t hw_ptr;	/* last hw_ptr fed */
+	int audio_tstamp_type;		/* -1 for hw_ptr only */
+	int source;			/* DLL_SRC_* */
+	unsigned int locked:1;
+};
+
+int snd_pcm_dll_open(snd_pcm_dll_t **dllp, snd_pcm_t *pcm, double bandwidth)
+{
+	snd_pcm_dll_t *dll;
+
+	*dllp = NULL;
+	if (!pcm->setup)
+		return -EBADFD;
+	if (bandwidth < 0)
+		return -EINVAL;
+	dll = calloc(1, sizeof(*dll));
+	if (!dll)
+		return -ENOMEM;
+	dll->pcm = pcm;
+	if (!bandwidth)
+		bandwidth = DLL_DEFAULT_BANDWIDTH;
+	dll->omega = 2 * 3.14159265358979323846 * bandwidth;
+	dll->audio_tstamp_type = -1;
+	*dllp = dll;
+	return 0;
+}
+
+int snd_pcm_dll_close(snd_pcm_dll_t *dll)
+{
+	free(dll);
+	return 0;
+}
+
+void snd_pcm_dll_reset(snd_pcm_dll_t *dll)
+{
+	dll->locked = 0;
+}
+
+int snd_pcm_dll_set_audio_tstamp_type(snd_pcm_dll_t *dll, int type)
+{
+	if (type >= 0 &&
+	    !snd_pcm_hw_params_supports_audio_ts_type(&dll->pcm->hw_params,
+						      type))
+		return -EINVAL;
+	dll->audio_tstamp_type = type;
+	dll->locked = 0;
+	return 0;
+}
+
+static long long tstamp_nsec(const snd_htimestamp_t *tstamp)
+{
+	return (long long)tstamp->tv_sec * 1000000000LL + tstamp->tv_nsec;
+}
+
+static void dll_start(snd_pcm_dll_t *dll, long long nsec, double pos)
+{
+	dll->nominal = dll->pcm->rate;
+	dll->rate = dll->nominal;
+	dll->pos = pos;
+	dll->nsec = nsec;
+	dll->locked = 1;
+}
+
+/* the second order loop; pos is the observed position in frames */
+static void dll_feed(snd_pcm_dll_t *dll, long long nsec, double pos)
+{
+	double dt, err, w, b;
+
+	if (!dll->locked || dll->nominal != dll->pcm->rate) {
+		dll_start(dll, nsec, pos);
+		return;
+	}
+	if (nsec <= dll->nsec)
+		return; /* no new observation */
+	dt = (nsec - dll->nsec) * 1e-9;
+	err = pos - (dll->pos + dll->rate * dt);
+	if (err > (double)dll->pcm->buffer_size ||
+	    err < -(double)dll->pcm->buffer_size) {
+		/* discontinuity, e.g. xrun or a long stall */
+		dll_start(dll, nsec, pos);
+		return;
+	}
+	w = dll->omega * dt;
+	b = 1.4142135623730951 * w;
+	if (b > 1.0)
+		b = 1.0;
+	dll->pos += dll->rate * dt + b * err;
+	dll->rate += dll->omega * w * err;
+	if (dll->rate > dll->nominal * (1 + DLL_MAX_DEVIATION))
+		dll->rate = dll->nominal * (1 + DLL_MAX_DEVIATION);
+	else if (dll->rate < dll->nominal * (1 - DLL_MAX_DEVIATION))
+		dll->rate = dll->nominal * (1 - DLL_MAX_DEVIATION);
+	dll->nsec = nsec;
+}
+
+static void dll_feed_hw_ptr(snd_pcm_dll_t *dll, long long nsec,
+			    snd_pcm_uframes_t hw_ptr)
+{
+	snd_pcm_sframes_t delta;
+
+	if (!dll->locked || dll->source != DLL_SRC_HW_PTR) {
+		dll->source = DLL_SRC_HW_PTR;
+		dll->locked = 0;
+		dll->base = hw_ptr;
+		dll->frames = 0;
+	} else {
+		delta = hw_ptr - dll->hw_ptr;
+		if (delta < 0)
+			delta += dll->pcm->boundary;
+		dll->frames += delta;
+	}
+	dll->hw_ptr = hw_ptr;
+	dll_feed(dll, nsec, (double)dll->frames);
+}
+
+int snd_pcm_dll_update(snd_pcm_dll_t *dll, const snd_htimestamp_t *tstamp,
+		       snd_pcm_uframes_t hw_ptr)
+{
+	dll_feed_hw_ptr(dll, tstamp_nsec(tstamp), hw_ptr);
+	return 0;
+}
+
+int snd_pcm_dll_update_status(snd_pcm_dll_t *dll)
+{
+	snd_pcm_t *pcm = dll->pcm;
+	snd_pcm_status_t status;
+	snd_pcm_audio_tstamp_config_t config;
+	snd_pcm_audio_tstamp_report_t report;
+	snd_htimestamp_t tstamp;
+	snd_pcm_uframes_t off;
+	long long nsec;
+	double pos;
+	int err;
+
+	memset(&status, 0, sizeof(status));
+	if (dll->audio_tstamp_type >= 0) {
+		config.type_requested = dll->audio_tstamp_type;
+		config.report_delay = 0;
+		snd_pcm_status_set_audio_htstamp_config(&status, &config);
+	}
+	err = snd_pcm_status(pcm, &status);
+	if (err < 0)
+		return err;
+	if (status.state != SND_PCM_STATE_RUNNING &&
+	    status.state != SND_PCM_STATE_DRAINING) {
+		dll->locked = 0;
+		return 0;
+	}
+
+	__copy_to_snd_htimestamp(&status.tstamp, &tstamp);
+	nsec = tstamp_nsec(&tstamp);
+	if (dll->audio_tstamp_type >= 0) {
+		snd_pcm_status_get_audio_htstamp_report(&status, &report);
+		if (report.valid &&
+		    report.actual_type == (unsigned int)dll->audio_tstamp_type) {
+			__copy_to_snd_htimestamp(&status.audio_tstamp, &tstamp);
+			pos = tstamp_nsec(&tstamp) * 1e-9 * pcm->rate;
+			if (!dll->locked || dll->source != DLL_SRC_AUDIO_TSTAMP) {
+				dll->source = DLL_SRC_AUDIO_TSTAMP;
+				dll->locked = 0;
+				/* align the audio time to the hw_ptr */
+				off = (unsigned long long)pos % pcm->boundary;
+				dll->base = status.hw_ptr >= off ?
+					status.hw_ptr - off :
+					status.hw_ptr + pcm->boundary - off;
+			}
+			dll->hw_ptr = status.hw_ptr;
+			dll_feed(dll, nsec, pos);
+			return 1;
+		}
+	}
+	dll_feed_hw_ptr(dll, nsec, status.hw_ptr);
+	return 1;
+}
+
+double snd_pcm_dll_get_rate(snd_pcm_dll_t *dll)
+{
+	return dll->locked ? dll->rate : dll->pcm->rate;
+}
+
+double snd_pcm_dll_get_ratio(snd_pcm_dll_t *dll)
+{
+	return dll->locked ? dll->rate / dll->nominal : 1.0;
+}
+
+static clockid_t dll_clock(snd_pcm_dll_t *dll)
+{
+	switch (dll->pcm->sw_params.tstamp_type) {
+	case SND_PCM_TSTAMP_TYPE_MONOTONIC:
+		return CLOCK_MONOTONIC;
+	case SND_PCM_TSTAMP_TYPE_MONOTONIC_RAW:
+		return CLOCK_MONOTONIC_RAW;
+	default:
+		return CLOCK_REALTIME;
+	}
+}
+
+/* predict hw_ptr at the given time, or now if tstamp is NULL */
+snd_pcm_uframes_t snd_pcm_dll_get_hw_ptr(snd_pcm_dll_t *dll,
+					 const snd_htimestamp_t *tstamp)
+{
+	struct timespec now;
+	double pos;
+
+	if (!dll->locked)
+		return dll->hw_ptr;
+	if (!tstamp) {
+		clock_gettime(dll_clock(dll), &now);
+		tstamp = &now;
+	}
+	pos = dll->pos + dll->rate * (tstamp_nsec(tstamp) - dll->nsec) * 1e-9;
+	if (pos < 0)
+		pos = 0;
+	return (dll->base + (unsigned long long)pos) % dll->pcm->boundary;
+}
@@ -0,0 +1,1515 @@
+/*
+ *  SALSA-Lib - PCM Interface - sharing a device by dmix and dsnoop
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include "pcm.h"
+#include "local.h"
+
+/*
+ * All clients of a device share a single hw PCM without any server
+ * process.  The first client opens and sets up the hw; the others get
+ * the hw fd passed over an abstract unix socket, served by a thread in
+ * each client, so the socket survives as long as any client does.
+ *
+ * Each client writes into a private ring buffer with virtual pointers.
+ * Committed frames are added atomically into a shared sum buffer and
+ * the saturated sum is stored into the hw ring; a client retries the
+ * store until the sum it stored is still current, so the last writer
+ * of a sample always leaves the complete mix behind.  Each 32bit sum
+ * is tagged with the ring lap it belongs to, and both are updated in
+ * one compare-and-swap: the first writer of a new lap replaces the
+ * old sum instead of adding to it, and a writer of an older lap, too
+ * late for the hw, leaves it alone.  So there is no separate clear
+ * racing with the writers.
+ *
+ * The hw runs with the stop threshold at the boundary and its appl_ptr
+ * kept a whole buffer ahead of hw_ptr, so it never stops by itself and
+ * its poll still wakes up once per period.
+ *
+ * dsnoop, the capture side, shares the hw the same way.  There is
+ * nothing to mix: each client keeps only its own appl_ptr on the hw
+ * positions and reads the hw ring in place, mapped read-only, so
+ * snd_pcm_mmap_begin() gives out the hw ring itself.  The hw appl_ptr
+ * follows hw_ptr, so the poll on the shared fd wakes all readers at
+ * each period.
+ */
+
+#define DMIX_IPC_KEY(stream, card, dev) \
+	(0x53400000 | ((stream) << 16) | ((card) << 8) | (dev))
+#define DMIX_IPC_PERM		0600
+#define DMIX_MAGIC		(0x444d4958 + sizeof(long))	/* "DMIX" */
+#define DMIX_SEM_OPEN		0	/* open, close and hw setup */
+#define DMIX_CONNECT_TIMEOUT	2	/* secs */
+
+/* the header of the shared memory */
+struct dmix_shm {
+	unsigned long magic;
+	unsigned int setup;		/* the hw is set up */
+	unsigned int generation;	/* bumped at each hw prepare */
+	struct snd_pcm_dmix_setup params;
+	snd_pcm_uframes_t boundary;
+	int sum_shmid;
+};
+
+struct snd_pcm_dmix {
+	int fd;				/* shared hw PCM */
+	int semid;
+	int shmid;
+	struct dmix_shm *shm;
+	uint64_t *sum;			/* shared accumulation buffer */
+	unsigned int lap_shift;		/* scales the lap count to 32 bits */
+
+	int sock;			/* shared listening socket */
+	int quit[2];			/* stops the server thread */
+	pthread_t server;
+	unsigned int server_running:1;
+
+	/* hw records and ring buffer */
+	struct snd_pcm_mmap_status *hw_status;
+	struct snd_pcm_mmap_control *hw_control;
+	struct snd_pcm_sync_ptr *hw_sync_ptr;	/* if not mmappable */
+	char *hw_buf;
+	size_t hw_buf_size;
+	snd_pcm_channel_area_t *hw_areas;
+
+	/* this client */
+	char *buf;			/* private ring buffer (dmix) */
+	unsigned int generation;
+	snd_pcm_uframes_t hw_ptr;	/* hw position at the last sync */
+	snd_pcm_uframes_t mix_ptr;	/* appl_ptr mixed up to here */
+	snd_pcm_uframes_t slave_ptr;	/* hw position of mix_ptr */
+	snd_pcm_uframes_t pause_ptr;	/* hw position at pause (dsnoop) */
+};
+
+#define dmix_state(pcm)		((pcm)->mmap_status->state)
+#define dmix_capture(pcm)	((pcm)->stream == SND_PCM_STREAM_CAPTURE)
+
+/* ring pointers wrap at the boundary */
+static inline snd_pcm_uframes_t dmix_ptr_diff(snd_pcm_uframes_t a,
+					      snd_pcm_uframes_t b,
+					      snd_pcm_uframes_t boundary)
+{
+	return a >= b ? a - b : a + boundary - b;
+}
+
+static inline snd_pcm_uframes_t dmix_ptr_add(snd_pcm_uframes_t a,
+					     snd_pcm_uframes_t n,
+					     snd_pcm_uframes_t boundary)
+{
+	a += n;
+	if (a >= boundary)
+		a -= boundary;
+	return a;
+}
+
+/*
+ * LOCKS
+ */
+
+static int dmix_lock(struct snd_pcm_dmix *dmix, int num)
+{
+	struct sembuf op[2] = {
+		{ num, 0, 0 },		/* wait for zero */
+		{ num, 1, SEM_UNDO },	/* then take it */
+	};
+
+	while (semop(dmix->semid, op, 2) < 0) {
+		if (errno != EINTR)
+			return -errno;
+	}
+	return 0;
+}
+
+static void dmix_unlock(struct snd_pcm_dmix *dmix, int num)
+{
+	struct sembuf op = { num, -1, SEM_UNDO | IPC_NOWAIT };
+
+	semop(dmix->semid, &op, 1);
+}
+
+/*
+ * SHARING THE HW FD
+ */
+
+static socklen_t dmix_sock_addr(struct sockaddr_un *addr, key_t key)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	/* abstract namespace, no file left behind */
+	snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+		 "salsa-dmix-%08x", (unsigned int)key);
+	return offsetof(struct sockaddr_un, sun_path) + 1 +
+		strlen(addr->sun_path + 1);
+}
+
+static int dmix_listen(key_t key)
+{
+	struct sockaddr_un addr;
+	socklen_t len = dmix_sock_addr(&addr, key);
+	int sock;
+
+	/* non-blocking, as all clients race for each connection */
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+	if (bind(sock, (struct sockaddr *)&addr, len) < 0 ||
+	    listen(sock, 4) < 0) {
+		int err = -errno;
+		close(sock);
+		return err;
+	}
+	return sock;
+}
+
+static int dmix_send_fds(int sock, int *fds)
+{
+	char data = 'D';
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { &data, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+		return -errno;
+	return 0;
+}
+
+static int dmix_recv_fds(int sock, int *fds)
+{
+	char data;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { &data, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+		return errno ? -errno : -EPIPE;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+		return -EPROTO;
+	memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+	return 0;
+}
+
+/* get the hw fd and the listening socket from a running client */
+static int dmix_connect(key_t key, int *fds)
+{
+	struct sockaddr_un addr;
+	socklen_t len = dmix_sock_addr(&addr, key);
+	struct timeval tv = { DMIX_CONNECT_TIMEOUT, 0 };
+	int sock, err;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(sock, (struct sockaddr *)&addr, len) < 0)
+		err = -errno;
+	else
+		err = dmix_recv_fds(sock, fds);
+	close(sock);
+	return err;
+}
+
+static void *dmix_server(void *arg)
+{
+	struct snd_pcm_dmix *dmix = arg;
+	struct pollfd pfds[2];
+	sigset_t mask;
+	int fds[2] = { dmix->fd, dmix->sock };
+	int sock;
+
+	/* leave the signals to the app threads */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pfds[0].fd = dmix->sock;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = dmix->quit[0];
+	pfds[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[1].revents || (pfds[0].revents & (POLLERR | POLLNVAL)))
+			break;
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+		/* another client may have taken it already */
+		sock = accept(dmix->sock, NULL, NULL);
+		if (sock < 0)
+			continue;
+		dmix_send_fds(sock, fds);
+		close(sock);
+	}
+	return NULL;
+}
+
+static int dmix_start_server(struct snd_pcm_dmix *dmix)
+{
+	int err;
+
+	if (pipe(dmix->quit) < 0)
+		return -errno;
+	fcntl(dmix->quit[0], F_SETFD, FD_CLOEXEC);
+	fcntl(dmix->quit[1], F_SETFD, FD_CLOEXEC);
+	err = pthread_create(&dmix->server, NULL, dmix_server, dmix);
+	if (err) {
+		close(dmix->quit[0]);
+		close(dmix->quit[1]);
+		return -err;
+	}
+	dmix->server_running = 1;
+	return 0;
+}
+
+static void dmix_stop_server(struct snd_pcm_dmix *dmix)
+{
+	if (!dmix->server_running)
+		return;
+	write(dmix->quit[1], "", 1);
+	pthread_join(dmix->server, NULL);
+	close(dmix->quit[0]);
+	close(dmix->quit[1]);
+	dmix->server_running = 0;
+}
+
+/*
+ * HW RECORDS AND RING BUFFER
+ */
+
+static size_t dmix_page_align(size_t size)
+{
+	size_t psz = sysconf(_SC_PAGE_SIZE);
+
+	return (size + psz - 1) / psz * psz;
+}
+
+static int dmix_map_hw_records(struct snd_pcm_dmix *dmix)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, dmix_page_align(sizeof(*dmix->hw_status)), PROT_READ,
+		   MAP_FILE | MAP_SHARED, dmix->fd, SNDRV_PCM_MMAP_OFFSET_STATUS);
+	if (ptr != MAP_FAILED) {
+		dmix->hw_status = ptr;
+		ptr = mmap(NULL, dmix_page_align(sizeof(*dmix->hw_control)),
+			   PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED,
+			   dmix->fd, SNDRV_PCM_MMAP_OFFSET_CONTROL);
+		if (ptr != MAP_FAILED) {
+			dmix->hw_control = ptr;
+			return 0;
+		}
+		munmap(dmix->hw_status,
+		       dmix_page_align(sizeof(*dmix->hw_status)));
+	}
+
+	dmix->hw_sync_ptr = calloc(1, sizeof(*dmix->hw_sync_ptr));
+	if (!dmix->hw_sync_ptr)
+		return -ENOMEM;
+	dmix->hw_status = &dmix->hw_sync_ptr->s.status;
+	dmix->hw_control = &dmix->hw_sync_ptr->c.control;
+	dmix->hw_sync_ptr->flags = SNDRV_PCM_SYNC_PTR_APPL |
+		SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+	if (ioctl(dmix->fd, SNDRV_PCM_IOCTL_SYNC_PTR, dmix->hw_sync_ptr) < 0)
+		return -errno;
+	return 0;
+}
+
+static void dmix_unmap_hw_records(struct snd_pcm_dmix *dmix)
+{
+	if (dmix->hw_sync_ptr) {
+		free(dmix->hw_sync_ptr);
+	} else if (dmix->hw_status) {
+		munmap(dmix->hw_status,
+		       dmix_page_align(sizeof(*dmix->hw_status)));
+		munmap(dmix->hw_control,
+		       dmix_page_align(sizeof(*dmix->hw_control)));
+	}
+	dmix->hw_sync_ptr = NULL;
+	dmix->hw_status = NULL;
+	dmix->hw_control = NULL;
+}
+
+static int dmix_map_hw_ring(struct snd_pcm_dmix *dmix, int prot)
+{
+	const struct snd_pcm_dmix_setup *setup = &dmix->shm->params;
+	unsigned int width = snd_pcm_format_physical_width(setup->format);
+	struct sndrv_pcm_channel_info info;
+	off_t offset = 0;
+	size_t size = 0, s;
+	unsigned int c;
+	void *ptr;
+
+	dmix->hw_areas = calloc(setup->channels, sizeof(*dmix->hw_areas));
+	if (!dmix->hw_areas)
+		return -ENOMEM;
+	for (c = 0; c < setup->channels; c++) {
+		memzero_valgrind(&info, sizeof(info));
+		info.channel = c;
+		if (ioctl(dmix->fd, SNDRV_PCM_IOCTL_CHANNEL_INFO, &info) < 0)
+			return -errno;
+		/* the hw is interleaved, all in one block */
+		if (!c)
+			offset = info.offset;
+		else if (info.offset != offset)
+			return -ENXIO;
+		dmix->hw_areas[c].first = info.first;
+		dmix->hw_areas[c].step = info.step;
+		s = (info.first + info.step * (setup->buffer_size - 1) +
+		     width + 7) / 8;
+		if (s > size)
+			size = s;
+	}
+	size = dmix_page_align(size);
+	ptr = mmap(NULL, size, prot, MAP_FILE | MAP_SHARED, dmix->fd, offset);
+	if (ptr == MAP_FAILED)
+		return -errno;
+	dmix->hw_buf = ptr;
+	dmix->hw_buf_size = size;
+	for (c = 0; c < setup->channels; c++)
+		dmix->hw_areas[c].addr = dmix->hw_buf;
+	return 0;
+}
+
+static void dmix_unmap_hw_ring(struct snd_pcm_dmix *dmix)
+{
+	if (dmix->hw_buf)
+		munmap(dmix->hw_buf, dmix->hw_buf_size);
+	dmix->hw_buf = NULL;
+	free(dmix->hw_areas);
+	dmix->hw_areas = NULL;
+}
+
+/* read the hw position, letting the kernel update it first on hwsync */
+static snd_pcm_uframes_t dmix_hw_sync(struct snd_pcm_dmix *dmix, int hwsync)
+{
+	if (dmix->hw_sync_ptr) {
+		dmix->hw_sync_ptr->flags = SNDRV_PCM_SYNC_PTR_APPL |
+			SNDRV_PCM_SYNC_PTR_AVAIL_MIN |
+			(hwsync ? SNDRV_PCM_SYNC_PTR_HWSYNC : 0);
+		ioctl(dmix->fd, SNDRV_PCM_IOCTL_SYNC_PTR, dmix->hw_sync_ptr);
+	} else if (hwsync) {
+		ioctl(dmix->fd, SNDRV_PCM_IOCTL_HWSYNC);
+	}
+	return dmix->hw_status->hw_ptr;
+}
+
+/* keep the hw ring looking full for playback and empty for capture,
+ * so its poll wakes up once per period
+ */
+static void dmix_hw_kick(struct snd_pcm_dmix *dmix, snd_pcm_uframes_t hw_ptr,
+			 int capture)
+{
+	snd_pcm_uframes_t appl_ptr = hw_ptr;
+
+	if (!capture)
+		appl_ptr = dmix_ptr_add(hw_ptr, dmix->shm->params.buffer_size,
+					dmix->shm->boundary);
+	dmix->hw_control->appl_ptr = appl_ptr;
+	if (dmix->hw_sync_ptr) {
+		dmix->hw_sync_ptr->flags = 0;
+		ioctl(dmix->fd, SNDRV_PCM_IOCTL_SYNC_PTR, dmix->hw_sync_ptr);
+	}
+}
+
+static int dmix_hw_state_error(int state)
+{
+	switch (state) {
+	case SND_PCM_STATE_PREPARED:
+	case SND_PCM_STATE_RUNNING:
+		return 0;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	case SND_PCM_STATE_DISCONNECTED:
+		return -ENODEV;
+	default:
+		return -EPIPE;
+	}
+}
+
+/* bring the shared hw back after a suspend or an xrun; the positions
+ * restart from zero, so the running clients see an xrun
+ */
+static int dmix_hw_prepare(struct snd_pcm_dmix *dmix, int capture)
+{
+	struct dmix_shm *shm = dmix->shm;
+	int err;
+
+	dmix_hw_sync(dmix, 0);
+	if (!dmix_hw_state_error(dmix->hw_status->state))
+		return 0;
+	err = dmix_lock(dmix, DMIX_SEM_OPEN);
+	if (err < 0)
+		return err;
+	dmix_hw_sync(dmix, 0);
+	err = dmix_hw_state_error(dmix->hw_status->state);
+	if (err == -ENODEV)
+		goto unlock;
+	if (err < 0) {
+		if (ioctl(dmix->fd, SNDRV_PCM_IOCTL_PREPARE) < 0) {
+			err = -errno;
+			goto unlock;
+		}
+		if (dmix->sum)
+			memset(dmix->sum, 0, shm->params.buffer_size *
+			       shm->params.channels * sizeof(*dmix->sum));
+		shm->generation++;
+		dmix_hw_kick(dmix, 0, capture);
+		err = 0;
+	}
+ unlock:
+	dmix_unlock(dmix, DMIX_SEM_OPEN);
+	return err;
+}
+
+static int dmix_hw_start(struct snd_pcm_dmix *dmix, int capture)
+{
+	int err;
+
+	dmix_hw_sync(dmix, 0);
+	err = dmix_hw_state_error(dmix->hw_status->state);
+	if (err < 0)
+		return err;
+	if (dmix->hw_status->state == SND_PCM_STATE_RUNNING)
+		return 0;
+	dmix_hw_kick(dmix, dmix->hw_status->hw_ptr, capture);
+	/* a concurrent client may have started it already */
+	if (ioctl(dmix->fd, SNDRV_PCM_IOCTL_START) < 0 && errno != EBADFD)
+		return -errno;
+	return 0;
+}
+
+/*
+ * MIXING
+ */
+
+static inline int16_t dmix_sat16(int32_t s)
+{
+	if (s > 0x7fff)
+		return 0x7fff;
+	if (s < -0x8000)
+		return -0x8000;
+	return s;
+}
+
+static inline int32_t dmix_sat24(int32_t s)
+{
+	if (s > 0x7fffff)
+		return 0x7fffffff;
+	if (s < -0x800000)
+		return -0x7fffffff - 1;
+	return s << 8;
+}
+
+/* add a sample into the sum slot of the given lap; the sum of an
+ * older lap is replaced, and nothing is added for an older lap than
+ * the slot's.  Returns 0 if too late, or 1 with the new slot value.
+ */
+static inline int dmix_add(uint64_t *slot, int32_t v, uint32_t lap,
+			   uint64_t *val)
+{
+	uint64_t old, new;
+	int32_t d;
+
+	old = __atomic_load_n(slot, __ATOMIC_SEQ_CST);
+	do {
+		d = (int32_t)(lap - (uint32_t)(old >> 32));
+		if (d < 0)
+			return 0;
+		new = (uint64_t)lap << 32 |
+			(uint32_t)(d ? v : (int32_t)(uint32_t)old + v);
+	} while (!__atomic_compare_exchange_n(slot, &old, new, 0,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_SEQ_CST));
+	*val = new;
+	return 1;
+}
+
+/* add a sample into the sum and store the saturated sum; the store is
+ * repeated until the sum is unchanged, so a concurrent adder can't be
+ * overwritten by a stale value
+ */
+#define DMIX_MIX_LOOP(type, sat, shift) \
+do { \
+	for (; frames > 0; frames--) { \
+		uint64_t s, t; \
+		if (dmix_add(sum, *(const type *)src >> (shift), lap, &s)) { \
+			for (;;) { \
+				__atomic_store_n((type *)dst, sat((int32_t)s), \
+						 __ATOMIC_SEQ_CST); \
+				t = __atomic_load_n(sum, __ATOMIC_SEQ_CST); \
+				if (t == s) \
+					break; \
+				s = t; \
+			} \
+		} \
+		src += src_step; \
+		dst += dst_step; \
+		sum += sum_step; \
+	} \
+} while (0)
+
+/* mix the frames of src_areas into the sum and store the result into
+ * dst_areas; the sum is interleaved, one slot per channel of each dst
+ * frame, starting at dst_offset.  lap tags the slots of this pass of
+ * the ring; see dmix_lap().
+ */
+void _snd_pcm_dmix_mix_areas(uint64_t *sum0,
+			     const snd_pcm_channel_area_t *dst_areas,
+			     snd_pcm_uframes_t dst_offset,
+			     const snd_pcm_channel_area_t *src_areas,
+			     snd_pcm_uframes_t src_offset,
+			     unsigned int channels,
+			     snd_pcm_uframes_t frames0,
+			     snd_pcm_format_t format,
+			     uint32_t lap)
+{
+	unsigned int c;
+
+	for (c = 0; c < channels; c++) {
+		const snd_pcm_channel_area_t *da = &dst_areas[c];
+		const snd_pcm_channel_area_t *sa = &src_areas[c];
+		char *dst = (char *)da->addr +
+			(da->first + da->step * dst_offset) / 8;
+		const char *src = (const char *)sa->addr +
+			(sa->first + sa->step * src_offset) / 8;
+		int dst_step = da->step / 8, src_step = sa->step / 8;
+		uint64_t *sum = sum0 + dst_offset * channels + c;
+		unsigned int sum_step = channels;
+		snd_pcm_uframes_t frames = frames0;
+
+		switch (format) {
+		case SND_PCM_FORMAT_S16:
+			DMIX_MIX_LOOP(int16_t, dmix_sat16, 0);
+			break;
+		case SND_PCM_FORMAT_S32:
+			/* 24bit headroom in the sum */
+			DMIX_MIX_LOOP(int32_t, dmix_sat24, 8);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* the lap of a hw position; the boundary is the buffer size times a
+ * power of two, so the scaled count wraps at 32 bits along with the
+ * ring pointers
+ */
+static inline uint32_t dmix_lap(struct snd_pcm_dmix *dmix,
+				snd_pcm_uframes_t ptr)
+{
+	return (uint32_t)(ptr / dmix->shm->params.buffer_size) <<
+		dmix->lap_shift;
+}
+
+/* mix the committed frames; the ones the hw has passed are dropped */
+static void dmix_mix(snd_pcm_t *pcm)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	snd_pcm_uframes_t boundary = dmix->shm->boundary;
+	snd_pcm_uframes_t bs = pcm->buffer_size;
+	snd_pcm_uframes_t size, late, ofs, hw_ofs, frames;
+
+	size = dmix_ptr_diff(pcm->mmap_control->appl_ptr, dmix->mix_ptr,
+			    pcm->boundary);
+	if (!size)
+		return;
+	late = dmix_ptr_diff(dmix->hw_ptr, dmix->slave_ptr, boundary);
+	if (late && late < boundary / 2) {
+		if (late > size)
+			late = size;
+		dmix->mix_ptr = dmix_ptr_add(dmix->mix_ptr, late, pcm->boundary);
+		dmix->slave_ptr = dmix_ptr_add(dmix->slave_ptr, late, boundary);
+		size -= late;
+	}
+	while (size > 0) {
+		ofs = dmix->mix_ptr % bs;
+		hw_ofs = dmix->slave_ptr % bs;
+		frames = size;
+		if (frames > bs - ofs)
+			frames = bs - ofs;
+		if (frames > bs - hw_ofs)
+			frames = bs - hw_ofs;
+		_snd_pcm_dmix_mix_areas(dmix->sum, dmix->hw_areas, hw_ofs,
+					pcm->running_areas, ofs,
+					pcm->channels, frames, pcm->format,
+					dmix_lap(dmix, dmix->slave_ptr));
+		dmix->mix_ptr = dmix_ptr_add(dmix->mix_ptr, frames,
+					    pcm->boundary);
+		dmix->slave_ptr = dmix_ptr_add(dmix->slave_ptr, frames,
+					      boundary);
+		size -= frames;
+	}
+}
+
+/* follow the hw and mix; the heart of the emulated SYNC_PTR */
+static void dmix_sync(snd_pcm_t *pcm, int hwsync)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	snd_pcm_uframes_t hw_ptr, delta;
+	int err;
+
+	switch (dmix_state(pcm)) {
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_DRAINING:
+		break;
+	default:
+		return;
+	}
+
+	hw_ptr = dmix_hw_sync(dmix, hwsync);
+	err = dmix_hw_state_error(dmix->hw_status->state);
+	if (err < 0 || dmix->generation != dmix->shm->generation) {
+		switch (err) {
+		case -ESTRPIPE:
+			pcm->mmap_status->suspended_state = dmix_state(pcm);
+			dmix_state(pcm) = SND_PCM_STATE_SUSPENDED;
+			break;
+		case -ENODEV:
+			dmix_state(pcm) = SND_PCM_STATE_DISCONNECTED;
+			break;
+		default:
+			dmix_state(pcm) = SND_PCM_STATE_XRUN;
+			break;
+		}
+		return;
+	}
+
+	if (dmix_capture(pcm)) {
+		/* the client pointers are the hw positions */
+		if (dmix_state(pcm) == SND_PCM_STATE_RUNNING)
+			pcm->mmap_status->hw_ptr = hw_ptr;
+		else if (pcm->mmap_control->appl_ptr ==
+			 pcm->mmap_status->hw_ptr)
+			dmix_state(pcm) = SND_PCM_STATE_SETUP;
+		dmix_hw_kick(dmix, hw_ptr, 1);
+		return;
+	}
+
+	delta = dmix_ptr_diff(hw_ptr, dmix->hw_ptr, dmix->shm->boundary);
+	dmix->hw_ptr = hw_ptr;
+	pcm->mmap_status->hw_ptr = dmix_ptr_add(pcm->mmap_status->hw_ptr, delta,
+					       pcm->boundary);
+	dmix_mix(pcm);
+	dmix_hw_kick(dmix, hw_ptr, 0);
+
+	if (dmix_state(pcm) == SND_PCM_STATE_DRAINING &&
+	    dmix_ptr_diff(pcm->mmap_control->appl_ptr, pcm->mmap_status->hw_ptr,
+			 pcm->boundary) >= pcm->buffer_size)
+		dmix_state(pcm) = SND_PCM_STATE_SETUP;
+}
+
+/*
+ * EMULATED IOCTLS
+ */
+
+static int dmix_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	struct dmix_shm *shm = dmix->shm;
+	int capture = dmix_capture(pcm);
+	struct snd_pcm_dmix_setup setup;
+	snd_pcm_hw_params_t hw = *params;
+	snd_mask_t *access = (snd_mask_t *)
+		&hw.masks[SNDRV_PCM_HW_PARAM_ACCESS - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+	snd_pcm_sw_params_t sw;
+	int err;
+
+	snd_pcm_hw_params_get_format(params, &setup.format);
+	snd_pcm_hw_params_get_channels(params, &setup.channels);
+	snd_pcm_hw_params_get_rate(params, &setup.rate, 0);
+	snd_pcm_hw_params_get_period_size(params, &setup.period_size, 0);
+	snd_pcm_hw_params_get_buffer_size(params, &setup.buffer_size);
+
+	err = dmix_lock(dmix, DMIX_SEM_OPEN);
+	if (err < 0)
+		return err;
+	if (!shm->setup) {
+		/* the first one sets up the hw for all */
+		_snd_mask_none(access);
+		_snd_mask_set(access, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		if (ioctl(dmix->fd, SNDRV_PCM_IOCTL_HW_PARAMS, &hw) < 0) {
+			err = -errno;
+			goto unlock;
+		}
+		memset(&sw, 0, sizeof(sw));
+		sw.tstamp_mode = SND_PCM_TSTAMP_ENABLE;
+		sw.period_step = 1;
+		sw.avail_min = setup.period_size;
+		sw.boundary = _snd_pcm_boundary(setup.buffer_size);
+		sw.start_threshold = sw.boundary;
+		sw.stop_threshold = sw.boundary;
+		/* the kernel silences what nobody mixed into */
+		if (!capture)
+			sw.silence_size = sw.boundary;
+		if (ioctl(dmix->fd, SNDRV_PCM_IOCTL_SW_PARAMS, &sw) < 0 ||
+		    ioctl(dmix->fd, SNDRV_PCM_IOCTL_PREPARE) < 0) {
+			err = -errno;
+			goto free_hw;
+		}
+		if (shm->sum_shmid >= 0)
+			shmctl(shm->sum_shmid, IPC_RMID, NULL);
+		shm->sum_shmid = -1;
+		if (!capture) {
+			shm->sum_shmid = shmget(IPC_PRIVATE, setup.buffer_size *
+						setup.channels * sizeof(uint64_t),
+						IPC_CREAT | DMIX_IPC_PERM);
+			if (shm->sum_shmid < 0) {
+				err = -errno;
+				goto free_hw;
+			}
+		}
+		shm->params = setup;
+		shm->boundary = sw.boundary;
+		shm->generation++;
+		shm->setup = 1;
+		if (dmix->hw_sync_ptr)
+			dmix->hw_control->avail_min = setup.period_size;
+		dmix_hw_kick(dmix, 0, capture);
+	} else if (memcmp(&setup, &shm->params, sizeof(setup))) {
+		err = -EINVAL;
+		goto unlock;
+	}
+
+	/* the laps per boundary, scaled up to 2^32; see dmix_lap() */
+	for (dmix->lap_shift = 0;
+	     ((uint64_t)shm->boundary / shm->params.buffer_size) <<
+		     dmix->lap_shift < (1ULL << 32);
+	     dmix->lap_shift++)
+		;
+
+	if (!dmix->sum && shm->sum_shmid >= 0) {
+		void *ptr = shmat(shm->sum_shmid, NULL, 0);
+		if (ptr == (void *)-1) {
+			err = -errno;
+			goto unlock;
+		}
+		dmix->sum = ptr;
+	}
+	if (!dmix->hw_buf) {
+		err = dmix_map_hw_ring(dmix, capture ? PROT_READ :
+				       PROT_READ | PROT_WRITE);
+		if (err < 0) {
+			dmix_unmap_hw_ring(dmix);
+			goto unlock;
+		}
+	}
+	dmix->generation = shm->generation;
+	dmix_state(pcm) = SND_PCM_STATE_SETUP;
+	dmix_unlock(dmix, DMIX_SEM_OPEN);
+	return 0;
+
+ free_hw:
+	ioctl(dmix->fd, SNDRV_PCM_IOCTL_HW_FREE);
+ unlock:
+	dmix_unlock(dmix, DMIX_SEM_OPEN);
+	return err;
+}
+
+static int dmix_sw_params(snd_pcm_t *pcm, snd_pcm_sw_params_t *params)
+{
+	if (!params->avail_min)
+		return -EINVAL;
+	params->boundary = _snd_pcm_boundary(pcm->buffer_size);
+	return 0;
+}
+
+static int dmix_check_state(snd_pcm_t *pcm)
+{
+	switch (dmix_state(pcm)) {
+	case SND_PCM_STATE_OPEN:
+		return -EBADFD;
+	case SND_PCM_STATE_XRUN:
+		return -EPIPE;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	case SND_PCM_STATE_DISCONNECTED:
+		return -ENODEV;
+	default:
+		return 0;
+	}
+}
+
+/* frames between the app and the hw; the delay for both streams */
+static snd_pcm_uframes_t dmix_queued(snd_pcm_t *pcm)
+{
+	snd_pcm_uframes_t appl_ptr = pcm->mmap_control->appl_ptr;
+	snd_pcm_uframes_t hw_ptr = pcm->mmap_status->hw_ptr;
+
+	if (dmix_capture(pcm))
+		return dmix_ptr_diff(hw_ptr, appl_ptr, pcm->boundary);
+	return dmix_ptr_diff(appl_ptr, hw_ptr, pcm->boundary);
+}
+
+static int dmix_status(snd_pcm_t *pcm, unsigned int cmd,
+		       snd_pcm_status_t *status)
+{
+	snd_pcm_sframes_t delay;
+
+	dmix_sync(pcm, 1);
+	/* the timestamps come from the hw */
+	if (_snd_pcm_hw_ioctl(pcm, cmd, status) < 0)
+		return -errno;
+	status->state = dmix_state(pcm);
+	status->suspended_state = pcm->mmap_status->suspended_state;
+	status->appl_ptr = pcm->mmap_control->appl_ptr;
+	status->hw_ptr = pcm->mmap_status->hw_ptr;
+	delay = dmix_queued(pcm);
+	status->avail = dmix_capture(pcm) ? delay : pcm->buffer_size - delay;
+	status->avail_max = status->avail;
+	status->overrange = 0;
+	switch (status->state) {
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_DRAINING:
+	case SND_PCM_STATE_PAUSED:
+		status->delay = delay;
+		break;
+	default:
+		status->delay = 0;
+		break;
+	}
+	return 0;
+}
+
+static int dmix_prepare(snd_pcm_t *pcm)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	int err;
+
+	switch (dmix_state(pcm)) {
+	case SND_PCM_STATE_OPEN:
+		return -EBADFD;
+	case SND_PCM_STATE_DISCONNECTED:
+		return -ENODEV;
+	default:
+		break;
+	}
+	err = dmix_hw_prepare(dmix, dmix_capture(pcm));
+	if (err < 0)
+		return err;
+	if (dmix_capture(pcm)) {
+		pcm->mmap_status->hw_ptr = dmix_hw_sync(dmix, 0);
+		pcm->mmap_control->appl_ptr = pcm->mmap_status->hw_ptr;
+	} else {
+		pcm->mmap_status->hw_ptr = 0;
+		pcm->mmap_control->appl_ptr = 0;
+	}
+	dmix->mix_ptr = 0;
+	dmix->generation = dmix->shm->generation;
+	dmix_state(pcm) = SND_PCM_STATE_PREPARED;
+	return 0;
+}
+
+static int dmix_start(snd_pcm_t *pcm)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	int err;
+
+	if (dmix_state(pcm) != SND_PCM_STATE_PREPARED)
+		return -EBADFD;
+	if (dmix_capture(pcm)) {
+		err = dmix_hw_start(dmix, 1);
+		if (err < 0)
+			return err;
+		/* capture from now on */
+		pcm->mmap_status->hw_ptr = dmix_hw_sync(dmix, 1);
+		pcm->mmap_control->appl_ptr = pcm->mmap_status->hw_ptr;
+		dmix_state(pcm) = SND_PCM_STATE_RUNNING;
+		return 0;
+	}
+	if (pcm->mmap_control->appl_ptr == pcm->mmap_status->hw_ptr)
+		return -EPIPE;
+	err = dmix_hw_start(dmix, 0);
+	if (err < 0)
+		return err;
+	dmix->hw_ptr = dmix_hw_sync(dmix, 1);
+	dmix->mix_ptr = pcm->mmap_status->hw_ptr;
+	dmix->slave_ptr = dmix->hw_ptr;
+	dmix_state(pcm) = SND_PCM_STATE_RUNNING;
+	dmix_sync(pcm, 0);
+	return 0;
+}
+
+static int dmix_drain(snd_pcm_t *pcm)
+{
+	snd_pcm_uframes_t frames;
+	int err;
+
+	if (dmix_capture(pcm)) {
+		/* stop following the hw; the rest can still be read */
+		switch (dmix_state(pcm)) {
+		case SND_PCM_STATE_OPEN:
+			return -EBADFD;
+		case SND_PCM_STATE_RUNNING:
+			dmix_sync(pcm, 1);
+			if (dmix_state(pcm) == SND_PCM_STATE_RUNNING &&
+			    dmix_queued(pcm)) {
+				dmix_state(pcm) = SND_PCM_STATE_DRAINING;
+				return 0;
+			}
+			/* fallthru */
+		default:
+			if (dmix_state(pcm) != SND_PCM_STATE_SUSPENDED)
+				dmix_state(pcm) = SND_PCM_STATE_SETUP;
+			return 0;
+		}
+	}
+
+	switch (dmix_state(pcm)) {
+	case SND_PCM_STATE_OPEN:
+		return -EBADFD;
+	case SND_PCM_STATE_PREPARED:
+		if (pcm->mmap_control->appl_ptr == pcm->mmap_status->hw_ptr) {
+			dmix_state(pcm) = SND_PCM_STATE_SETUP;
+			return 0;
+		}
+		err = dmix_start(pcm);
+		if (err < 0)
+			return err;
+		/* fallthru */
+	case SND_PCM_STATE_RUNNING:
+		dmix_state(pcm) = SND_PCM_STATE_DRAINING;
+		break;
+	case SND_PCM_STATE_DRAINING:
+		break;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	default:
+		dmix_state(pcm) = SND_PCM_STATE_SETUP;
+		return 0;
+	}
+
+	for (;;) {
+		dmix_sync(pcm, 1);
+		switch (dmix_state(pcm)) {
+		case SND_PCM_STATE_DRAINING:
+			break;
+		case SND_PCM_STATE_XRUN:
+			dmix_state(pcm) = SND_PCM_STATE_SETUP;
+			return 0;
+		default:
+			return dmix_check_state(pcm);
+		}
+		if (pcm->mode & SND_PCM_NONBLOCK)
+			return -EAGAIN;
+		/* sleep until the rest is played, a period at most */
+		frames = dmix_ptr_diff(pcm->mmap_control->appl_ptr,
+				      pcm->mmap_status->hw_ptr, pcm->boundary);
+		if (frames > pcm->period_size)
+			frames = pcm->period_size;
+		usleep((unsigned long long)frames * 1000000 / pcm->rate + 1000);
+	}
+}
+
+static int dmix_pause(snd_pcm_t *pcm, int enable)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	snd_pcm_uframes_t hw_ptr, ahead;
+	int err;
+
+	if (enable) {
+		if (dmix_state(pcm) != SND_PCM_STATE_RUNNING)
+			return -EBADFD;
+		dmix_sync(pcm, 1);
+		if (dmix_state(pcm) != SND_PCM_STATE_RUNNING)
+			return dmix_check_state(pcm);
+		dmix->pause_ptr = dmix->hw_status->hw_ptr;
+		dmix_state(pcm) = SND_PCM_STATE_PAUSED;
+		return 0;
+	}
+
+	if (dmix_state(pcm) != SND_PCM_STATE_PAUSED)
+		return -EBADFD;
+	err = dmix_hw_start(dmix, dmix_capture(pcm));
+	if (err < 0)
+		return err;
+	if (dmix_capture(pcm)) {
+		/* skip what was captured during the pause */
+		hw_ptr = dmix_hw_sync(dmix, 1);
+		pcm->mmap_control->appl_ptr =
+			dmix_ptr_add(pcm->mmap_control->appl_ptr,
+				     dmix_ptr_diff(hw_ptr, dmix->pause_ptr,
+						   pcm->boundary),
+				     pcm->boundary);
+		pcm->mmap_status->hw_ptr = hw_ptr;
+		dmix_state(pcm) = SND_PCM_STATE_RUNNING;
+		return 0;
+	}
+	/* the frames mixed before the pause keep playing; count the rest
+	 * as still queued
+	 */
+	hw_ptr = dmix_hw_sync(dmix, 1);
+	ahead = dmix_ptr_diff(dmix->slave_ptr, hw_ptr, dmix->shm->boundary);
+	if (ahead >= dmix->shm->boundary / 2)
+		ahead = 0;
+	dmix->hw_ptr = hw_ptr;
+	dmix->slave_ptr = dmix_ptr_add(hw_ptr, ahead, dmix->shm->boundary);
+	pcm->mmap_status->hw_ptr =
+		dmix_ptr_add(dmix->mix_ptr, pcm->boundary - ahead,
+			    pcm->boundary);
+	dmix_state(pcm) = SND_PCM_STATE_RUNNING;
+	dmix_sync(pcm, 0);
+	return 0;
+}
+
+/* the mixed frames can't be taken back from the hw ring; on capture,
+ * the frames read already are still in the ring
+ */
+static snd_pcm_uframes_t dmix_rewindable(snd_pcm_t *pcm)
+{
+	snd_pcm_uframes_t from = pcm->mmap_status->hw_ptr;
+
+	if (dmix_capture(pcm))
+		return pcm->buffer_size - dmix_queued(pcm);
+	if (dmix_state(pcm) != SND_PCM_STATE_PREPARED)
+		from = pcm->dmix->mix_ptr;
+	return dmix_ptr_diff(pcm->mmap_control->appl_ptr, from, pcm->boundary);
+}
+
+static int dmix_reset(snd_pcm_t *pcm)
+{
+	int err = dmix_check_state(pcm);
+
+	if (err < 0)
+		return err;
+	dmix_sync(pcm, 1);
+	if (dmix_capture(pcm))
+		pcm->mmap_control->appl_ptr = pcm->mmap_status->hw_ptr;
+	else
+		pcm->mmap_control->appl_ptr =
+			dmix_ptr_add(pcm->mmap_control->appl_ptr,
+				     pcm->boundary - dmix_rewindable(pcm),
+				     pcm->boundary);
+	return 0;
+}
+
+static int dmix_rewind(snd_pcm_t *pcm, snd_pcm_uframes_t *frames)
+{
+	snd_pcm_uframes_t n;
+	int err = dmix_check_state(pcm);
+
+	if (err < 0)
+		return err;
+	dmix_sync(pcm, 1);
+	n = dmix_rewindable(pcm);
+	if (*frames > n)
+		*frames = n;
+	pcm->mmap_control->appl_ptr =
+		dmix_ptr_add(pcm->mmap_control->appl_ptr,
+			    pcm->boundary - *frames, pcm->boundary);
+	return 0;
+}
+
+static int dmix_forward(snd_pcm_t *pcm, snd_pcm_uframes_t *frames)
+{
+	snd_pcm_uframes_t n, ofs, size;
+	int err = dmix_check_state(pcm);
+
+	if (err < 0)
+		return err;
+	dmix_sync(pcm, 1);
+	n = dmix_queued(pcm);
+	if (!dmix_capture(pcm))
+		n = pcm->buffer_size - n;
+	if (*frames > n)
+		*frames = n;
+	/* skipped frames are mixed as silence */
+	ofs = pcm->mmap_control->appl_ptr % pcm->buffer_size;
+	for (n = dmix_capture(pcm) ? 0 : *frames; n > 0; n -= size) {
+		size = pcm->buffer_size - ofs;
+		if (size > n)
+			size = n;
+		snd_pcm_areas_silence(pcm->running_areas, ofs, pcm->channels,
+				      size, pcm->format);
+		ofs = 0;
+	}
+	pcm->mmap_control->appl_ptr =
+		dmix_ptr_add(pcm->mmap_control->appl_ptr, *frames,
+			    pcm->boundary);
+	dmix_sync(pcm, 0);
+	return 0;
+}
+
+static int dmix_ioctl(snd_pcm_t *pcm, unsigned int cmd, void *arg)
+{
+	int err;
+
+	switch (cmd) {
+	case SNDRV_PCM_IOCTL_HW_REFINE:
+		return _snd_pcm_dmix_hw_refine(pcm, arg);
+	case SNDRV_PCM_IOCTL_HW_PARAMS:
+		return dmix_hw_params(pcm, arg);
+	case SNDRV_PCM_IOCTL_HW_FREE:
+		/* the hw stays set up for the others */
+		dmix_state(pcm) = SND_PCM_STATE_OPEN;
+		return 0;
+	case SNDRV_PCM_IOCTL_SW_PARAMS:
+		return dmix_sw_params(pcm, arg);
+	case SNDRV_PCM_IOCTL_STATUS:
+	case SNDRV_PCM_IOCTL_STATUS_EXT:
+		return dmix_status(pcm, cmd, arg);
+	case SNDRV_PCM_IOCTL_SYNC_PTR:
+		dmix_sync(pcm, ((struct snd_pcm_sync_ptr *)arg)->flags &
+			  SNDRV_PCM_SYNC_PTR_HWSYNC);
+		return 0;
+	case SNDRV_PCM_IOCTL_HWSYNC:
+		dmix_sync(pcm, 1);
+		return dmix_check_state(pcm);
+	case SNDRV_PCM_IOCTL_DELAY:
+		dmix_sync(pcm, 1);
+		err = dmix_check_state(pcm);
+		if (err < 0)
+			return err;
+		*(snd_pcm_sframes_t *)arg = dmix_queued(pcm);
+		return 0;
+	case SNDRV_PCM_IOCTL_PREPARE:
+		return dmix_prepare(pcm);
+	case SNDRV_PCM_IOCTL_RESET:
+		return dmix_reset(pcm);
+	case SNDRV_PCM_IOCTL_START:
+		return dmix_start(pcm);
+	case SNDRV_PCM_IOCTL_DROP:
+		if (dmix_state(pcm) == SND_PCM_STATE_OPEN)
+			return -EBADFD;
+		dmix_state(pcm) = SND_PCM_STATE_SETUP;
+		return 0;
+	case SNDRV_PCM_IOCTL_DRAIN:
+		return dmix_drain(pcm);
+	case SNDRV_PCM_IOCTL_PAUSE:
+		return dmix_pause(pcm, (int)(unsigned long)arg);
+	case SNDRV_PCM_IOCTL_XRUN:
+		switch (dmix_state(pcm)) {
+		case SND_PCM_STATE_RUNNING:
+		case SND_PCM_STATE_DRAINING:
+		case SND_PCM_STATE_PAUSED:
+			dmix_state(pcm) = SND_PCM_STATE_XRUN;
+			return 0;
+		case SND_PCM_STATE_XRUN:
+			return 0;
+		default:
+			return -EBADFD;
+		}
+	case SNDRV_PCM_IOCTL_REWIND:
+		return dmix_rewind(pcm, arg);
+	case SNDRV_PCM_IOCTL_FORWARD:
+		return dmix_forward(pcm, arg);
+	case SNDRV_PCM_IOCTL_RESUME:
+	case SNDRV_PCM_IOCTL_LINK:
+	case SNDRV_PCM_IOCTL_UNLINK:
+		return -ENOSYS;
+	default:
+		if (_snd_pcm_hw_ioctl(pcm, cmd, arg) < 0)
+			return -errno;
+		return 0;
+	}
+}
+
+/* same convention as ioctl() */
+int _snd_pcm_dmix_ioctl(snd_pcm_t *pcm, unsigned int cmd, void *arg)
+{
+	int err = dmix_ioctl(pcm, cmd, arg);
+
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+	return 0;
+}
+
+const struct snd_pcm_dmix_setup *_snd_pcm_dmix_setup(snd_pcm_t *pcm)
+{
+	struct dmix_shm *shm = pcm->dmix->shm;
+
+	return shm->setup ? &shm->params : NULL;
+}
+
+/*
+ * PRIVATE RING BUFFER AND POLL
+ */
+
+int _snd_pcm_dmix_mmap(snd_pcm_t *pcm)
+{
+	struct snd_pcm_dmix *dmix = pcm->dmix;
+	unsigned int c, bytes = pcm->sample_bits / 8;
+	int interleaved = pcm->_access == SND_PCM_ACCESS_RW_INTERLEAVED ||
+		pcm->_access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+	/* dsnoop reads the hw ring in place */
+	if (dmix_capture(pcm)) {
+		memcpy(pcm->running_areas, dmix->hw_areas,
+		       pcm->channels * sizeof(*pcm->running_areas));
+		return 0;
+	}
+	dmix->buf = calloc(pcm->buffer_size, pcm->frame_bits / 8);
+	if (!dmix->buf)
+		return -ENOMEM;
+	for (c = 0; c < pcm->channels; c++) {
+		snd_pcm_channel_area_t *a = &pcm->running_areas[c];
+		if (interleaved) {
+			a->addr = dmix->buf;
+			a->first = c * pcm->sample_bits;
+			a->step = pcm->frame_bits;
+		} else {
+			a->addr = dmix->buf + c * pcm->buffer_size * bytes;
+			a->first = 0;
+			a->step = pcm->sample_bits;
+		}
+	}
+	return 0;
+}
+
+void _snd_pcm_dmix_munmap(snd_pcm_t *pcm)
+{
+	free(pcm->dmix->buf);
+	pcm->dmix->buf = NULL;
+}
+
+static int dmix_avail_ready(snd_pcm_t *pcm)
+{
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+
+	if (avail < 0)
+		return avail;
+	switch (dmix_state(pcm)) {
+	case SND_PCM_STATE_RUNNING:
+	case SND_PCM_STATE_DRAINING:
+	case SND_PCM_STATE_PREPARED:
+		return avail >= (snd_pcm_sframes_t)pcm->sw_params.avail_min;
+	default:
+		/* nothing to wait for */
+		return 1;
+	}
+}
+
+/* the hw fd wakes up every period; sleep until this client has room */
+int _snd_pcm_dmix_wait(snd_pcm_t *pcm, int timeout)
+{
+	struct pollfd pfd = pcm->pollfd;
+	int err;
+
+	for (;;) {
+		err = dmix_avail_ready(pcm);
+		if (err)
+			return err;
+		err = poll(&pfd, 1, timeout);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!err)
+			return 0;
+		if (pfd.revents & (POLLERR | POLLNVAL))
+			return -EIO;
+	}
+}
+
+int _snd_pcm_dmix_revents(snd_pcm_t *pcm, struct pollfd *pfds,
+			  unsigned short *revents)
+{
+	*revents = pfds->revents;
+	if ((*revents & POLLOUT) && dmix_avail_ready(pcm) == 0)
+		*revents &= ~POLLOUT;
+	return 0;
+}
+
+/*
+ * OPEN/CLOSE
+ */
+
+/* drop all references of this client, except the semaphores */
+static void dmix_release(struct snd_pcm_dmix *dmix)
+{
+	dmix_unmap_hw_ring(dmix);
+	dmix_unmap_hw_records(dmix);
+	if (dmix->sum)
+		shmdt(dmix->sum);
+	if (dmix->shm)
+		shmdt(dmix->shm);
+	if (dmix->sock >= 0)
+		close(dmix->sock);
+	if (dmix->fd >= 0)
+		close(dmix->fd);
+}
+
+/* attach to the clients of the device, or become the first one;
+ * returns the shared hw fd
+ */
+int _snd_pcm_dmix_open(struct snd_pcm_dmix **dmixp, const char *filename,
+		       snd_pcm_stream_t stream, int card, int dev)
+{
+	key_t key = DMIX_IPC_KEY(stream, card, dev);
+	struct snd_pcm_dmix *dmix;
+	struct shmid_ds ds;
+	int fds[2];
+	void *ptr;
+	int err;
+
+	dmix = calloc(1, sizeof(*dmix));
+	if (!dmix)
+		return -ENOMEM;
+	dmix->fd = -1;
+	dmix->sock = -1;
+	dmix->shmid = -1;
+
+	/* the semaphores are never removed, as another client may be
+	 * just about to take them
+	 */
+	dmix->semid = semget(key, 1, IPC_CREAT | DMIX_IPC_PERM);
+	if (dmix->semid < 0) {
+		err = -errno;
+		free(dmix);
+		return err;
+	}
+	err = dmix_lock(dmix, DMIX_SEM_OPEN);
+	if (err < 0) {
+		free(dmix);
+		return err;
+	}
+
+	dmix->shmid = shmget(key, sizeof(struct dmix_shm),
+			     IPC_CREAT | DMIX_IPC_PERM);
+	if (dmix->shmid < 0) {
+		err = -errno;
+		goto error;
+	}
+	ptr = shmat(dmix->shmid, NULL, 0);
+	if (ptr == (void *)-1) {
+		err = -errno;
+		goto error;
+	}
+	dmix->shm = ptr;
+	if (shmctl(dmix->shmid, IPC_STAT, &ds) < 0) {
+		err = -errno;
+		goto error;
+	}
+
+	if (ds.shm_nattch == 1) {
+		/* the first client; clean up after a crashed group */
+		if (dmix->shm->magic == DMIX_MAGIC &&
+		    dmix->shm->sum_shmid >= 0)
+			shmctl(dmix->shm->sum_shmid, IPC_RMID, NULL);
+		memset(dmix->shm, 0, sizeof(*dmix->shm));
+		dmix->shm->magic = DMIX_MAGIC;
+		dmix->shm->sum_shmid = -1;
+		dmix->fd = open(filename, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (dmix->fd < 0) {
+			err = -errno;
+			goto error;
+		}
+		dmix->sock = dmix_listen(key);
+		if (dmix->sock < 0) {
+			err = dmix->sock;
+			goto error;
+		}
+	} else {
+		/* a client of another ABI can't share the records */
+		if (dmix->shm->magic != DMIX_MAGIC) {
+			err = -EBUSY;
+			goto error;
+		}
+		err = dmix_connect(key, fds);
+		if (err < 0)
+			goto error;
+		dmix->fd = fds[0];
+		dmix->sock = fds[1];
+	}
+
+	err = dmix_map_hw_records(dmix);
+	if (err < 0)
+		goto error;
+	if (dmix->shm->setup && dmix->shm->sum_shmid >= 0) {
+		void *ptr = shmat(dmix->shm->sum_shmid, NULL, 0);
+		if (ptr == (void *)-1) {
+			err = -errno;
+			goto error;
+		}
+		dmix->sum = ptr;
+	}
+	err = dmix_start_server(dmix);
+	if (err < 0)
+		goto error;
+	dmix_unlock(dmix, DMIX_SEM_OPEN);
+	*dmixp = dmix;
+	return dmix->fd;
+
+ error:
+	if (dmix->shm && shmctl(dmix->shmid, IPC_STAT, &ds) == 0 &&
+	    ds.shm_nattch == 1)
+		shmctl(dmix->shmid, IPC_RMID, NULL);
+	dmix_release(dmix);
+	dmix_unlock(dmix, DMIX_SEM_OPEN);
+	free(dmix);
+	return err;
+}
+
+/* the last client releases the hw and the shared memory */
+void _snd_pcm_dmix_close(struct snd_pcm_dmix *dmix)
+{
+	struct shmid_ds ds;
+	int last;
+
+	dmix_stop_server(dmix);
+	dmix_lock(dmix, DMIX_SEM_OPEN);
+	last = shmctl(dmix->shmid, IPC_STAT, &ds) == 0 && ds.shm_nattch == 1;
+	if (last) {
+		ioctl(dmix->fd, SNDRV_PCM_IOCTL_DROP);
+		ioctl(dmix->fd, SNDRV_PCM_IOCTL_HW_FREE);
+		if (dmix->shm->sum_shmid >= 0)
+			shmctl(dmix->shm->sum_shmid, IPC_RMID, NULL);
+		shmctl(dmix->shmid, IPC_RMID, NULL);
+	}
+	dmix_release(dmix);
+	dmix_unlock(dmix, DMIX_SEM_OPEN);
+	free(dmix);
+}
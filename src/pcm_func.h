@@ -35,6 +35,9 @@ typedef enum _snd_pcm_xrun {
 #define SND_PCM_NO_AUTO_CHANNELS	0x00020000
 #define SND_PCM_NO_AUTO_FORMAT		0x00040000
 #define SND_PCM_NO_SOFTVOL		0x00080000
+#if SALSA_HAS_RT_SUPPORT
+#define SND_PCM_RT_PREFAULT		0x10000000
+#endif
 
 typedef enum _snd_pcm_type {
 	SND_PCM_TYPE_HW = 0,
@@ -88,11 +91,26 @@ int snd_pcm_close(snd_pcm_t *pcm);
 int snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
 int snd_pcm_hw_free(snd_pcm_t *pcm);
 int snd_pcm_hw_params_any(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
+int snd_pcm_set_params(snd_pcm_t *pcm, snd_pcm_format_t format,
+		       snd_pcm_access_t access, unsigned int channels,
+		       unsigned int rate, int soft_resample,
+		       unsigned int latency);
+#if SALSA_HAS_PLUG_SUPPORT
+int _snd_pcm_plug_hw_refine(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
+#endif
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+void _snd_pcm_plug_status(snd_pcm_t *pcm, snd_pcm_status_t *status);
+snd_pcm_sframes_t _snd_pcm_plug_delay(snd_pcm_t *pcm, snd_pcm_sframes_t delay);
+void _snd_pcm_plug_reset(snd_pcm_t *pcm);
+snd_pcm_sframes_t _snd_pcm_plug_move(snd_pcm_t *pcm, snd_pcm_uframes_t frames,
+				     int forward);
+#endif
 int snd_pcm_hw_params_get_min_align(const snd_pcm_hw_params_t *params,
 				    snd_pcm_uframes_t *val);
 int snd_pcm_sw_params(snd_pcm_t *pcm, snd_pcm_sw_params_t *params);
 
 snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *pcm);
+snd_pcm_sframes_t snd_pcm_avail(snd_pcm_t *pcm);
 int snd_pcm_avail_delay(snd_pcm_t *pcm, snd_pcm_sframes_t *availp,
 			snd_pcm_sframes_t *delayp);
 snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer,
@@ -103,6 +121,14 @@ snd_pcm_sframes_t snd_pcm_writen(snd_pcm_t *pcm, void **bufs,
 				 snd_pcm_uframes_t size);
 snd_pcm_sframes_t snd_pcm_readn(snd_pcm_t *pcm, void **bufs,
 				snd_pcm_uframes_t size);
+snd_pcm_sframes_t snd_pcm_mmap_writei(snd_pcm_t *pcm, const void *buffer,
+				      snd_pcm_uframes_t size);
+snd_pcm_sframes_t snd_pcm_mmap_readi(snd_pcm_t *pcm, void *buffer,
+				     snd_pcm_uframes_t size);
+snd_pcm_sframes_t snd_pcm_mmap_writen(snd_pcm_t *pcm, void **bufs,
+				      snd_pcm_uframes_t size);
+snd_pcm_sframes_t snd_pcm_mmap_readn(snd_pcm_t *pcm, void **bufs,
+				     snd_pcm_uframes_t size);
 int snd_pcm_wait(snd_pcm_t *pcm, int timeout);
 
 int snd_pcm_recover(snd_pcm_t *pcm, int err, int silent);
@@ -151,6 +177,135 @@ int snd_pcm_areas_copy(const snd_pcm_channel_area_t *dst_channels,
 snd_pcm_sframes_t snd_pcm_forwardable(snd_pcm_t *pcm);
 snd_pcm_sframes_t snd_pcm_rewindable(snd_pcm_t *pcm);
 
+#if SALSA_HAS_WAITSET_SUPPORT
+/* waiting for many PCMs (and other fds) at once */
+typedef struct _snd_pcm_waitset snd_pcm_waitset_t;
+
+typedef struct _snd_pcm_waitset_event {
+	snd_pcm_t *pcm;			/* NULL for an fd added via add_fd */
+	int fd;
+	void *private_data;
+	unsigned short revents;		/* POLL* bits */
+	snd_pcm_sframes_t avail;	/* avail_update() result for a PCM */
+} snd_pcm_waitset_event_t;
+
+int snd_pcm_waitset_open(snd_pcm_waitset_t **wsp);
+int snd_pcm_waitset_close(snd_pcm_waitset_t *ws);
+int snd_pcm_waitset_add_pcm(snd_pcm_waitset_t *ws, snd_pcm_t *pcm,
+			    void *private_data);
+int snd_pcm_waitset_remove_pcm(snd_pcm_waitset_t *ws, snd_pcm_t *pcm);
+int snd_pcm_waitset_add_fd(snd_pcm_waitset_t *ws, int fd,
+			   unsigned short events, void *private_data);
+int snd_pcm_waitset_remove_fd(snd_pcm_waitset_t *ws, int fd);
+int snd_pcm_waitset_wait(snd_pcm_waitset_t *ws,
+			 snd_pcm_waitset_event_t *events, unsigned int space,
+			 int timeout);
+#endif
+
+#if SALSA_HAS_DLL_SUPPORT
+/* clock-drift estimator */
+typedef struct _snd_pcm_dll snd_pcm_dll_t;
+
+int snd_pcm_dll_open(snd_pcm_dll_t **dllp, snd_pcm_t *pcm, double bandwidth);
+int snd_pcm_dll_close(snd_pcm_dll_t *dll);
+void snd_pcm_dll_reset(snd_pcm_dll_t *dll);
+int snd_pcm_dll_set_audio_tstamp_type(snd_pcm_dll_t *dll, int type);
+int snd_pcm_dll_update(snd_pcm_dll_t *dll, const snd_htimestamp_t *tstamp,
+		       snd_pcm_uframes_t hw_ptr);
+int snd_pcm_dll_update_status(snd_pcm_dll_t *dll);
+double snd_pcm_dll_get_rate(snd_pcm_dll_t *dll);
+double snd_pcm_dll_get_ratio(snd_pcm_dll_t *dll);
+snd_pcm_uframes_t snd_pcm_dll_get_hw_ptr(snd_pcm_dll_t *dll,
+					 const snd_htimestamp_t *tstamp);
+#endif
+
+#if SALSA_HAS_STATS_SUPPORT
+/* per-stream counters; bin 0 counts zero, bin n counts [2^(n-1), 2^n) */
+#define SND_PCM_STATS_HIST_BINS		24
+
+typedef struct _snd_pcm_stats {
+	unsigned long xruns;		/* xruns seen by the application */
+	unsigned long suspends;		/* suspends seen by the application */
+	unsigned long wakeups;		/* successful snd_pcm_wait() etc */
+	unsigned long ioctls;		/* ioctls issued on the PCM fd */
+	unsigned long xfers;		/* read/write calls and mmap commits */
+	unsigned long frames;		/* frames transferred */
+	unsigned long avail_hist[SND_PCM_STATS_HIST_BINS];	/* frames */
+	unsigned long interval_hist[SND_PCM_STATS_HIST_BINS];	/* usec */
+	unsigned long xfer_hist[SND_PCM_STATS_HIST_BINS];	/* frames */
+} snd_pcm_stats_t;
+
+int snd_pcm_stats(snd_pcm_t *pcm, snd_pcm_stats_t *stats);
+void snd_pcm_stats_reset(snd_pcm_t *pcm);
+int snd_pcm_stats_dump(const snd_pcm_stats_t *stats, snd_output_t *out);
+#endif
+
+#if SALSA_HAS_RECOVERY_SUPPORT
+/* non-blocking xrun and suspend recovery */
+typedef struct _snd_pcm_recovery snd_pcm_recovery_t;
+typedef snd_pcm_sframes_t (*snd_pcm_recovery_fill_t)(snd_pcm_t *pcm,
+				const snd_pcm_channel_area_t *areas,
+				snd_pcm_uframes_t offset,
+				snd_pcm_uframes_t frames,
+				void *private_data);
+
+int snd_pcm_recovery_open(snd_pcm_recovery_t **recp, snd_pcm_t *pcm);
+int snd_pcm_recovery_close(snd_pcm_recovery_t *rec);
+void snd_pcm_recovery_set_fill(snd_pcm_recovery_t *rec,
+			       snd_pcm_recovery_fill_t fill,
+			       void *private_data);
+int snd_pcm_recovery_get_fd(snd_pcm_recovery_t *rec);
+int snd_pcm_recovery_in_progress(snd_pcm_recovery_t *rec);
+int snd_pcm_recovery_start(snd_pcm_recovery_t *rec, int err);
+int snd_pcm_recovery_step(snd_pcm_recovery_t *rec);
+#endif
+
+#if SALSA_HAS_PUMP_SUPPORT
+/* realtime pump thread with a lock-free FIFO */
+typedef struct _snd_pcm_pump snd_pcm_pump_t;
+typedef struct _snd_pcm_pump_stats {
+	unsigned long xruns;		/* PCM xruns recovered by the pump */
+	unsigned long fifo_underruns;	/* FIFO ran empty */
+	unsigned long fifo_overruns;	/* FIFO ran full */
+	unsigned long silence_frames;	/* played for the empty FIFO */
+	unsigned long dropped_frames;	/* captured, lost for the full FIFO */
+} snd_pcm_pump_stats_t;
+
+int snd_pcm_pump_open(snd_pcm_pump_t **pumpp, snd_pcm_t *pcm,
+		      snd_pcm_uframes_t fifo_size);
+int snd_pcm_pump_close(snd_pcm_pump_t *pump);
+int snd_pcm_pump_set_priority(snd_pcm_pump_t *pump, int priority);
+int snd_pcm_pump_set_cpu(snd_pcm_pump_t *pump, int cpu);
+int snd_pcm_pump_start(snd_pcm_pump_t *pump);
+int snd_pcm_pump_stop(snd_pcm_pump_t *pump);
+int snd_pcm_pump_error(snd_pcm_pump_t *pump);
+snd_pcm_uframes_t snd_pcm_pump_avail(snd_pcm_pump_t *pump);
+snd_pcm_sframes_t snd_pcm_pump_write(snd_pcm_pump_t *pump, const void *buf,
+				     snd_pcm_uframes_t size);
+snd_pcm_sframes_t snd_pcm_pump_read(snd_pcm_pump_t *pump, void *buf,
+				    snd_pcm_uframes_t size);
+void snd_pcm_pump_get_stats(snd_pcm_pump_t *pump,
+			    snd_pcm_pump_stats_t *stats);
+#endif
+
+#if SALSA_HAS_HW_BATCH_SUPPORT
+/* deferred hw_params refine */
+int snd_pcm_hw_params_batch_begin(snd_pcm_t *pcm,
+				  const snd_pcm_hw_params_t *params);
+int snd_pcm_hw_params_batch_commit(snd_pcm_t *pcm,
+				   snd_pcm_hw_params_t *params);
+void snd_pcm_hw_params_batch_abort(snd_pcm_t *pcm);
+#endif
+
+#if SALSA_HAS_REFINE_CACHE_SUPPORT
+int snd_pcm_refine_cache_set_dir(const char *dir);
+void snd_pcm_refine_cache_clear(void);
+#endif
+
+#if SALSA_HAS_RT_SUPPORT
+int snd_pcm_rt_get_faults(unsigned long *minor, unsigned long *major);
+#endif
+
 #if SALSA_HAS_ASYNC_SUPPORT
 int snd_async_add_pcm_handler(snd_async_handler_t **handler, snd_pcm_t *pcm, 
 			      snd_async_callback_t callback,
@@ -17,6 +17,7 @@
 typedef struct {
 	struct sndrv_pcm_channel_info info;
 	void *addr;
+	size_t size;		/* mapped size, set only on the owner */
 } snd_pcm_channel_info_t;
 
 struct _snd_pcm {
@@ -26,6 +27,8 @@ struct _snd_pcm {
 	int mode;
 	unsigned int setup:1;
 	unsigned int monotonic:1;
+	unsigned int appl_dirty:1;	/* appl_ptr not pushed via sync_ptr */
+	unsigned int appl_stale:1;	/* appl_ptr not pulled via sync_ptr */
 
 	int card;
 	int device;
@@ -62,18 +65,69 @@ struct _snd_pcm {
 	struct snd_pcm_mmap_status *mmap_status;
 	struct snd_pcm_mmap_control *mmap_control;
 	struct snd_pcm_sync_ptr *sync_ptr;
+	unsigned long sync_ptr_saved;	/* SYNC_PTR ioctls skipped */
 
 	snd_pcm_channel_info_t *mmap_channels;
 	snd_pcm_channel_area_t *running_areas;
+
+	/* timer wakeups when the period wakeups are disabled */
+	int timer_fd;
+	unsigned int timer_rate;	/* measured hw rate in 1/256 Hz */
+	snd_pcm_uframes_t timer_ptr;	/* hw_ptr at the last measurement */
+	long long timer_nsec;		/* and its monotonic time */
+#if SALSA_HAS_PLUG_SUPPORT
+	struct snd_pcm_plug *plug;	/* opened as plughw */
+#endif
+#if SALSA_HAS_DMIX_SUPPORT
+	struct snd_pcm_dmix *dmix;	/* opened as dmix or dsnoop */
+#endif
 #if SALSA_HAS_ASYNC_SUPPORT
 	snd_async_handler_t *async;
 #endif
+#if SALSA_HAS_STATS_SUPPORT
+	snd_pcm_stats_t stats;
+	long long stats_nsec;		/* time of the last wakeup */
+	unsigned int stats_xrun:1;	/* xrun already counted */
+	unsigned int stats_suspend:1;	/* suspend already counted */
+#endif
+#if SALSA_HAS_HW_BATCH_SUPPORT
+	struct snd_pcm_hw_batch *hw_batch;	/* deferred hw_params refine */
+#endif
 };
 
 /*
  * Macros
  */
 
+#if SALSA_HAS_STATS_SUPPORT
+/* only the thread driving the PCM writes; readers just mustn't tear */
+#define _snd_pcm_stats_inc(pcm, field) \
+	__atomic_store_n(&(pcm)->stats.field, (pcm)->stats.field + 1, \
+			 __ATOMIC_RELAXED)
+#define _snd_pcm_hw_ioctl(pcm, cmd, arg) \
+	(_snd_pcm_stats_inc(pcm, ioctls), ioctl((pcm)->fd, cmd, arg))
+#else
+#define _snd_pcm_hw_ioctl(pcm, cmd, arg)	ioctl((pcm)->fd, cmd, arg)
+#endif
+
+/* PCM ioctls go through here; dmix emulates them on the shared hw PCM */
+#if SALSA_HAS_DMIX_SUPPORT
+int _snd_pcm_dmix_ioctl(snd_pcm_t *pcm, unsigned int cmd, void *arg);
+int _snd_pcm_dmix_revents(snd_pcm_t *pcm, struct pollfd *pfds,
+			  unsigned short *revents);
+
+#define _snd_pcm_ioctl(pcm, cmd, arg) \
+	((pcm)->dmix ? \
+	 _snd_pcm_dmix_ioctl(pcm, cmd, (void *)(unsigned long)(arg)) : \
+	 _snd_pcm_hw_ioctl(pcm, cmd, arg))
+#else
+#define _snd_pcm_ioctl(pcm, cmd, arg)	_snd_pcm_hw_ioctl(pcm, cmd, arg)
+#endif
+
+#if SALSA_HAS_REFINE_CACHE_SUPPORT
+int _snd_pcm_refine_cache_ioctl(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
+#endif
+
 #if SALSA_CHECK_ABI
 #define SALSA_PCM_MAGIC		sizeof(struct _snd_pcm)
 __SALSA_EXPORT_FUNC
@@ -87,7 +141,20 @@ int snd_pcm_open(snd_pcm_t **pcm, const char *name,
 __SALSA_EXPORT_FUNC
 int snd_pcm_nonblock(snd_pcm_t *pcm, int nonblock)
 {
-	return _snd_set_nonblock(pcm->fd, nonblock);
+#if SALSA_HAS_DMIX_SUPPORT
+	/* the dmix clients share the fd, which stays non-blocking */
+	if (!pcm->dmix)
+#endif
+	{
+		int err = _snd_set_nonblock(pcm->fd, nonblock);
+		if (err < 0)
+			return err;
+	}
+	if (nonblock)
+		pcm->mode |= SND_PCM_NONBLOCK;
+	else
+		pcm->mode &= ~SND_PCM_NONBLOCK;
+	return 0;
 }
 
 static __inline__ int
@@ -133,6 +200,10 @@ int snd_pcm_poll_descriptors_revents(snd_pcm_t *pcm, struct pollfd *pfds,
 				     unsigned int nfds,
 				     unsigned short *revents)
 {
+#if SALSA_HAS_DMIX_SUPPORT
+	if (pcm->dmix)
+		return _snd_pcm_dmix_revents(pcm, pfds, revents);
+#endif
 	*revents = pfds->revents;
 	return 0;
 }
@@ -140,7 +211,7 @@ int snd_pcm_poll_descriptors_revents(snd_pcm_t *pcm, struct pollfd *pfds,
 __SALSA_EXPORT_FUNC
 int snd_pcm_info(snd_pcm_t *pcm, snd_pcm_info_t *info)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_INFO, info) < 0)
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_INFO, info) < 0)
 		return -errno;
 	return 0;
 }
@@ -159,22 +230,55 @@ int snd_pcm_status(snd_pcm_t *pcm, snd_pcm_status_t *status)
 {
 	int cmd = pcm->protocol < SNDRV_PROTOCOL_VERSION(2, 0, 13) ?
 		SNDRV_PCM_IOCTL_STATUS : SNDRV_PCM_IOCTL_STATUS_EXT;
-	if (ioctl(pcm->fd, cmd, status) < 0)
+	if (_snd_pcm_ioctl(pcm, cmd, status) < 0)
 		return -errno;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		_snd_pcm_plug_status(pcm, status);
+#endif
 	return 0;
 }
 
+/* sync the status and control records when they aren't mmapped;
+ * a locally changed appl_ptr is always pushed and a appl_ptr moved by
+ * the kernel is always pulled, regardless of SNDRV_PCM_SYNC_PTR_APPL
+ */
 __SALSA_EXPORT_FUNC
 int _snd_pcm_sync_ptr(snd_pcm_t *pcm, int flags)
 {
 	if (pcm->sync_ptr) {
+		if (pcm->appl_dirty)
+			flags &= ~SNDRV_PCM_SYNC_PTR_APPL;
+		else if (pcm->appl_stale)
+			flags |= SNDRV_PCM_SYNC_PTR_APPL;
 		pcm->sync_ptr->flags = flags;
-		if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, pcm->sync_ptr) < 0)
+		if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_SYNC_PTR, pcm->sync_ptr) < 0)
 			return -errno;
+		pcm->appl_dirty = 0;
+		pcm->appl_stale = 0;
 	}
 	return 0;
 }
 
+/* the kernel moved appl_ptr; defer the pull until the next sync */
+__SALSA_EXPORT_FUNC
+void _snd_pcm_appl_moved(snd_pcm_t *pcm)
+{
+	if (pcm->sync_ptr) {
+		pcm->appl_stale = 1;
+		pcm->sync_ptr_saved++;
+	}
+}
+
+/* number of SYNC_PTR ioctls saved by the deferred sync;
+ * always 0 when the status and control records are mmapped
+ */
+__SALSA_EXPORT_FUNC
+unsigned long snd_pcm_sync_ptr_saved(snd_pcm_t *pcm)
+{
+	return pcm->sync_ptr_saved;
+}
+
 
 __SALSA_EXPORT_FUNC
 snd_pcm_state_t snd_pcm_state(snd_pcm_t *pcm)
@@ -189,7 +293,7 @@ int _snd_pcm_hwsync(snd_pcm_t *pcm)
 {
 	if (pcm->sync_ptr)
 		return _snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_HWSYNC);
-	else if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HWSYNC) < 0)
+	else if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_HWSYNC, 0) < 0)
 		return -errno;
 	return 0;
 }
@@ -202,52 +306,67 @@ int snd_pcm_hwsync(snd_pcm_t *pcm)
 	return _snd_pcm_hwsync(pcm);
 }
 
-__SALSA_EXPORT_FUNC
-snd_pcm_sframes_t snd_pcm_avail(snd_pcm_t *pcm)
-{
-	int err = _snd_pcm_hwsync(pcm);
-	if (err < 0)
-		return err;
-	return snd_pcm_avail_update(pcm);
-}
-
 __SALSA_EXPORT_FUNC
 int snd_pcm_delay(snd_pcm_t *pcm, snd_pcm_sframes_t *delayp)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DELAY, delayp) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_DELAY, delayp) < 0)
 		return -errno;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		*delayp = _snd_pcm_plug_delay(pcm, *delayp);
+#endif
 	return 0;
 }
 
 __SALSA_EXPORT_FUNC
 int snd_pcm_resume(snd_pcm_t *pcm)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_RESUME) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_RESUME, 0) < 0)
 		return -errno;
+#if SALSA_HAS_STATS_SUPPORT
+	pcm->stats_suspend = 0;
+#endif
 	return 0;
 }
 
 __SALSA_EXPORT_FUNC
 int snd_pcm_prepare(snd_pcm_t *pcm)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PREPARE) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_PREPARE, 0) < 0)
 		return -errno;
-	return _snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+#if SALSA_HAS_STATS_SUPPORT
+	pcm->stats_xrun = 0;
+	pcm->stats_suspend = 0;
+#endif
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		_snd_pcm_plug_reset(pcm);
+#endif
+	_snd_pcm_appl_moved(pcm);
+	return 0;
 }
 
 __SALSA_EXPORT_FUNC
 int snd_pcm_reset(snd_pcm_t *pcm)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_RESET) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_RESET, 0) < 0)
 		return -errno;
-	return _snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		_snd_pcm_plug_reset(pcm);
+#endif
+	_snd_pcm_appl_moved(pcm);
+	return 0;
 }
 
 __SALSA_EXPORT_FUNC
 int snd_pcm_start(snd_pcm_t *pcm)
 {
-	_snd_pcm_sync_ptr(pcm, 0);
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_START) < 0)
+	if (pcm->appl_dirty)
+		_snd_pcm_sync_ptr(pcm, 0);
+	else if (pcm->sync_ptr)
+		pcm->sync_ptr_saved++;
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_START, 0) < 0)
 		return -errno;
 	return 0;
 }
@@ -255,15 +374,19 @@ int snd_pcm_start(snd_pcm_t *pcm)
 __SALSA_EXPORT_FUNC
 int snd_pcm_drop(snd_pcm_t *pcm)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DROP) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_DROP, 0) < 0)
 		return -errno;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		_snd_pcm_plug_reset(pcm);
+#endif
 	return 0;
 }
 
 __SALSA_EXPORT_FUNC
 int snd_pcm_drain(snd_pcm_t *pcm)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DRAIN) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_DRAIN, 0) < 0)
 		return -errno;
 	return 0;
 }
@@ -271,7 +394,7 @@ int snd_pcm_drain(snd_pcm_t *pcm)
 __SALSA_EXPORT_FUNC
 int snd_pcm_pause(snd_pcm_t *pcm, int enable)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PAUSE, enable) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_PAUSE, enable) < 0)
 		return -errno;
 	return 0;
 }
@@ -281,7 +404,11 @@ snd_pcm_sframes_t snd_pcm_rewind(snd_pcm_t *pcm, snd_pcm_uframes_t frames)
 {
 	if (frames == 0)
 		return 0;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_REWIND, &frames) < 0)
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		return _snd_pcm_plug_move(pcm, frames, 0);
+#endif
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_REWIND, &frames) < 0)
 		return -errno;
 	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
 	return frames;
@@ -292,7 +419,11 @@ snd_pcm_sframes_t snd_pcm_forward(snd_pcm_t *pcm, snd_pcm_uframes_t frames)
 {
 	if (frames == 0)
 		return 0;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_FORWARD, &frames) < 0)
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (pcm->plug)
+		return _snd_pcm_plug_move(pcm, frames, 1);
+#endif
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_FORWARD, &frames) < 0)
 		return -errno;
 	_snd_pcm_sync_ptr(pcm, SNDRV_PCM_SYNC_PTR_APPL);
 	return frames;
@@ -301,7 +432,7 @@ snd_pcm_sframes_t snd_pcm_forward(snd_pcm_t *pcm, snd_pcm_uframes_t frames)
 __SALSA_EXPORT_FUNC
 int snd_pcm_link(snd_pcm_t *pcm1, snd_pcm_t *pcm2)
 {
-	if (ioctl(pcm1->fd, SNDRV_PCM_IOCTL_LINK, pcm2->fd) < 0)
+	if (_snd_pcm_ioctl(pcm1, SNDRV_PCM_IOCTL_LINK, pcm2->fd) < 0)
 		return -errno;
 	return 0;
 }
@@ -309,7 +440,7 @@ int snd_pcm_link(snd_pcm_t *pcm1, snd_pcm_t *pcm2)
 __SALSA_EXPORT_FUNC
 int snd_pcm_unlink(snd_pcm_t *pcm)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_UNLINK) < 0)
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_UNLINK, 0) < 0)
 		return -errno;
 	return 0;
 }
@@ -405,7 +536,17 @@ ssize_t snd_pcm_samples_to_bytes(snd_pcm_t *pcm, long samples)
 
 static inline int snd_pcm_hw_refine(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 {
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_REFINE, params) < 0)
+#if SALSA_HAS_PLUG_SUPPORT
+	if (pcm->plug)
+		return _snd_pcm_plug_hw_refine(pcm, params);
+#endif
+#if SALSA_HAS_REFINE_CACHE_SUPPORT
+#if SALSA_HAS_DMIX_SUPPORT
+	if (!pcm->dmix)
+#endif
+		return _snd_pcm_refine_cache_ioctl(pcm, params);
+#endif
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_HW_REFINE, params) < 0)
 		return -errno;
 	return 0;
 }
@@ -476,6 +617,28 @@ int snd_pcm_hw_params_supports_audio_wallclock_ts(const snd_pcm_hw_params_t *par
 	return !!(params->info & SNDRV_PCM_INFO_HAS_WALL_CLOCK);
 }
 
+__SALSA_EXPORT_FUNC
+int snd_pcm_hw_params_supports_audio_ts_type(const snd_pcm_hw_params_t *params,
+					     int type)
+{
+	switch (type) {
+	case SND_PCM_AUDIO_TSTAMP_TYPE_COMPAT:
+		return !!(params->info & SNDRV_PCM_INFO_HAS_WALL_CLOCK);
+	case SND_PCM_AUDIO_TSTAMP_TYPE_DEFAULT:
+		return 1; /* based on hw_ptr, always supported */
+	case SND_PCM_AUDIO_TSTAMP_TYPE_LINK:
+		return !!(params->info & SNDRV_PCM_INFO_HAS_LINK_ATIME);
+	case SND_PCM_AUDIO_TSTAMP_TYPE_LINK_ABSOLUTE:
+		return !!(params->info & SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME);
+	case SND_PCM_AUDIO_TSTAMP_TYPE_LINK_ESTIMATED:
+		return !!(params->info & SNDRV_PCM_INFO_HAS_LINK_ESTIMATED_ATIME);
+	case SND_PCM_AUDIO_TSTAMP_TYPE_LINK_SYNCHRONIZED:
+		return !!(params->info & SNDRV_PCM_INFO_HAS_LINK_SYNCHRONIZED_ATIME);
+	default:
+		return 0;
+	}
+}
+
 __SALSA_EXPORT_FUNC
 int snd_pcm_hw_params_get_rate_numden(const snd_pcm_hw_params_t *params,
 				      unsigned int *rate_num,
@@ -2021,6 +2184,33 @@ void snd_pcm_status_get_audio_htstamp(const snd_pcm_status_t *obj, snd_htimestam
 	__copy_to_snd_htimestamp(&obj->audio_tstamp, ptr);
 }
 
+__SALSA_EXPORT_FUNC
+void snd_pcm_status_get_driver_htstamp(const snd_pcm_status_t *obj,
+				       snd_htimestamp_t *ptr)
+{
+	__copy_to_snd_htimestamp(&obj->driver_tstamp, ptr);
+}
+
+__SALSA_EXPORT_FUNC
+void snd_pcm_status_get_audio_htstamp_report(const snd_pcm_status_t *obj,
+				snd_pcm_audio_tstamp_report_t *report)
+{
+	unsigned int data = obj->audio_tstamp_data;
+
+	report->valid = data & 1;
+	report->actual_type = (data >> 1) & 0xf;
+	report->accuracy_report = (data >> 5) & 1;
+	report->accuracy = obj->audio_tstamp_accuracy;
+}
+
+__SALSA_EXPORT_FUNC
+void snd_pcm_status_set_audio_htstamp_config(snd_pcm_status_t *obj,
+				snd_pcm_audio_tstamp_config_t *config)
+{
+	obj->audio_tstamp_data = (config->type_requested & 0xf) |
+		(config->report_delay << 4);
+}
+
 __SALSA_EXPORT_FUNC
 snd_pcm_sframes_t snd_pcm_status_get_delay(const snd_pcm_status_t *obj)
 {
@@ -2184,58 +2374,6 @@ int snd_pcm_open_lconf(snd_pcm_t **pcm, const char *name,
 	return -ENXIO;
 }
 
-__SALSA_EXPORT_FUNC
-snd_pcm_sframes_t snd_pcm_mmap_writei(snd_pcm_t *pcm, const void *buffer,
-				      snd_pcm_uframes_t size)
-{
-	const snd_pcm_channel_area_t *areas;
-	snd_pcm_uframes_t offset;
-
-	snd_pcm_mmap_begin(pcm, &areas, &offset, &size);
-	memcpy(snd_pcm_channel_area_addr(areas, offset), buffer,
-	       snd_pcm_frames_to_bytes(pcm, size));
-	return snd_pcm_mmap_commit(pcm, offset, size);
-}
-
-__SALSA_EXPORT_FUNC
-snd_pcm_sframes_t snd_pcm_mmap_readi(snd_pcm_t *pcm, void *buffer,
-				     snd_pcm_uframes_t size)
-{
-	const snd_pcm_channel_area_t *areas;
-	snd_pcm_uframes_t offset;
-
-	snd_pcm_mmap_begin(pcm, &areas, &offset, &size);
-	memcpy(buffer, snd_pcm_channel_area_addr(areas, offset),
-	       snd_pcm_frames_to_bytes(pcm, size));
-	return snd_pcm_mmap_commit(pcm, offset, size);
-}
-
-__SALSA_EXPORT_FUNC __SALSA_NOT_IMPLEMENTED
-snd_pcm_sframes_t snd_pcm_mmap_writen(snd_pcm_t *pcm, void **bufs,
-				      snd_pcm_uframes_t size)
-{
-	return -ENXIO;
-}
-
-__SALSA_EXPORT_FUNC __SALSA_NOT_IMPLEMENTED
-snd_pcm_sframes_t snd_pcm_mmap_readn(snd_pcm_t *pcm, void **bufs,
-				     snd_pcm_uframes_t size)
-{
-	return -ENXIO;
-}
-
-__SALSA_EXPORT_FUNC __SALSA_NOT_IMPLEMENTED
-int snd_pcm_set_params(snd_pcm_t *pcm,
-                       snd_pcm_format_t format,
-                       snd_pcm_access_t acc,
-                       unsigned int channels,
-                       unsigned int rate,
-                       int soft_resample,
-                       unsigned int latency)
-{
-	return -ENXIO;
-}
-
 #if SALSA_HAS_ASYNC_SUPPORT
 
 __SALSA_EXPORT_FUNC
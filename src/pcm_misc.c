@@ -203,51 +203,73 @@ const struct snd_pcm_format_data _snd_pcm_formats[SND_PCM_FORMAT_LAST+1] = {
 	},
 };
 
+/* fill the buffer with the silence pattern of the format repeatedly */
+static void silence_pattern(const struct snd_pcm_format_data *fmt,
+			    unsigned char *buf, unsigned int size)
+{
+	unsigned int i, w = fmt->phys / 8;
+
+	for (i = 0; i < size; i++)
+		buf[i] = fmt->silence[i % w];
+}
+
+/* whether the silence can be filled by memset() */
+static int silence_is_uniform(const struct snd_pcm_format_data *fmt)
+{
+	int i;
+
+	for (i = 1; i < fmt->phys / 8; i++)
+		if (fmt->silence[i] != fmt->silence[0])
+			return 0;
+	return 1;
+}
+
+/* returns the first 64 bits of a silenced buffer in the memory order,
+ * i.e. the silence sample repeated for the sample widths up to 64 bits
+ */
 u_int64_t snd_pcm_format_silence_64(snd_pcm_format_t format)
 {
 	const struct snd_pcm_format_data *fmt;
-	int i, p, w;
 	u_int64_t silence;
 
 	fmt = &_snd_pcm_formats[format];
-	if (fmt->phys <= 0)
+	if (fmt->phys < 8)
 		return 0;
-	w = fmt->width / 8;
-	p = 0;
-	silence = 0;
-	while (p < w) {
-		for (i = 0; i < w; i++, p++)
-			silence = (silence << 8) | fmt->silence[i];
-	}
+	silence_pattern(fmt, (unsigned char *)&silence, sizeof(silence));
 	return silence;
 }
 
 int snd_pcm_format_set_silence(snd_pcm_format_t format, void *data,
 			       unsigned int samples)
 {
+	const struct snd_pcm_format_data *fmt;
 	int width;
+	size_t bytes;
 	unsigned char *dst;
-	const unsigned char *pat;
+	u_int64_t blk[3]; /* 24 bytes, a multiple of any sample size */
 
 	if (!samples)
 		return 0;
-	width = _snd_pcm_formats[format].phys;
+	fmt = &_snd_pcm_formats[format];
+	width = fmt->phys;
 	if (width <= 0)
 		return -EINVAL;
-	pat = _snd_pcm_formats[format].silence;
-	/* signed or 1 byte data */
-	if (_snd_pcm_formats[format].signd == 1 || width <= 8) {
-		unsigned int bytes = samples * width / 8;
-		memset(data, *pat, bytes);
+	bytes = (size_t)samples * width / 8;
+	/* signed, 1 byte data or a pattern like DSD */
+	if (fmt->signd == 1 || width <= 8 || silence_is_uniform(fmt)) {
+		memset(data, fmt->silence[0], bytes);
 		return 0;
 	}
-	/* non-zero samples, fill using a loop */
-	width /= 8;
+	/* non-zero samples, fill with 64bit words */
+	silence_pattern(fmt, (unsigned char *)blk, sizeof(blk));
 	dst = data;
-	while (samples--) {
-		memcpy(dst, pat, width);
-		dst += width;
+	for (; bytes >= sizeof(blk); bytes -= sizeof(blk)) {
+		memcpy(dst, &blk[0], 8);
+		memcpy(dst + 8, &blk[1], 8);
+		memcpy(dst + 16, &blk[2], 8);
+		dst += sizeof(blk);
 	}
+	memcpy(dst, blk, bytes);
 	return 0;
 }
 
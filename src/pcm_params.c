@@ -342,6 +342,16 @@ static int snd_interval_refine_set(snd_interval_t *i, unsigned int val)
  * HANDLE HW_PARAMS, SW_PARAMS
  */
 
+/* the wrap point of the ring pointers, as the kernel computes it */
+snd_pcm_uframes_t _snd_pcm_boundary(snd_pcm_uframes_t buffer_size)
+{
+	snd_pcm_uframes_t boundary = buffer_size;
+
+	while (boundary * 2 <= LONG_MAX - buffer_size)
+		boundary *= 2;
+	return boundary;
+}
+
 /* set up default sw_params values */
 static int snd_pcm_sw_params_default(snd_pcm_t *pcm,
 				     snd_pcm_sw_params_t *params)
@@ -356,9 +366,7 @@ static int snd_pcm_sw_params_default(snd_pcm_t *pcm,
 	params->stop_threshold = pcm->buffer_size;
 	params->silence_threshold = 0;
 	params->silence_size = 0;
-	params->boundary = pcm->buffer_size;
-	while (params->boundary * 2 <= LONG_MAX - pcm->buffer_size)
-		params->boundary *= 2;
+	params->boundary = _snd_pcm_boundary(pcm->buffer_size);
 	return 0;
 }
 
@@ -442,6 +450,7 @@ static void _snd_pcm_hw_params_any(snd_pcm_hw_params_t *params)
 
 int snd_pcm_hw_params_any(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 {
+	_snd_pcm_refine_cache_check(pcm);
 	_snd_pcm_hw_params_any(params);
 	return snd_pcm_hw_refine(pcm, params);
 }
@@ -532,6 +541,87 @@ static int hw_param_set_min(snd_pcm_hw_params_t *params,
 				       val, openmin, 0);
 }
 
+/*
+ * BATCHED REFINE
+ *
+ * While a batch is open, the setters narrow the masks and intervals
+ * only in user space and record themselves.  The kernel refines the
+ * result once at the commit; if that fails, the recorded setters are
+ * replayed step by step from the params at the batch start.
+ */
+enum {
+	HW_OP_SET,
+	HW_OP_SET_MIN,
+	HW_OP_SET_MAX,
+	HW_OP_SET_MINMAX,
+	HW_OP_SET_NEAR,
+	HW_OP_SET_FIRST,
+	HW_OP_SET_LAST,
+	HW_OP_SET_INTEGER,
+	HW_OP_SET_MASK,
+};
+
+#if SALSA_HAS_HW_BATCH_SUPPORT
+
+struct hw_batch_op {
+	unsigned char op;
+	unsigned char var;
+	int dir;
+	unsigned int val;
+	int maxdir;
+	unsigned int max;
+	snd_mask_t mask;
+};
+
+struct snd_pcm_hw_batch {
+	snd_pcm_hw_params_t start;
+	unsigned int count;
+	unsigned int size;
+	struct hw_batch_op *ops;
+	int err;			/* failed to record */
+};
+
+#define hw_batch_active(pcm)	((pcm)->hw_batch != NULL)
+
+static void hw_batch_add(snd_pcm_t *pcm, int op, int var,
+			 unsigned int val, int dir,
+			 unsigned int max, int maxdir, const snd_mask_t *mask)
+{
+	struct snd_pcm_hw_batch *b = pcm->hw_batch;
+	struct hw_batch_op *o;
+
+	if (!b)
+		return;
+	if (b->count >= b->size) {
+		unsigned int size = b->size ? b->size * 2 : 16;
+		o = realloc(b->ops, size * sizeof(*o));
+		if (!o) {
+			b->err = -ENOMEM;
+			return;
+		}
+		b->ops = o;
+		b->size = size;
+	}
+	o = &b->ops[b->count++];
+	o->op = op;
+	o->var = var;
+	o->val = val;
+	o->dir = dir;
+	o->max = max;
+	o->maxdir = maxdir;
+	if (mask)
+		o->mask = *mask;
+}
+#else
+#define hw_batch_active(pcm)	0
+static inline void hw_batch_add(snd_pcm_t *pcm, int op, int var,
+				unsigned int val, int dir,
+				unsigned int max, int maxdir,
+				const snd_mask_t *mask)
+{
+}
+#endif /* SALSA_HAS_HW_BATCH_SUPPORT */
+
 static int hw_param_update_var(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 			       int var, int changed)
 {
@@ -541,6 +631,12 @@ static int hw_param_update_var(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 		params->cmask |= 1 << var;
 		params->rmask |= 1 << var;
 	}
+	if (hw_batch_active(pcm)) {
+		/* the refine is deferred to the commit */
+		if (snd_pcm_hw_param_empty(params, var))
+			return -ENOENT;
+		return 0;
+	}
 	if (params->rmask) {
 		changed = snd_pcm_hw_refine(pcm, params);
 		if (changed < 0)
@@ -551,8 +647,8 @@ static int hw_param_update_var(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	return 0;
 }
 
-int _snd_pcm_hw_param_set_min(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
-			      int var, unsigned int *val, int *dir)
+static int hw_set_min(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+		      int var, unsigned int *val, int *dir)
 {
 	snd_pcm_hw_params_t save;
 	int err;
@@ -566,6 +662,18 @@ int _snd_pcm_hw_param_set_min(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	return err;
 }
 
+int _snd_pcm_hw_param_set_min(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			      int var, unsigned int *val, int *dir)
+{
+	unsigned int v = *val;
+	int d = dir ? *dir : 0;
+	int err = hw_set_min(pcm, params, var, val, dir);
+
+	if (!err)
+		hw_batch_add(pcm, HW_OP_SET_MIN, var, v, d, 0, 0, NULL);
+	return err;
+}
+
 static int hw_param_set_max(snd_pcm_hw_params_t *params,
 			    int var, unsigned int val, int dir)
 {
@@ -584,8 +692,8 @@ static int hw_param_set_max(snd_pcm_hw_params_t *params,
 				       val, openmax, 0);
 }
 
-int _snd_pcm_hw_param_set_max(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
-			      int var, unsigned int *val, int *dir)
+static int hw_set_max(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+		      int var, unsigned int *val, int *dir)
 {
 	snd_pcm_hw_params_t save;
 	int err;
@@ -599,6 +707,18 @@ int _snd_pcm_hw_param_set_max(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	return err;
 }
 
+int _snd_pcm_hw_param_set_max(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			      int var, unsigned int *val, int *dir)
+{
+	unsigned int v = *val;
+	int d = dir ? *dir : 0;
+	int err = hw_set_max(pcm, params, var, val, dir);
+
+	if (!err)
+		hw_batch_add(pcm, HW_OP_SET_MAX, var, v, d, 0, 0, NULL);
+	return err;
+}
+
 static int hw_param_set_minmax(snd_pcm_hw_params_t *params,
 			       int var,
 			       unsigned int min, int mindir,
@@ -628,6 +748,9 @@ int _snd_pcm_hw_param_set_minmax(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 				  *max, maxdir ? *maxdir : 0);
 	err = hw_param_update_var(pcm, params, var, err);
 	if (!err) {
+		hw_batch_add(pcm, HW_OP_SET_MINMAX, var,
+			     *min, mindir ? *mindir : 0,
+			     *max, maxdir ? *maxdir : 0, NULL);
 		err = _snd_pcm_hw_param_get_min(params, var, min, mindir);
 		if (err >= 0)
 			return _snd_pcm_hw_param_get_max(params, var, max,
@@ -677,8 +800,8 @@ static int hw_param_set(snd_pcm_hw_params_t *params,
 	}
 }
 
-int _snd_pcm_hw_param_set(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
-			  int var, unsigned int val, int dir)
+static int hw_set(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+		  int var, unsigned int val, int dir)
 {
 	snd_pcm_hw_params_t save = *params;
 	int err = hw_param_set(params, var, val, dir);
@@ -688,11 +811,21 @@ int _snd_pcm_hw_param_set(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	return err;
 }
 
+int _snd_pcm_hw_param_set(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			  int var, unsigned int val, int dir)
+{
+	int err = hw_set(pcm, params, var, val, dir);
+
+	if (!err)
+		hw_batch_add(pcm, HW_OP_SET, var, val, dir, 0, 0, NULL);
+	return err;
+}
+
 int _snd_pcm_hw_param_test(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 			   int var, unsigned int val, int *dir)
 {
 	snd_pcm_hw_params_t save = *params;
-	int err = _snd_pcm_hw_param_set(pcm, params, var, val, dir ? *dir : 0);
+	int err = hw_set(pcm, params, var, val, dir ? *dir : 0);
 	*params = save;
 	return err;
 }
@@ -714,6 +847,8 @@ int _snd_pcm_hw_param_set_integer(snd_pcm_t *pcm,
 	err = hw_param_update_var(pcm, params, var, 1);
 	if (err < 0)
 		*params = save;
+	else
+		hw_batch_add(pcm, HW_OP_SET_INTEGER, var, 0, 0, 0, 0, NULL);
 	return err;
 }
 
@@ -724,6 +859,10 @@ int _snd_pcm_hw_param_set_mask(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 		params->cmask |= 1 << var;
 		params->rmask |= 1 << var;
 	}
+	if (hw_batch_active(pcm)) {
+		hw_batch_add(pcm, HW_OP_SET_MASK, var, 0, 0, 0, 0, val);
+		return 0;
+	}
 	if (params->rmask)
 		return snd_pcm_hw_refine(pcm, params);
 	return 0;
@@ -745,8 +884,8 @@ static int hw_param_set_last(snd_pcm_hw_params_t *params, int var)
 		return snd_interval_refine_last(hw_param_interval(params, var));
 }	
 
-int _snd_pcm_hw_param_set_first(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
-				int var, unsigned int *val, int *dir)
+static int hw_set_first(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			int var, unsigned int *val, int *dir)
 {
 	int err = hw_param_set_first(params, var);
 	err = hw_param_update_var(pcm, params, var, err);
@@ -755,8 +894,18 @@ int _snd_pcm_hw_param_set_first(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	return err;
 }
 
-int _snd_pcm_hw_param_set_last(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
-			       int var, unsigned int *val, int *dir)
+int _snd_pcm_hw_param_set_first(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+				int var, unsigned int *val, int *dir)
+{
+	int err = hw_set_first(pcm, params, var, val, dir);
+
+	if (!err)
+		hw_batch_add(pcm, HW_OP_SET_FIRST, var, 0, 0, 0, 0, NULL);
+	return err;
+}
+
+static int hw_set_last(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+		       int var, unsigned int *val, int *dir)
 {
 	int err = hw_param_set_last(params, var);
 	err = hw_param_update_var(pcm, params, var, err);
@@ -765,6 +914,16 @@ int _snd_pcm_hw_param_set_last(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	return err;
 }
 
+int _snd_pcm_hw_param_set_last(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			       int var, unsigned int *val, int *dir)
+{
+	int err = hw_set_last(pcm, params, var, val, dir);
+
+	if (!err)
+		hw_batch_add(pcm, HW_OP_SET_LAST, var, 0, 0, 0, 0, NULL);
+	return err;
+}
+
 /*
  */
 static void boundary_sub(int a, int adir, int b, int bdir, int *c, int *cdir)
@@ -806,8 +965,8 @@ static int boundary_nearer(int min, int mindir, int best, int bestdir,
 	return boundary_lt(dmin, dmindir, dmax, dmaxdir);
 }
 
-int _snd_pcm_hw_param_set_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
-			       int var, unsigned int *val, int *dir)
+static int hw_set_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+		       int var, unsigned int *val, int *dir)
 {
 	snd_pcm_hw_params_t save;
 	int err;
@@ -832,7 +991,7 @@ int _snd_pcm_hw_param_set_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 	}
 	save = *params;
 	saved_min = min;
-	err = _snd_pcm_hw_param_set_min(pcm, params, var, &min, &mindir);
+	err = hw_set_min(pcm, params, var, &min, &mindir);
 
 	i = hw_param_interval(params, var);
 	if (!interval_is_empty(i) && interval_is_single(i))
@@ -843,8 +1002,7 @@ int _snd_pcm_hw_param_set_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 		if (min == saved_min && mindir == valdir)
 			goto _end;
 		params1 = save;
-		err = _snd_pcm_hw_param_set_max(pcm, &params1, var,
-						&max, &maxdir);
+		err = hw_set_max(pcm, &params1, var, &max, &maxdir);
 		if (err < 0)
 			goto _end;
 		if (boundary_nearer(max, maxdir, best, valdir, min, mindir)) {
@@ -853,16 +1011,28 @@ int _snd_pcm_hw_param_set_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
 		}
 	} else {
 		*params = save;
-		err = _snd_pcm_hw_param_set_max(pcm, params, var, &max, &maxdir);
+		err = hw_set_max(pcm, params, var, &max, &maxdir);
 		if (err < 0)
 			return err;
 		last = 1;
 	}
  _end:
 	if (last)
-		err = _snd_pcm_hw_param_set_last(pcm, params, var, val, dir);
+		err = hw_set_last(pcm, params, var, val, dir);
 	else
-		err = _snd_pcm_hw_param_set_first(pcm, params, var, val, dir);
+		err = hw_set_first(pcm, params, var, val, dir);
+	return err;
+}
+
+int _snd_pcm_hw_param_set_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			       int var, unsigned int *val, int *dir)
+{
+	unsigned int v = *val;
+	int d = dir ? *dir : 0;
+	int err = hw_set_near(pcm, params, var, val, dir);
+
+	if (!err)
+		hw_batch_add(pcm, HW_OP_SET_NEAR, var, v, d, 0, 0, NULL);
 	return err;
 }
 
@@ -889,8 +1059,39 @@ static int snd_pcm_hw_params_choose(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 		{ SNDRV_PCM_HW_PARAM_TICK_TIME, 0 },
 	};
 	int i, err;
+#if SALSA_HAS_HW_BATCH_SUPPORT
+	snd_pcm_hw_params_t save = *params;
+	int var;
+
+	/* Pick access, format, subformat, channels and rate at once.
+	 * If the kernel accepts the combination, it's the same as chosen
+	 * one by one, since each is the first of a superset; otherwise
+	 * go step by step from the beginning.
+	 */
+	err = 0;
+	for (i = 0; i <= 4 && err >= 0; i++) {
+		var = vars[i].var;
+		err = hw_param_set_first(params, var);
+		if (err > 0) {
+			params->cmask |= 1 << var;
+			params->rmask |= 1 << var;
+		}
+	}
+	if (err >= 0 && params->rmask)
+		err = snd_pcm_hw_refine(pcm, params);
+	for (i = 0; i <= 4 && err >= 0; i++) {
+		if (snd_pcm_hw_param_empty(params, vars[i].var))
+			err = -ENOENT;
+	}
+	if (err < 0) {
+		*params = save;
+		i = 0;
+	}
+#else
+	i = 0;
+#endif
 
-	for (i = 0; i < sizeof(vars)/sizeof(vars[0]); i++) {
+	for (; i < sizeof(vars)/sizeof(vars[0]); i++) {
 		if (vars[i].last)
 			err = _snd_pcm_hw_param_set_last(pcm, params,
 							 vars[i].var,
@@ -905,6 +1106,881 @@ static int snd_pcm_hw_params_choose(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 	return 0;
 }
 
+#if SALSA_HAS_HW_BATCH_SUPPORT
+int snd_pcm_hw_params_batch_begin(snd_pcm_t *pcm,
+				  const snd_pcm_hw_params_t *params)
+{
+	struct snd_pcm_hw_batch *b;
+
+	if (pcm->hw_batch)
+		return -EBUSY;
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	b->start = *params;
+	pcm->hw_batch = b;
+	return 0;
+}
+
+void snd_pcm_hw_params_batch_abort(snd_pcm_t *pcm)
+{
+	struct snd_pcm_hw_batch *b = pcm->hw_batch;
+
+	if (b) {
+		pcm->hw_batch = NULL;
+		free(b->ops);
+		free(b);
+	}
+}
+
+/* redo the recorded setters with a refine each */
+static int hw_batch_replay(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			   const struct snd_pcm_hw_batch *b)
+{
+	const struct hw_batch_op *o;
+	unsigned int val, max;
+	int dir, maxdir, err, ret = 0;
+
+	*params = b->start;
+	for (o = b->ops; o < b->ops + b->count; o++) {
+		val = o->val;
+		dir = o->dir;
+		max = o->max;
+		maxdir = o->maxdir;
+		switch (o->op) {
+		case HW_OP_SET:
+			err = hw_set(pcm, params, o->var, val, dir);
+			break;
+		case HW_OP_SET_MIN:
+			err = hw_set_min(pcm, params, o->var, &val, &dir);
+			break;
+		case HW_OP_SET_MAX:
+			err = hw_set_max(pcm, params, o->var, &val, &dir);
+			break;
+		case HW_OP_SET_MINMAX:
+			err = _snd_pcm_hw_param_set_minmax(pcm, params, o->var,
+							   &val, &dir,
+							   &max, &maxdir);
+			break;
+		case HW_OP_SET_NEAR:
+			err = hw_set_near(pcm, params, o->var, &val, &dir);
+			break;
+		case HW_OP_SET_FIRST:
+			err = hw_set_first(pcm, params, o->var, NULL, NULL);
+			break;
+		case HW_OP_SET_LAST:
+			err = hw_set_last(pcm, params, o->var, NULL, NULL);
+			break;
+		case HW_OP_SET_INTEGER:
+			err = _snd_pcm_hw_param_set_integer(pcm, params,
+							    o->var);
+			break;
+		case HW_OP_SET_MASK:
+			err = _snd_pcm_hw_param_set_mask(pcm, params, o->var,
+							 &o->mask);
+			break;
+		default:
+			err = -EINVAL;
+			break;
+		}
+		/* a failed setter leaves the params as is, like before */
+		if (err < 0 && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/* refine the batched setup at once; if the kernel rejects it, fall
+ * back to the step-wise refine.  The values the setters returned
+ * during the batch are provisional; read them again from params.
+ */
+int snd_pcm_hw_params_batch_commit(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	struct snd_pcm_hw_batch *b = pcm->hw_batch;
+	unsigned int i;
+	int err;
+
+	if (!b)
+		return -EBADFD;
+	pcm->hw_batch = NULL;
+	err = b->err;
+	if (!err && params->rmask)
+		err = snd_pcm_hw_refine(pcm, params);
+	/* the same check as each setter does after its refine */
+	for (i = 0; i < b->count && !err; i++) {
+		if (snd_pcm_hw_param_empty(params, b->ops[i].var))
+			err = -ENOENT;
+	}
+	if (err < 0)
+		err = hw_batch_replay(pcm, params, b);
+	free(b->ops);
+	free(b);
+	return err;
+}
+#endif /* SALSA_HAS_HW_BATCH_SUPPORT */
+
+#if SALSA_HAS_PLUG_SUPPORT || SALSA_HAS_DMIX_SUPPORT
+/* refine on the hw PCM itself, bypassing the emulation */
+static int hw_refine_direct(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+#if SALSA_HAS_REFINE_CACHE_SUPPORT
+	return _snd_pcm_refine_cache_ioctl(pcm, params);
+#else
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_HW_REFINE, params) < 0)
+		return -errno;
+	return 0;
+#endif
+}
+#endif
+
+#if SALSA_HAS_PLUG_SUPPORT
+/*
+ * PLUG LAYER
+ *
+ * The app side may choose any format convertible by pcm_plug.c with
+ * RW access.  When the format isn't supported by the hardware, the
+ * nearest hw format is set up with the corresponding MMAP access, and
+ * the read/write calls convert directly from/to the mmapped ring.
+ */
+
+/* the bits/bytes params depend on the format on each side */
+static const int plug_format_vars[] = {
+	SNDRV_PCM_HW_PARAM_SAMPLE_BITS,
+	SNDRV_PCM_HW_PARAM_FRAME_BITS,
+	SNDRV_PCM_HW_PARAM_PERIOD_BYTES,
+	SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+};
+
+static int plug_mmap_access(int access)
+{
+	switch (access) {
+	case SND_PCM_ACCESS_RW_INTERLEAVED:
+		return SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+		return SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+	default:
+		return -1;
+	}
+}
+
+#define PLUG_FORMAT_VARS \
+	(sizeof(plug_format_vars) / sizeof(plug_format_vars[0]))
+
+static int plug_is_format_var(int var)
+{
+	unsigned int k;
+
+	for (k = 0; k < PLUG_FORMAT_VARS; k++)
+		if (plug_format_vars[k] == var)
+			return 1;
+	return 0;
+}
+
+static void plug_release_format_vars(snd_pcm_hw_params_t *params)
+{
+	unsigned int k;
+
+	for (k = 0; k < PLUG_FORMAT_VARS; k++)
+		interval_set_any(hw_param_interval(params,
+						   plug_format_vars[k]));
+	params->rmask = ~0U;
+}
+
+static int plug_interval_refine_range(snd_pcm_hw_params_t *params, int var,
+				      unsigned long long min,
+				      unsigned long long max)
+{
+	snd_interval_t *i = hw_param_interval(params, var);
+	int err;
+
+	if (max > UINT_MAX)
+		max = UINT_MAX;
+	err = snd_interval_refine_min(i, min > UINT_MAX ? UINT_MAX : min,
+				      0, 0);
+	if (err < 0)
+		return err;
+	return snd_interval_refine_max(i, max, 0, 0);
+}
+
+/* recompute the format-dependent params for the app side */
+static int plug_refine_format_vars(snd_pcm_hw_params_t *params)
+{
+	const snd_mask_t *fmask =
+		hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT);
+	const snd_interval_t *ch =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_CHANNELS);
+	const snd_interval_t *psize =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+	const snd_interval_t *bsize =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+	unsigned int smin = UINT_MAX, smax = 0;
+	unsigned long long fmin, fmax;
+	int f, err;
+
+	for (f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+		int w;
+		if (!mask_get(fmask, f))
+			continue;
+		w = snd_pcm_format_physical_width(f);
+		if (w <= 0)
+			continue;
+		if (w < smin)
+			smin = w;
+		if (w > smax)
+			smax = w;
+	}
+	if (!smax)
+		return -EINVAL;
+	err = plug_interval_refine_range(params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS,
+					 smin, smax);
+	if (err < 0)
+		return err;
+	fmin = (unsigned long long)smin * ch->min;
+	fmax = (unsigned long long)smax * ch->max;
+	err = plug_interval_refine_range(params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
+					 fmin, fmax);
+	if (err < 0)
+		return err;
+	err = plug_interval_refine_range(params,
+					 SNDRV_PCM_HW_PARAM_PERIOD_BYTES,
+					 psize->min * fmin / 8,
+					 psize->max * fmax / 8);
+	if (err < 0)
+		return err;
+	return plug_interval_refine_range(params,
+					  SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+					  bsize->min * fmin / 8,
+					  bsize->max * fmax / 8);
+}
+
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+/*
+ * With the rate conversion, the hw side gets the rate and the sizes
+ * scaled by the rate ratio, and the kernel derives the rest.  The app
+ * side times, sizes and periods are kept in line by the rules below.
+ */
+static const int plug_rate_vars[] = {
+	SNDRV_PCM_HW_PARAM_RATE,
+	SNDRV_PCM_HW_PARAM_PERIOD_TIME,
+	SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+	SNDRV_PCM_HW_PARAM_PERIODS,
+	SNDRV_PCM_HW_PARAM_BUFFER_TIME,
+	SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+	SNDRV_PCM_HW_PARAM_TICK_TIME,
+};
+
+#define PLUG_RATE_VARS \
+	(sizeof(plug_rate_vars) / sizeof(plug_rate_vars[0]))
+
+/* the rates tried for the hw side, in addition to the hw min and max */
+static const unsigned int plug_std_rates[] = {
+	8000, 11025, 16000, 22050, 32000, 44100, 48000,
+	64000, 88200, 96000, 176400, 192000,
+};
+
+#define PLUG_STD_RATES \
+	(sizeof(plug_std_rates) / sizeof(plug_std_rates[0]))
+
+static int plug_is_rate_var(int var)
+{
+	unsigned int k;
+
+	for (k = 0; k < PLUG_RATE_VARS; k++)
+		if (plug_rate_vars[k] == var)
+			return 1;
+	return 0;
+}
+
+static void plug_release_rate_vars(snd_pcm_hw_params_t *params)
+{
+	unsigned int k;
+
+	for (k = 0; k < PLUG_RATE_VARS; k++)
+		interval_set_any(hw_param_interval(params, plug_rate_vars[k]));
+	params->rmask = ~0U;
+}
+
+/* refine the dst var with the src interval scaled by num / den */
+static int plug_interval_refine_scaled(snd_pcm_hw_params_t *dst,
+				       const snd_pcm_hw_params_t *src,
+				       int var, unsigned int num,
+				       unsigned int den)
+{
+	const snd_interval_t *i = hw_param_interval_c(src, var);
+
+	return plug_interval_refine_range(dst, var,
+		(unsigned long long)i->min * num / den,
+		((unsigned long long)i->max * num + den - 1) / den);
+}
+
+/* the time and the size of a period or a buffer at the app rate */
+static int plug_refine_size_time(snd_pcm_hw_params_t *params,
+				 int size_var, int time_var)
+{
+	const snd_interval_t *rate =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+	const snd_interval_t *size = hw_param_interval(params, size_var);
+	const snd_interval_t *time = hw_param_interval(params, time_var);
+	int err;
+
+	err = plug_interval_refine_range(params, size_var,
+		(unsigned long long)time->min * rate->min / 1000000,
+		((unsigned long long)time->max * rate->max + 999999) / 1000000);
+	if (err < 0)
+		return err;
+	return plug_interval_refine_range(params, time_var,
+		(unsigned long long)size->min * 1000000 / rate->max,
+		((unsigned long long)size->max * 1000000 + rate->min - 1) /
+		rate->min);
+}
+
+static int plug_refine_rate_vars(snd_pcm_hw_params_t *params)
+{
+	const snd_interval_t *psize =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+	const snd_interval_t *bsize =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+	const snd_interval_t *periods =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_PERIODS);
+	int loop, err;
+
+	err = plug_interval_refine_range(params, SNDRV_PCM_HW_PARAM_RATE,
+					 PCM_PLUG_RATE_MIN, PCM_PLUG_RATE_MAX);
+	if (err < 0)
+		return err;
+	/* twice for passing the changes around */
+	for (loop = 0; loop < 2; loop++) {
+		err = plug_refine_size_time(params,
+					    SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+					    SNDRV_PCM_HW_PARAM_PERIOD_TIME);
+		if (err < 0)
+			return err;
+		err = plug_refine_size_time(params,
+					    SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+					    SNDRV_PCM_HW_PARAM_BUFFER_TIME);
+		if (err < 0)
+			return err;
+		if (!psize->min)
+			continue;
+		err = plug_interval_refine_range(params,
+			SNDRV_PCM_HW_PARAM_PERIODS,
+			bsize->min / psize->max,
+			((unsigned long long)bsize->max + psize->min - 1) /
+			psize->min);
+		if (err < 0)
+			return err;
+		err = plug_interval_refine_range(params,
+			SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+			(unsigned long long)psize->min * periods->min,
+			(unsigned long long)psize->max * periods->max);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+static int plug_try_rate(snd_pcm_t *pcm, const snd_pcm_hw_params_t *params,
+			 unsigned int rate)
+{
+	snd_pcm_hw_params_t hw = *params;
+
+	if (snd_interval_refine_set(hw_param_interval(&hw,
+						      SNDRV_PCM_HW_PARAM_RATE),
+				    rate) < 0)
+		return 0;
+	hw.rmask = ~0U;
+	return hw_refine_direct(pcm, &hw) >= 0;
+}
+
+/* pick the hw rate for the given app rate: the rate itself if the
+ * hardware can do it, otherwise the nearest one, higher on ties;
+ * returns 0 if nothing works
+ */
+static unsigned int plug_choose_rate(snd_pcm_t *pcm,
+				     const snd_pcm_hw_params_t *params,
+				     unsigned int rate)
+{
+	snd_pcm_hw_params_t hw = *params;
+	const snd_interval_t *hw_rate;
+	unsigned int rates[PLUG_STD_RATES + 2];
+	unsigned int i, j, n = 0;
+
+	plug_release_rate_vars(&hw);
+	if (plug_try_rate(pcm, &hw, rate))
+		return rate;
+	if (hw_refine_direct(pcm, &hw) < 0)
+		return 0;
+	hw_rate = hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_RATE);
+	rates[n++] = hw_rate->min;
+	rates[n++] = hw_rate->max;
+	for (i = 0; i < PLUG_STD_RATES; i++)
+		if (plug_std_rates[i] > hw_rate->min &&
+		    plug_std_rates[i] < hw_rate->max)
+			rates[n++] = plug_std_rates[i];
+	/* sort by the distance from the app rate */
+	for (i = 1; i < n; i++) {
+		unsigned int r = rates[i];
+		unsigned int d = r > rate ? r - rate : rate - r;
+
+		for (j = i; j > 0; j--) {
+			unsigned int p = rates[j - 1];
+			unsigned int pd = p > rate ? p - rate : rate - p;
+
+			if (pd < d || (pd == d && p > r))
+				break;
+			rates[j] = p;
+		}
+		rates[j] = r;
+	}
+	for (i = 0; i < n; i++) {
+		if (rates[i] < PCM_PLUG_RATE_MIN ||
+		    rates[i] > PCM_PLUG_RATE_MAX)
+			continue;
+		if (plug_try_rate(pcm, &hw, rates[i]))
+			return rates[i];
+	}
+	return 0;
+}
+
+/* set up the hw side for converting from/to the app rate */
+static int plug_rate_hw_vars(snd_pcm_hw_params_t *hw,
+			     snd_pcm_hw_params_t *params,
+			     unsigned int rate, unsigned int hw_rate)
+{
+	int err;
+
+	err = plug_refine_rate_vars(params);
+	if (err < 0)
+		return err;
+	plug_release_rate_vars(hw);
+	snd_interval_refine_set(hw_param_interval(hw, SNDRV_PCM_HW_PARAM_RATE),
+				hw_rate);
+	err = plug_interval_refine_scaled(hw, params,
+					  SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+					  hw_rate, rate);
+	if (err < 0)
+		return err;
+	return plug_interval_refine_scaled(hw, params,
+					   SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+					   hw_rate, rate);
+}
+#endif /* SALSA_HAS_PLUG_RATE_SUPPORT */
+
+/* widen the hw side to all convertible formats and MMAP access */
+static void plug_widen_hw(snd_pcm_hw_params_t *hw)
+{
+	snd_mask_t *fmask = hw_param_mask(hw, SNDRV_PCM_HW_PARAM_FORMAT);
+	snd_mask_t *amask = hw_param_mask(hw, SNDRV_PCM_HW_PARAM_ACCESS);
+	int f, a;
+
+	for (f = 0; f <= SND_PCM_FORMAT_LAST; f++)
+		if (_snd_pcm_plug_format_supported(f))
+			mask_set(fmask, f);
+	for (a = 0; a <= SND_PCM_ACCESS_LAST; a++)
+		if (mask_get(amask, a) && plug_mmap_access(a) >= 0)
+			mask_set(amask, plug_mmap_access(a));
+	plug_release_format_vars(hw);
+}
+
+int _snd_pcm_plug_hw_refine(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	snd_pcm_hw_params_t hw = *params;
+	snd_mask_t *fmask = hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT);
+	snd_mask_t *amask = hw_param_mask(params, SNDRV_PCM_HW_PARAM_ACCESS);
+	snd_mask_t *hw_fmask = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_FORMAT);
+	snd_mask_t *hw_amask = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_ACCESS);
+	int convert = 0, hw_convert = 0;
+	int f, a, err;
+	unsigned int k;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	const snd_interval_t *rate =
+		hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+	unsigned int app_rate = 0, hw_rate = 0;
+	int rate_convert = 0;
+#endif
+
+	/* conversion is possible only with a convertible format and
+	 * RW access on the app side
+	 */
+	for (f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+		if (mask_get(fmask, f) && _snd_pcm_plug_format_supported(f)) {
+			convert = 1;
+			break;
+		}
+	}
+	if (!mask_get(amask, SND_PCM_ACCESS_RW_INTERLEAVED) &&
+	    !mask_get(amask, SND_PCM_ACCESS_RW_NONINTERLEAVED))
+		convert = 0;
+	if (!convert)
+		return hw_refine_direct(pcm, params);
+
+	plug_widen_hw(&hw);
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	/* a single app rate is mapped to a single hw rate; otherwise
+	 * any app rate is possible as long as any hw rate is
+	 */
+	if (interval_is_single(rate)) {
+		app_rate = rate->min + rate->openmin;
+		hw_rate = plug_choose_rate(pcm, &hw, app_rate);
+		if (!hw_rate)
+			return -EINVAL;
+		if (hw_rate != app_rate) {
+			err = plug_rate_hw_vars(&hw, params, app_rate, hw_rate);
+			if (err < 0)
+				return err;
+			rate_convert = 1;
+		}
+	} else {
+		plug_release_rate_vars(&hw);
+		rate_convert = 1;
+	}
+#endif
+	err = hw_refine_direct(pcm, &hw);
+	if (err < 0)
+		return err;
+
+	/* and narrow back to what the app side can get */
+	for (f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+		if (mask_get(hw_fmask, f) && _snd_pcm_plug_format_supported(f)) {
+			hw_convert = 1;
+			break;
+		}
+	}
+	for (f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+		if (!mask_get(fmask, f))
+			continue;
+		if (mask_get(hw_fmask, f) ||
+		    (hw_convert && _snd_pcm_plug_format_supported(f)))
+			continue;
+		mask_reset(fmask, f);
+	}
+	for (a = 0; a <= SND_PCM_ACCESS_LAST; a++) {
+		if (!mask_get(amask, a))
+			continue;
+		if (mask_get(hw_amask, a) ||
+		    (hw_convert && plug_mmap_access(a) >= 0 &&
+		     mask_get(hw_amask, plug_mmap_access(a))))
+			continue;
+		mask_reset(amask, a);
+	}
+	if (mask_is_empty(fmask) || mask_is_empty(amask))
+		return -EINVAL;
+
+	for (k = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL;
+	     k <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; k++) {
+		if (plug_is_format_var(k))
+			continue;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+		if (rate_convert && plug_is_rate_var(k))
+			continue;
+#endif
+		*hw_param_interval(params, k) = *hw_param_interval(&hw, k);
+	}
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (rate_convert) {
+		if (app_rate) {
+			/* sizes scaled back from the hw rate */
+			err = plug_interval_refine_scaled(params, &hw,
+				SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+				app_rate, hw_rate);
+			if (err < 0)
+				return err;
+			err = plug_interval_refine_scaled(params, &hw,
+				SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+				app_rate, hw_rate);
+		} else {
+			/* times are common to any rates */
+			err = snd_interval_refine(
+				hw_param_interval(params,
+						  SNDRV_PCM_HW_PARAM_PERIOD_TIME),
+				hw_param_interval(&hw,
+						  SNDRV_PCM_HW_PARAM_PERIOD_TIME));
+			if (err < 0)
+				return err;
+			err = snd_interval_refine(
+				hw_param_interval(params,
+						  SNDRV_PCM_HW_PARAM_BUFFER_TIME),
+				hw_param_interval(&hw,
+						  SNDRV_PCM_HW_PARAM_BUFFER_TIME));
+			if (err < 0)
+				return err;
+			err = snd_interval_refine(
+				hw_param_interval(params,
+						  SNDRV_PCM_HW_PARAM_PERIODS),
+				hw_param_interval(&hw,
+						  SNDRV_PCM_HW_PARAM_PERIODS));
+		}
+		if (err < 0)
+			return err;
+		err = plug_refine_rate_vars(params);
+		if (err < 0)
+			return err;
+	}
+#endif
+	err = plug_refine_format_vars(params);
+	if (err < 0)
+		return err;
+
+	params->info = hw.info;
+	params->rate_num = hw.rate_num;
+	params->rate_den = hw.rate_den;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (rate_convert) {
+		params->rate_num = app_rate;
+		params->rate_den = app_rate ? 1 : 0;
+	}
+#endif
+	params->fifo_size = hw.fifo_size;
+	params->msbits = hw.msbits;
+	if (mask_is_single(fmask)) {
+		f = mask_get_min(fmask);
+		if (!mask_get(hw_fmask, f))
+			params->msbits = snd_pcm_format_width(f);
+	}
+	params->cmask = hw.cmask;
+	params->rmask = 0;
+	return 0;
+}
+
+/* let the choice fall on the formats and access the hardware supports
+ * natively, if any
+ */
+static void plug_prefer_native(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	snd_pcm_hw_params_t hw = *params;
+	snd_mask_t *m;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	snd_interval_t *i;
+#endif
+
+	if (hw_refine_direct(pcm, &hw) < 0) {
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+		/* convert the format but keep the rate if possible */
+		hw = *params;
+		plug_widen_hw(&hw);
+		if (hw_refine_direct(pcm, &hw) < 0)
+			return;
+		i = hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_RATE);
+		_snd_pcm_hw_param_set_minmax(pcm, params,
+					     SNDRV_PCM_HW_PARAM_RATE,
+					     &i->min, NULL, &i->max, NULL);
+#endif
+		return;
+	}
+	m = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_FORMAT);
+	if (!mask_is_empty(m))
+		_snd_pcm_hw_param_set_mask(pcm, params,
+					   SNDRV_PCM_HW_PARAM_FORMAT, m);
+	m = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_ACCESS);
+	if (!mask_is_empty(m))
+		_snd_pcm_hw_param_set_mask(pcm, params,
+					   SNDRV_PCM_HW_PARAM_ACCESS, m);
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	i = hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_RATE);
+	_snd_pcm_hw_param_set_minmax(pcm, params, SNDRV_PCM_HW_PARAM_RATE,
+				     &i->min, NULL, &i->max, NULL);
+#endif
+}
+
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+/* try the exact value, otherwise leave the var to the kernel */
+static void plug_refine_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			     int var, unsigned long long val)
+{
+	snd_pcm_hw_params_t tmp = *params;
+
+	if (val > UINT_MAX ||
+	    snd_interval_refine_set(hw_param_interval(&tmp, var), val) < 0)
+		return;
+	tmp.rmask = ~0U;
+	if (hw_refine_direct(pcm, &tmp) >= 0)
+		*params = tmp;
+}
+
+/* scale the app period and buffer sizes to the hw rate */
+static void plug_rate_hw_sizes(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw,
+			       const snd_pcm_hw_params_t *params,
+			       unsigned int rate, unsigned int hw_rate)
+{
+	snd_pcm_uframes_t size;
+
+	snd_pcm_hw_params_get_period_size(params, &size, NULL);
+	plug_refine_near(pcm, hw, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+			 ((unsigned long long)size * hw_rate + rate / 2) /
+			 rate);
+	snd_pcm_hw_params_get_buffer_size(params, &size);
+	plug_refine_near(pcm, hw, SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+			 ((unsigned long long)size * hw_rate + rate / 2) /
+			 rate);
+}
+
+/* set up the rate converter for the hw params in effect */
+static int plug_rate_setup(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw,
+			   unsigned int rate, unsigned int hw_rate)
+{
+	struct snd_pcm_plug *plug = pcm->plug;
+	unsigned int channels;
+
+	snd_pcm_hw_params_get_channels(hw, &channels);
+	snd_pcm_hw_params_get_period_size(hw, &plug->hw_period_size, NULL);
+	snd_pcm_hw_params_get_buffer_size(hw, &plug->hw_buffer_size);
+	plug->hw_rate = hw_rate;
+	if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+		return _snd_pcm_rate_open(&plug->rate, channels,
+					  rate, hw_rate);
+	else
+		return _snd_pcm_rate_open(&plug->rate, channels,
+					  hw_rate, rate);
+}
+#endif /* SALSA_HAS_PLUG_RATE_SUPPORT */
+
+/* set up the hardware for the chosen app params */
+static int plug_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	struct snd_pcm_plug *plug = pcm->plug;
+	snd_pcm_hw_params_t hw = *params;
+	snd_mask_t *m;
+	snd_pcm_format_t format, hw_format;
+	snd_pcm_access_t access;
+	int hw_access, f, err;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	unsigned int rate, hw_rate;
+#endif
+
+	snd_pcm_hw_params_get_format(params, &format);
+	snd_pcm_hw_params_get_access(params, &access);
+	plug->convert = 0;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	snd_pcm_hw_params_get_rate(params, &rate, NULL);
+	hw_rate = rate;
+#endif
+
+	plug_release_format_vars(&hw);
+	if (hw_refine_direct(pcm, &hw) < 0) {
+		hw_access = plug_mmap_access(access);
+		if (hw_access < 0 || !_snd_pcm_plug_format_supported(format))
+			return -EINVAL;
+		hw = *params;
+		m = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_ACCESS);
+		mask_clear(m);
+		mask_set(m, hw_access);
+		m = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_FORMAT);
+		mask_clear(m);
+		for (f = 0; f <= SND_PCM_FORMAT_LAST; f++)
+			if (_snd_pcm_plug_format_supported(f))
+				mask_set(m, f);
+		plug_release_format_vars(&hw);
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+		hw_rate = plug_choose_rate(pcm, &hw, rate);
+		if (!hw_rate)
+			return -EINVAL;
+		if (hw_rate != rate) {
+			err = plug_rate_hw_vars(&hw, params, rate, hw_rate);
+			if (err < 0)
+				return err;
+		}
+#endif
+		err = hw_refine_direct(pcm, &hw);
+		if (err < 0)
+			return err;
+		hw_format = _snd_pcm_plug_choose_format(format, m);
+		if (hw_format == SND_PCM_FORMAT_UNKNOWN)
+			return -EINVAL;
+		mask_leave_single(m, hw_format);
+		hw.rmask = ~0U;
+		err = hw_refine_direct(pcm, &hw);
+		if (err < 0)
+			return err;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+		if (hw_rate != rate)
+			plug_rate_hw_sizes(pcm, &hw, params, rate, hw_rate);
+#endif
+		plug->convert = 1;
+		plug->hw_format = hw_format;
+		plug->hw_access = hw_access;
+		plug->hw_sample_bits = snd_pcm_format_physical_width(hw_format);
+	}
+
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_HW_PARAMS, &hw) < 0) {
+		plug->convert = 0;
+		return -errno;
+	}
+	params->info = hw.info;
+	params->rate_num = hw.rate_num;
+	params->rate_den = hw.rate_den;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (hw_rate != rate) {
+		err = plug_rate_setup(pcm, &hw, rate, hw_rate);
+		if (err < 0) {
+			_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_HW_FREE, 0);
+			plug->convert = 0;
+			return err;
+		}
+		params->rate_num = rate;
+		params->rate_den = 1;
+	}
+#endif
+	params->fifo_size = hw.fifo_size;
+	if (!plug->convert)
+		params->msbits = hw.msbits;
+	return 0;
+}
+#endif /* SALSA_HAS_PLUG_SUPPORT */
+
+#if SALSA_HAS_DMIX_SUPPORT
+/* the app writes into a private ring, so any non-complex access is
+ * fine; the shared hw is refined with MMAP access and the formats the
+ * mixer can sum.  dsnoop reads the interleaved hw ring in place, in
+ * any format.  Once a client set up the hw, the rest get its setup.
+ */
+int _snd_pcm_dmix_hw_refine(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	const struct snd_pcm_dmix_setup *setup = _snd_pcm_dmix_setup(pcm);
+	snd_pcm_hw_params_t hw = *params;
+	snd_mask_t *amask = hw_param_mask(params, SNDRV_PCM_HW_PARAM_ACCESS);
+	snd_mask_t *hw_amask = hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_ACCESS);
+	snd_mask_t formats;
+	int err;
+
+	mask_reset(amask, SND_PCM_ACCESS_MMAP_COMPLEX);
+	if (pcm->stream == SND_PCM_STREAM_CAPTURE)
+		mask_reset(amask, SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+	if (mask_is_empty(amask))
+		return -EINVAL;
+	mask_clear(hw_amask);
+	mask_set(hw_amask, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+
+	if (pcm->stream == SND_PCM_STREAM_PLAYBACK) {
+		mask_clear(&formats);
+		mask_set(&formats, SND_PCM_FORMAT_S16);
+		mask_set(&formats, SND_PCM_FORMAT_S32);
+		if (snd_mask_refine(hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_FORMAT),
+				    &formats) < 0)
+			return -EINVAL;
+	}
+	if (setup) {
+		if (snd_mask_refine_set(hw_param_mask(&hw, SNDRV_PCM_HW_PARAM_FORMAT),
+					setup->format) < 0 ||
+		    snd_interval_refine_set(hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_CHANNELS),
+					    setup->channels) < 0 ||
+		    snd_interval_refine_set(hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_RATE),
+					    setup->rate) < 0 ||
+		    snd_interval_refine_set(hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_PERIOD_SIZE),
+					    setup->period_size) < 0 ||
+		    snd_interval_refine_set(hw_param_interval(&hw, SNDRV_PCM_HW_PARAM_BUFFER_SIZE),
+					    setup->buffer_size) < 0)
+			return -EINVAL;
+	}
+	hw.rmask = ~0U;
+	err = hw_refine_direct(pcm, &hw);
+	if (err < 0)
+		return err;
+	*hw_amask = *amask;
+	*params = hw;
+	return 0;
+}
+#endif /* SALSA_HAS_DMIX_SUPPORT */
+
 static int _snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 {
 	int err;
@@ -913,9 +1989,20 @@ static int _snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 	err = snd_pcm_hw_refine(pcm, params);
 	if (err < 0)
 		return err;
+#if SALSA_HAS_PLUG_SUPPORT
+	if (pcm->plug)
+		plug_prefer_native(pcm, params);
+#endif
 	snd_pcm_hw_params_choose(pcm, params);
 	snd_pcm_hw_free(pcm);
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_PARAMS, params) < 0)
+#if SALSA_HAS_PLUG_SUPPORT
+	if (pcm->plug) {
+		err = plug_hw_params(pcm, params);
+		if (err < 0)
+			return err;
+	} else
+#endif
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_HW_PARAMS, params) < 0)
 		return -errno;
 #if 0
 	params->info &= ~0xf0000000;
@@ -934,15 +2021,20 @@ static int _snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 	snd_pcm_hw_params_get_buffer_size(params, &pcm->buffer_size);
 	pcm->sample_bits = snd_pcm_format_physical_width(pcm->format);
 	pcm->frame_bits = pcm->sample_bits * pcm->channels;
+	/* the hw rate may have changed; measure it again */
+	pcm->timer_rate = 0;
+	pcm->timer_ptr = 0;
+	pcm->timer_nsec = 0;
 
 	/* Default sw params */
 	memset(&sw, 0, sizeof(sw));
 	snd_pcm_sw_params_default(pcm, &sw);
 	snd_pcm_sw_params(pcm, &sw);
 
-	if (pcm->_access == SND_PCM_ACCESS_MMAP_INTERLEAVED ||
-	    pcm->_access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED ||
-	    pcm->_access == SND_PCM_ACCESS_MMAP_COMPLEX) {
+	if (pcm_dmix(pcm) ||
+	    pcm_hw_access(pcm) == SND_PCM_ACCESS_MMAP_INTERLEAVED ||
+	    pcm_hw_access(pcm) == SND_PCM_ACCESS_MMAP_NONINTERLEAVED ||
+	    pcm_hw_access(pcm) == SND_PCM_ACCESS_MMAP_COMPLEX) {
 		err = _snd_pcm_mmap(pcm);
 		if (err < 0) {
 			_snd_pcm_munmap(pcm);
@@ -951,6 +2043,7 @@ static int _snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 	}
 
 	_snd_pcm_sync_ptr(pcm, 0);
+	_snd_pcm_refine_cache_flush(pcm);
 	return 0;
 }
 
@@ -983,6 +2076,13 @@ int snd_pcm_hw_params_get_min_align(const snd_pcm_hw_params_t *params,
 int snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
 {
 	int err;
+#if SALSA_HAS_HW_BATCH_SUPPORT
+	if (pcm->hw_batch) {
+		err = snd_pcm_hw_params_batch_commit(pcm, params);
+		if (err < 0)
+			return err;
+	}
+#endif
 	err = _snd_pcm_hw_params(pcm, params);
 	if (err < 0)
 		return err;
@@ -995,23 +2095,243 @@ int snd_pcm_hw_free(snd_pcm_t *pcm)
 	if (!pcm->setup)
 		return 0;
 	_snd_pcm_munmap(pcm);
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_FREE) < 0)
+#if SALSA_HAS_PLUG_SUPPORT
+	if (pcm->plug) {
+		pcm->plug->convert = 0;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+		_snd_pcm_rate_close(pcm->plug->rate);
+		pcm->plug->rate = NULL;
+#endif
+	}
+#endif
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_HW_FREE, 0) < 0)
 		return -errno;
 	pcm->setup = 0;
 	return 0;
 }
 
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+/* convert a sw_params threshold to the hw rate, rounding up */
+static snd_pcm_uframes_t plug_sw_frames(snd_pcm_t *pcm,
+					const snd_pcm_sw_params_t *params,
+					snd_pcm_uframes_t val)
+{
+	struct snd_pcm_plug *plug = pcm->plug;
+	snd_pcm_uframes_t boundary = _snd_pcm_boundary(plug->hw_buffer_size);
+	unsigned long long frames;
+
+	if (val >= params->boundary)
+		return boundary;
+	if (val == pcm->buffer_size)
+		return plug->hw_buffer_size;
+	frames = ((unsigned long long)val * plug->hw_rate + pcm->rate - 1) /
+		pcm->rate;
+	if (val <= pcm->buffer_size && frames > plug->hw_buffer_size)
+		return plug->hw_buffer_size;
+	if (frames > boundary)
+		return boundary;
+	return frames;
+}
+
+static void plug_sw_params(snd_pcm_t *pcm, const snd_pcm_sw_params_t *params,
+			   snd_pcm_sw_params_t *hw)
+{
+	*hw = *params;
+	hw->avail_min = plug_sw_frames(pcm, params, params->avail_min);
+	if (!hw->avail_min)
+		hw->avail_min = 1;
+	hw->xfer_align = plug_sw_frames(pcm, params, params->xfer_align);
+	hw->start_threshold = plug_sw_frames(pcm, params,
+					     params->start_threshold);
+	hw->stop_threshold = plug_sw_frames(pcm, params,
+					    params->stop_threshold);
+	hw->silence_threshold = plug_sw_frames(pcm, params,
+					       params->silence_threshold);
+	hw->silence_size = plug_sw_frames(pcm, params, params->silence_size);
+	hw->boundary = _snd_pcm_boundary(pcm->plug->hw_buffer_size);
+}
+#endif /* SALSA_HAS_PLUG_RATE_SUPPORT */
+
 int snd_pcm_sw_params(snd_pcm_t *pcm, snd_pcm_sw_params_t *params)
 {
+	snd_pcm_sw_params_t *hw = params;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	snd_pcm_sw_params_t sw;
+#endif
+
 	if (!pcm->setup)
 		return -EBADFD;
-	if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SW_PARAMS, params) < 0)
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	/* the kernel sees the thresholds in hw frames */
+	if (pcm_plug_rate(pcm)) {
+		plug_sw_params(pcm, params, &sw);
+		hw = &sw;
+	}
+#endif
+	if (_snd_pcm_ioctl(pcm, SNDRV_PCM_IOCTL_SW_PARAMS, hw) < 0)
 		return -errno;
 	pcm->sw_params = *params;
-	pcm->mmap_control->avail_min = params->avail_min;
+#if SALSA_HAS_PLUG_RATE_SUPPORT
+	if (hw != params)
+		pcm->plug->hw_sw_params = *hw;
+#endif
+	pcm->boundary = hw->boundary;
+	pcm->mmap_control->avail_min = hw->avail_min;
 	return 0;
 }
 
+/*
+ * SIMPLE SETUP
+ */
+
+static unsigned int interval_clamp(const snd_interval_t *i,
+				   unsigned long long val)
+{
+	unsigned int min = i->min + i->openmin;
+	unsigned int max = i->max - i->openmax;
+
+	if (val < min)
+		return min;
+	if (val > max)
+		return max;
+	return val;
+}
+
+/* set the period and buffer sizes computed from the latency within
+ * the ranges of the refined params; no refine here
+ */
+static int set_params_sizes(snd_pcm_hw_params_t *params,
+			    unsigned int rate, unsigned int latency)
+{
+	const snd_interval_t *bi, *pi, *ni;
+	unsigned int buffer, period, periods;
+
+	bi = hw_param_interval_c(params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+	pi = hw_param_interval_c(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+	ni = hw_param_interval_c(params, SNDRV_PCM_HW_PARAM_PERIODS);
+	buffer = interval_clamp(bi, (unsigned long long)latency * rate /
+				1000000);
+	periods = interval_clamp(ni, 4);
+	period = interval_clamp(pi, buffer / periods);
+	buffer = interval_clamp(bi, (unsigned long long)period * periods);
+	if (snd_interval_refine_set(hw_param_interval(params,
+					SNDRV_PCM_HW_PARAM_PERIOD_SIZE),
+				    period) < 0 ||
+	    snd_interval_refine_set(hw_param_interval(params,
+					SNDRV_PCM_HW_PARAM_BUFFER_SIZE),
+				    buffer) < 0)
+		return -EINVAL;
+	params->cmask |= (1 << SNDRV_PCM_HW_PARAM_PERIOD_SIZE) |
+		(1 << SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+	params->rmask |= (1 << SNDRV_PCM_HW_PARAM_PERIOD_SIZE) |
+		(1 << SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+	return 0;
+}
+
+/* the way alsa-lib does: buffer time near the latency and a quarter
+ * of it for the period time
+ */
+static int set_params_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params,
+			   unsigned int latency)
+{
+	snd_pcm_hw_params_t save = *params;
+	unsigned int val;
+	int err;
+
+	val = latency;
+	err = _snd_pcm_hw_param_set_near(pcm, params,
+					 SNDRV_PCM_HW_PARAM_BUFFER_TIME,
+					 &val, NULL);
+	if (!err) {
+		val /= 4;
+		return _snd_pcm_hw_param_set_near(pcm, params,
+						  SNDRV_PCM_HW_PARAM_PERIOD_TIME,
+						  &val, NULL);
+	}
+	*params = save;
+	val = latency / 4;
+	err = _snd_pcm_hw_param_set_near(pcm, params,
+					 SNDRV_PCM_HW_PARAM_PERIOD_TIME,
+					 &val, NULL);
+	if (err < 0)
+		return err;
+	_snd_pcm_hw_param_get_min(params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+				  &val, NULL);
+	val *= 4;
+	return _snd_pcm_hw_param_set_near(pcm, params,
+					  SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+					  &val, NULL);
+}
+
+/*
+ * Set up the PCM with the given parameters and the latency in usec.
+ * The common case costs three refines (plus the final choice): one for
+ * the device ranges, one for the fixed format, access, channels and
+ * rate, and one with the period and buffer sizes calculated from them.
+ * Only if the device rejects the calculated sizes, it falls back to
+ * the step-wise set_near.
+ *
+ * Resampling depends on the PCM type (plughw with the rate converter),
+ * so soft_resample is ignored.
+ */
+int snd_pcm_set_params(snd_pcm_t *pcm,
+		       snd_pcm_format_t format,
+		       snd_pcm_access_t acc,
+		       unsigned int channels,
+		       unsigned int rate,
+		       int soft_resample,
+		       unsigned int latency)
+{
+	snd_pcm_hw_params_t params, fixed;
+	snd_pcm_sw_params_t sw;
+	int err;
+
+	err = snd_pcm_hw_params_any(pcm, &params);
+	if (err < 0)
+		return err;
+	if (hw_param_set(&params, SNDRV_PCM_HW_PARAM_ACCESS, acc, 0) < 0 ||
+	    hw_param_set(&params, SNDRV_PCM_HW_PARAM_FORMAT, format, 0) < 0 ||
+	    hw_param_set(&params, SNDRV_PCM_HW_PARAM_CHANNELS,
+			 channels, 0) < 0 ||
+	    hw_param_set(&params, SNDRV_PCM_HW_PARAM_RATE, rate, 0) < 0)
+		return -EINVAL;
+	params.cmask |= (1 << SNDRV_PCM_HW_PARAM_ACCESS) |
+		(1 << SNDRV_PCM_HW_PARAM_FORMAT) |
+		(1 << SNDRV_PCM_HW_PARAM_CHANNELS) |
+		(1 << SNDRV_PCM_HW_PARAM_RATE);
+	params.rmask = ~0U;
+	err = snd_pcm_hw_refine(pcm, &params);
+	if (err < 0)
+		return err;
+	if (snd_pcm_hw_param_empty(&params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE) ||
+	    snd_pcm_hw_param_empty(&params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE))
+		return -EINVAL;
+
+	fixed = params;
+	err = set_params_sizes(&params, rate, latency);
+	if (!err)
+		err = _snd_pcm_hw_params(pcm, &params);
+	if (err < 0) {
+		/* the device has more constraints than the ranges tell */
+		params = fixed;
+		err = set_params_near(pcm, &params, latency);
+		if (err < 0)
+			return err;
+		err = _snd_pcm_hw_params(pcm, &params);
+		if (err < 0)
+			return err;
+	}
+
+	sw = pcm->sw_params;
+	sw.start_threshold = (pcm->buffer_size / pcm->period_size) *
+		pcm->period_size;
+	sw.avail_min = pcm->period_size;
+	err = snd_pcm_sw_params(pcm, &sw);
+	if (err < 0)
+		return err;
+	return snd_pcm_prepare(pcm);
+}
+
 /*
  * DUMP HW PARAMS
  */
@@ -0,0 +1,439 @@
+/*
+ *  SALSA-Lib - PCM Interface - format conversion for plughw
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <byteswap.h>
+#include "pcm.h"
+#include "local.h"
+
+/*
+ * A sample is converted via a left-justified signed 32bit value.
+ * Each side is processed in chunks over a small stack buffer by a
+ * loader/storer picked from the tables below by the sample size and
+ * the endianness, followed by a shift and a sign flip derived from
+ * _snd_pcm_formats[].  The loops are simple enough to be vectorized
+ * by the compiler for the contiguous cases.
+ */
+
+#define PLUG_CHUNK	256
+
+typedef void (*plug_get_t)(int32_t *dst, const unsigned char *src,
+			   int step, unsigned int n);
+typedef void (*plug_put_t)(unsigned char *dst, int step,
+			   const int32_t *src, unsigned int n);
+
+static void get_8(int32_t *dst, const unsigned char *src, int step,
+		  unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = src[0];
+}
+
+static void get_16le(int32_t *dst, const unsigned char *src, int step,
+		     unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = src[0] | (src[1] << 8);
+}
+
+static void get_16be(int32_t *dst, const unsigned char *src, int step,
+		     unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = (src[0] << 8) | src[1];
+}
+
+static void get_24le(int32_t *dst, const unsigned char *src, int step,
+		     unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = src[0] | (src[1] << 8) | (src[2] << 16);
+}
+
+static void get_24be(int32_t *dst, const unsigned char *src, int step,
+		     unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = (src[0] << 16) | (src[1] << 8) | src[2];
+}
+
+static void get_32le(int32_t *dst, const unsigned char *src, int step,
+		     unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = (int32_t)((u_int32_t)src[0] | ((u_int32_t)src[1] << 8) |
+				   ((u_int32_t)src[2] << 16) |
+				   ((u_int32_t)src[3] << 24));
+}
+
+static void get_32be(int32_t *dst, const unsigned char *src, int step,
+		     unsigned int n)
+{
+	for (; n > 0; n--, src += step)
+		*dst++ = (int32_t)(((u_int32_t)src[0] << 24) |
+				   ((u_int32_t)src[1] << 16) |
+				   ((u_int32_t)src[2] << 8) | (u_int32_t)src[3]);
+}
+
+static void put_8(unsigned char *dst, int step, const int32_t *src,
+		  unsigned int n)
+{
+	for (; n > 0; n--, dst += step)
+		dst[0] = *src++;
+}
+
+static void put_16le(unsigned char *dst, int step, const int32_t *src,
+		     unsigned int n)
+{
+	for (; n > 0; n--, dst += step, src++) {
+		dst[0] = *src;
+		dst[1] = *src >> 8;
+	}
+}
+
+static void put_16be(unsigned char *dst, int step, const int32_t *src,
+		     unsigned int n)
+{
+	for (; n > 0; n--, dst += step, src++) {
+		dst[0] = *src >> 8;
+		dst[1] = *src;
+	}
+}
+
+static void put_24le(unsigned char *dst, int step, const int32_t *src,
+		     unsigned int n)
+{
+	for (; n > 0; n--, dst += step, src++) {
+		dst[0] = *src;
+		dst[1] = *src >> 8;
+		dst[2] = *src >> 16;
+	}
+}
+
+static void put_24be(unsigned char *dst, int step, const int32_t *src,
+		     unsigned int n)
+{
+	for (; n > 0; n--, dst += step, src++) {
+		dst[0] = *src >> 16;
+		dst[1] = *src >> 8;
+		dst[2] = *src;
+	}
+}
+
+static void put_32le(unsigned char *dst, int step, const int32_t *src,
+		     unsigned int n)
+{
+	for (; n > 0; n--, dst += step, src++) {
+		dst[0] = *src;
+		dst[1] = *src >> 8;
+		dst[2] = *src >> 16;
+		dst[3] = *src >> 24;
+	}
+}
+
+static void put_32be(unsigned char *dst, int step, const int32_t *src,
+		     unsigned int n)
+{
+	for (; n > 0; n--, dst += step, src++) {
+		dst[0] = *src >> 24;
+		dst[1] = *src >> 16;
+		dst[2] = *src >> 8;
+		dst[3] = *src;
+	}
+}
+
+/* indexed by [bytes - 1][le] */
+static const plug_get_t plug_getters[4][2] = {
+	{ get_8, get_8 },
+	{ get_16be, get_16le },
+	{ get_24be, get_24le },
+	{ get_32be, get_32le },
+};
+
+static const plug_put_t plug_putters[4][2] = {
+	{ put_8, put_8 },
+	{ put_16be, put_16le },
+	{ put_24be, put_24le },
+	{ put_32be, put_32le },
+};
+
+#if SALSA_SUPPORT_FLOAT
+static inline int32_t float_to_s32(double v)
+{
+	v *= 2147483648.0;
+	if (v >= 2147483647.0)
+		return 0x7fffffff;
+	if (v <= -2147483648.0)
+		return (int32_t)0x80000000;
+	return (int32_t)v;
+}
+
+static void get_float(int32_t *dst, const unsigned char *src, int step,
+		      unsigned int n, int swap)
+{
+	union { u_int32_t i; float f; } u;
+
+	for (; n > 0; n--, src += step) {
+		memcpy(&u.i, src, 4);
+		if (swap)
+			u.i = bswap_32(u.i);
+		*dst++ = float_to_s32(u.f);
+	}
+}
+
+static void get_float64(int32_t *dst, const unsigned char *src, int step,
+			unsigned int n, int swap)
+{
+	union { u_int64_t i; double f; } u;
+
+	for (; n > 0; n--, src += step) {
+		memcpy(&u.i, src, 8);
+		if (swap)
+			u.i = bswap_64(u.i);
+		*dst++ = float_to_s32(u.f);
+	}
+}
+
+static void put_float(unsigned char *dst, int step, const int32_t *src,
+		      unsigned int n, int swap)
+{
+	union { u_int32_t i; float f; } u;
+
+	for (; n > 0; n--, dst += step) {
+		u.f = (float)(*src++ * (1.0 / 2147483648.0));
+		if (swap)
+			u.i = bswap_32(u.i);
+		memcpy(dst, &u.i, 4);
+	}
+}
+
+static void put_float64(unsigned char *dst, int step, const int32_t *src,
+			unsigned int n, int swap)
+{
+	union { u_int64_t i; double f; } u;
+
+	for (; n > 0; n--, dst += step) {
+		u.f = *src++ * (1.0 / 2147483648.0);
+		if (swap)
+			u.i = bswap_64(u.i);
+		memcpy(dst, &u.i, 8);
+	}
+}
+
+static inline int float_swapped(snd_pcm_format_t format)
+{
+	return !snd_pcm_format_cpu_endian(format);
+}
+#endif /* SALSA_SUPPORT_FLOAT */
+
+/* whether the format can be converted by the plug layer */
+int _snd_pcm_plug_format_supported(snd_pcm_format_t format)
+{
+	if (format < 0 || format > SND_PCM_FORMAT_LAST)
+		return 0;
+#if SALSA_SUPPORT_FLOAT
+	if (snd_pcm_format_float(format))
+		return 1;
+#endif
+	if (format >= SND_PCM_FORMAT_DSD_U8)
+		return 0;
+	return snd_pcm_format_linear(format) > 0 &&
+		_snd_pcm_formats[format].phys <= 32;
+}
+
+/* read samples into the left-justified signed 32bit buffer */
+void _snd_pcm_plug_load(int32_t *dst, const unsigned char *src, int step,
+			unsigned int n, snd_pcm_format_t format)
+{
+	const struct snd_pcm_format_data *fmt = &_snd_pcm_formats[format];
+	unsigned int i, shift;
+	u_int32_t sign;
+
+#if SALSA_SUPPORT_FLOAT
+	if (snd_pcm_format_float(format)) {
+		if (fmt->phys == 64)
+			get_float64(dst, src, step, n, float_swapped(format));
+		else
+			get_float(dst, src, step, n, float_swapped(format));
+		return;
+	}
+#endif
+	plug_getters[fmt->phys / 8 - 1][fmt->le > 0](dst, src, step, n);
+	shift = 32 - fmt->width;
+	sign = fmt->signd ? 0 : 0x80000000U;
+	for (i = 0; i < n; i++)
+		dst[i] = (int32_t)(((u_int32_t)dst[i] << shift) ^ sign);
+}
+
+/* write samples from the left-justified signed 32bit buffer;
+ * the buffer contents are modified
+ */
+void _snd_pcm_plug_store(unsigned char *dst, int step, int32_t *src,
+			 unsigned int n, snd_pcm_format_t format)
+{
+	const struct snd_pcm_format_data *fmt = &_snd_pcm_formats[format];
+	unsigned int i, shift;
+
+#if SALSA_SUPPORT_FLOAT
+	if (snd_pcm_format_float(format)) {
+		if (fmt->phys == 64)
+			put_float64(dst, step, src, n, float_swapped(format));
+		else
+			put_float(dst, step, src, n, float_swapped(format));
+		return;
+	}
+#endif
+	shift = 32 - fmt->width;
+	if (fmt->signd) {
+		for (i = 0; i < n; i++)
+			src[i] >>= shift;
+	} else {
+		for (i = 0; i < n; i++)
+			src[i] = ((u_int32_t)src[i] ^ 0x80000000U) >> shift;
+	}
+	plug_putters[fmt->phys / 8 - 1][fmt->le > 0](dst, step, src, n);
+}
+
+static void plug_convert(unsigned char *dst, int dst_step,
+			 snd_pcm_format_t dst_format,
+			 const unsigned char *src, int src_step,
+			 snd_pcm_format_t src_format,
+			 unsigned int samples)
+{
+	int32_t buf[PLUG_CHUNK];
+
+	while (samples > 0) {
+		unsigned int n = samples;
+		if (n > PLUG_CHUNK)
+			n = PLUG_CHUNK;
+		_snd_pcm_plug_load(buf, src, src_step, n, src_format);
+		_snd_pcm_plug_store(dst, dst_step, buf, n, dst_format);
+		src += src_step * n;
+		dst += dst_step * n;
+		samples -= n;
+	}
+}
+
+/* whether all channels are packed in frames of a single buffer */
+static int plug_areas_interleaved(const snd_pcm_channel_area_t *areas,
+				  unsigned int channels, unsigned int width)
+{
+	unsigned int c;
+
+	if (areas->step != channels * width || areas->first)
+		return 0;
+	for (c = 1; c < channels; c++) {
+		if (areas[c].addr != areas->addr ||
+		    areas[c].step != areas->step ||
+		    areas[c].first != c * width)
+			return 0;
+	}
+	return 1;
+}
+
+/* copy the areas with the format conversion */
+int _snd_pcm_plug_convert_areas(const snd_pcm_channel_area_t *dst_areas,
+				snd_pcm_uframes_t dst_offset,
+				snd_pcm_format_t dst_format,
+				const snd_pcm_channel_area_t *src_areas,
+				snd_pcm_uframes_t src_offset,
+				snd_pcm_format_t src_format,
+				unsigned int channels,
+				snd_pcm_uframes_t frames)
+{
+	unsigned int dst_width = snd_pcm_format_physical_width(dst_format);
+	unsigned int src_width = snd_pcm_format_physical_width(src_format);
+	unsigned int c;
+
+	if (dst_format == src_format)
+		return snd_pcm_areas_copy(dst_areas, dst_offset,
+					  src_areas, src_offset,
+					  channels, frames, dst_format);
+
+	/* interleaved on both sides: a single run over all samples */
+	if (plug_areas_interleaved(dst_areas, channels, dst_width) &&
+	    plug_areas_interleaved(src_areas, channels, src_width)) {
+		plug_convert(snd_pcm_channel_area_addr(dst_areas, dst_offset),
+			     dst_width / 8, dst_format,
+			     snd_pcm_channel_area_addr(src_areas, src_offset),
+			     src_width / 8, src_format,
+			     channels * frames);
+		return 0;
+	}
+
+	for (c = 0; c < channels; c++, dst_areas++, src_areas++) {
+		if (!dst_areas->addr)
+			continue;
+		if (!src_areas->addr) {
+			snd_pcm_area_silence(dst_areas, dst_offset, frames,
+					     dst_format);
+			continue;
+		}
+		plug_convert(snd_pcm_channel_area_addr(dst_areas, dst_offset),
+			     dst_areas->step / 8, dst_format,
+			     snd_pcm_channel_area_addr(src_areas, src_offset),
+			     src_areas->step / 8, src_format,
+			     frames);
+	}
+	return 0;
+}
+
+/* pick the hw format to convert the given format to/from;
+ * the narrowest one keeping the resolution is preferred, then the
+ * widest one, and the same endianness, signedness and size on ties
+ */
+snd_pcm_format_t _snd_pcm_plug_choose_format(snd_pcm_format_t format,
+					     const snd_mask_t *hw_formats)
+{
+	int width = snd_pcm_format_width(format);
+	int best = SND_PCM_FORMAT_UNKNOWN, best_score = -1;
+	int f;
+
+	if (_snd_mask_test(hw_formats, format))
+		return format;
+	for (f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+		int w, score;
+
+		if (!_snd_mask_test(hw_formats, f) ||
+		    !_snd_pcm_plug_format_supported(f))
+			continue;
+		w = snd_pcm_format_width(f);
+		if (w >= width)
+			score = 0x10000 - (w - width) * 0x100;
+		else
+			score = w * 0x100;
+		if (snd_pcm_format_float(f) != snd_pcm_format_float(format))
+			score -= 0x80;
+		if (snd_pcm_format_physical_width(f) ==
+		    snd_pcm_format_physical_width(format))
+			score += 4;
+		if (snd_pcm_format_little_endian(f) ==
+		    snd_pcm_format_little_endian(format))
+			score += 2;
+		if (snd_pcm_format_signed(f) == snd_pcm_format_signed(format))
+			score += 1;
+		if (score > best_score) {
+			best = f;
+			best_score = score;
+		}
+	}
+	return (snd_pcm_format_t)best;
+}
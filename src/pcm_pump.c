@@ -0,0 +1,528 @@
+/*
+ *  SALSA-Lib - Realtime PCM pump thread
+ *
+ *  A thread moving the frames between a lock-free single-producer /
+ *  single-consumer FIFO and the PCM, so that the application threads
+ *  don't have to be realtime-safe.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pcm.h"
+#include "local.h"
+
+#define PUMP_CACHELINE		64
+
+/*
+ * SPSC frame FIFO
+ *
+ * head and tail are free-running frame counts; each is written only by
+ * its own side and kept on a separate cache line together with the
+ * cached copy of the other side's index.
+ */
+struct pump_fifo {
+	/* producer */
+	unsigned long head __attribute__((aligned(PUMP_CACHELINE)));
+	unsigned long tail_cache;
+	/* consumer */
+	unsigned long tail __attribute__((aligned(PUMP_CACHELINE)));
+	unsigned long head_cache;
+	/* read-only after setup */
+	char *buf __attribute__((aligned(PUMP_CACHELINE)));
+	unsigned long size;		/* in frames, power of two */
+	unsigned int frame_bytes;
+};
+
+static snd_pcm_uframes_t fifo_space(struct pump_fifo *f)
+{
+	unsigned long space = f->size - (f->head - f->tail_cache);
+
+	if (!space) {
+		f->tail_cache = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+		space = f->size - (f->head - f->tail_cache);
+	}
+	return space;
+}
+
+static snd_pcm_uframes_t fifo_fill(struct pump_fifo *f)
+{
+	unsigned long fill = f->head_cache - f->tail;
+
+	if (!fill) {
+		f->head_cache = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+		fill = f->head_cache - f->tail;
+	}
+	return fill;
+}
+
+/* contiguous part for the producer */
+static char *fifo_write_ptr(struct pump_fifo *f, snd_pcm_uframes_t *frames)
+{
+	unsigned long ofs = f->head & (f->size - 1);
+
+	if (*frames > f->size - ofs)
+		*frames = f->size - ofs;
+	return f->buf + ofs * f->frame_bytes;
+}
+
+static char *fifo_read_ptr(struct pump_fifo *f, snd_pcm_uframes_t *frames)
+{
+	unsigned long ofs = f->tail & (f->size - 1);
+
+	if (*frames > f->size - ofs)
+		*frames = f->size - ofs;
+	return f->buf + ofs * f->frame_bytes;
+}
+
+static void fifo_produced(struct pump_fifo *f, snd_pcm_uframes_t frames)
+{
+	__atomic_store_n(&f->head, f->head + frames, __ATOMIC_RELEASE);
+}
+
+static void fifo_consumed(struct pump_fifo *f, snd_pcm_uframes_t frames)
+{
+	__atomic_store_n(&f->tail, f->tail + frames, __ATOMIC_RELEASE);
+}
+
+/*
+ * pump
+ */
+
+struct _snd_pcm_pump {
+	struct pump_fifo fifo;
+	snd_pcm_t *pcm;
+	pthread_t thread;
+	int priority;			/* SCHED_FIFO priority, 0 = normal */
+	int cpu;			/* CPU to bind, or -1 */
+	int running;
+	int error;			/* fatal error of the pump thread */
+	unsigned int direct:1;		/* mmap_begin() gives the app format */
+	char *silence;			/* a period to fill the underruns */
+	snd_pcm_pump_stats_t stats;
+};
+
+#define pump_count(pump, field, val) \
+	__atomic_fetch_add(&(pump)->stats.field, val, __ATOMIC_RELAXED)
+
+int snd_pcm_pump_open(snd_pcm_pump_t **pumpp, snd_pcm_t *pcm,
+		      snd_pcm_uframes_t fifo_size)
+{
+	snd_pcm_pump_t *pump;
+	unsigned long size;
+
+	*pumpp = NULL;
+	if (!pcm->setup)
+		return -EBADFD;
+	if (pcm->_access != SND_PCM_ACCESS_RW_INTERLEAVED &&
+	    pcm->_access != SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		return -EINVAL;
+	for (size = 1; size < fifo_size; size <<= 1)
+		;
+	if (posix_memalign((void **)&pump, PUMP_CACHELINE, sizeof(*pump)))
+		return -ENOMEM;
+	memset(pump, 0, sizeof(*pump));
+	pump->fifo.frame_bytes = snd_pcm_frames_to_bytes(pcm, 1);
+	pump->fifo.size = size;
+	if (posix_memalign((void **)&pump->fifo.buf, PUMP_CACHELINE,
+			   size * pump->fifo.frame_bytes)) {
+		free(pump);
+		return -ENOMEM;
+	}
+	if (pcm->stream == SND_PCM_STREAM_PLAYBACK) {
+		pump->silence = malloc(pcm->period_size * pump->fifo.frame_bytes);
+		if (!pump->silence) {
+			free(pump->fifo.buf);
+			free(pump);
+			return -ENOMEM;
+		}
+		snd_pcm_format_set_silence(pcm->format, pump->silence,
+					   pcm->period_size * pcm->channels);
+	}
+	pump->pcm = pcm;
+	pump->cpu = -1;
+	pump->direct = (pcm->_access == SND_PCM_ACCESS_MMAP_INTERLEAVED ||
+			pcm_dmix(pcm)) &&
+		!pcm_plug_convert(pcm) && !pcm_plug_rate(pcm);
+	*pumpp = pump;
+	return 0;
+}
+
+int snd_pcm_pump_close(snd_pcm_pump_t *pump)
+{
+	snd_pcm_pump_stop(pump);
+	free(pump->silence);
+	free(pump->fifo.buf);
+	free(pump);
+	return 0;
+}
+
+int snd_pcm_pump_set_priority(snd_pcm_pump_t *pump, int priority)
+{
+	if (pump->running)
+		return -EBUSY;
+	if (priority < 0 || priority > sched_get_priority_max(SCHED_FIFO))
+		return -EINVAL;
+	pump->priority = priority;
+	return 0;
+}
+
+int snd_pcm_pump_set_cpu(snd_pcm_pump_t *pump, int cpu)
+{
+	if (pump->running)
+		return -EBUSY;
+	if (cpu >= CPU_SETSIZE)
+		return -EINVAL;
+	pump->cpu = cpu < 0 ? -1 : cpu;
+	return 0;
+}
+
+/* areas for the FIFO frames at ptr */
+static void pump_fifo_areas(snd_pcm_pump_t *pump, snd_pcm_channel_area_t *areas,
+			    char *ptr)
+{
+	snd_pcm_t *pcm = pump->pcm;
+	unsigned int ch;
+
+	for (ch = 0; ch < pcm->channels; ch++) {
+		areas[ch].addr = ptr;
+		areas[ch].first = ch * pcm->sample_bits;
+		areas[ch].step = pcm->frame_bits;
+	}
+}
+
+/* move the frames between the FIFO and the PCM; returns the frames */
+static snd_pcm_sframes_t pump_xfer(snd_pcm_pump_t *pump, char *ptr,
+				   snd_pcm_uframes_t frames)
+{
+	snd_pcm_t *pcm = pump->pcm;
+	const snd_pcm_channel_area_t *pcm_areas;
+	snd_pcm_channel_area_t *fifo_areas;
+	snd_pcm_uframes_t offset;
+	int err;
+
+	if (!pump->direct) {
+		if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+			return pcm->_access == SND_PCM_ACCESS_MMAP_INTERLEAVED ?
+				snd_pcm_mmap_writei(pcm, ptr, frames) :
+				snd_pcm_writei(pcm, ptr, frames);
+		else
+			return pcm->_access == SND_PCM_ACCESS_MMAP_INTERLEAVED ?
+				snd_pcm_mmap_readi(pcm, ptr, frames) :
+				snd_pcm_readi(pcm, ptr, frames);
+	}
+
+	err = snd_pcm_mmap_begin(pcm, &pcm_areas, &offset, &frames);
+	if (err < 0)
+		return err;
+	if (!frames)
+		return 0;
+	fifo_areas = alloca(sizeof(*fifo_areas) * pcm->channels);
+	pump_fifo_areas(pump, fifo_areas, ptr);
+	if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+		snd_pcm_areas_copy(pcm_areas, offset, fifo_areas, 0,
+				   pcm->channels, frames, pcm->format);
+	else
+		snd_pcm_areas_copy(fifo_areas, 0, pcm_areas, offset,
+				   pcm->channels, frames, pcm->format);
+	return snd_pcm_mmap_commit(pcm, offset, frames);
+}
+
+/* feed up to avail frames from the FIFO to the PCM */
+static int pump_playback(snd_pcm_pump_t *pump, snd_pcm_uframes_t avail)
+{
+	snd_pcm_t *pcm = pump->pcm;
+	struct pump_fifo *f = &pump->fifo;
+	snd_pcm_uframes_t frames, queued, target;
+	snd_pcm_sframes_t n;
+	char *ptr;
+
+	while (avail > 0) {
+		frames = fifo_fill(f);
+		if (!frames)
+			break;
+		if (frames > avail)
+			frames = avail;
+		ptr = fifo_read_ptr(f, &frames);
+		n = pump_xfer(pump, ptr, frames);
+		if (n <= 0)
+			return n;
+		fifo_consumed(f, n);
+		avail -= n;
+	}
+
+	queued = pcm->buffer_size - avail;
+	if (queued < pcm->period_size &&
+	    snd_pcm_state(pcm) == SND_PCM_STATE_RUNNING) {
+		/* the FIFO ran dry; keep the device going with silence */
+		frames = pcm->period_size - queued;
+		if (frames > avail)
+			frames = avail;
+		n = pump_xfer(pump, pump->silence, frames);
+		if (n < 0)
+			return n;
+		pump_count(pump, fifo_underruns, 1);
+		pump_count(pump, silence_frames, n);
+		return 1;
+	}
+
+	if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+		target = pcm->sw_params.start_threshold;
+		if (target > pcm->buffer_size)
+			target = pcm->buffer_size;
+		if (queued >= target)
+			return snd_pcm_start(pcm);
+	}
+	return avail >= pcm->sw_params.avail_min;
+}
+
+/* take up to avail frames from the PCM into the FIFO */
+static int pump_capture(snd_pcm_pump_t *pump, snd_pcm_uframes_t avail)
+{
+	struct pump_fifo *f = &pump->fifo;
+	snd_pcm_uframes_t frames;
+	snd_pcm_sframes_t n;
+	char *ptr;
+
+	while (avail > 0) {
+		frames = fifo_space(f);
+		if (!frames) {
+			/* the reader is behind; drop to avoid an xrun */
+			n = snd_pcm_forward(pump->pcm, avail);
+			if (n < 0)
+				return n;
+			pump_count(pump, fifo_overruns, 1);
+			pump_count(pump, dropped_frames, n);
+			break;
+		}
+		if (frames > avail)
+			frames = avail;
+		ptr = fifo_write_ptr(f, &frames);
+		n = pump_xfer(pump, ptr, frames);
+		if (n <= 0)
+			return n;
+		fifo_produced(f, n);
+		avail -= n;
+	}
+	return 0;
+}
+
+/* recover without blocking the thread; a resume that isn't possible
+ * yet returns -EAGAIN and is retried in the next round
+ */
+static int pump_recover(snd_pcm_pump_t *pump, int err)
+{
+	snd_pcm_t *pcm = pump->pcm;
+
+	if (err == -ESTRPIPE) {
+		err = snd_pcm_resume(pcm);
+		if (err == -EAGAIN)
+			return err;
+	}
+	if (err < 0)
+		err = snd_pcm_prepare(pcm);
+	if (!err && pcm->stream == SND_PCM_STREAM_CAPTURE)
+		err = snd_pcm_start(pcm);
+	return err;
+}
+
+static void *pump_thread(void *arg)
+{
+	snd_pcm_pump_t *pump = arg;
+	snd_pcm_t *pcm = pump->pcm;
+	snd_pcm_sframes_t avail;
+	int timeout, idle_ms, err, suspended = 0;
+
+	/* wake up at least every two periods to see the stop request */
+	timeout = pcm->period_time / 500;
+	if (timeout < 10)
+		timeout = 10;
+	idle_ms = pcm->period_time / 4000;
+	if (!idle_ms)
+		idle_ms = 1;
+
+	if (pcm->stream == SND_PCM_STREAM_CAPTURE &&
+	    snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(pcm);
+
+	while (__atomic_load_n(&pump->running, __ATOMIC_ACQUIRE)) {
+		avail = snd_pcm_avail_update(pcm);
+		if (avail >= 0) {
+			if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+				err = pump_playback(pump, avail);
+			else
+				err = pump_capture(pump, avail);
+		} else {
+			err = avail;
+		}
+		if (err == -EPIPE || err == -ESTRPIPE) {
+			if (!suspended)
+				pump_count(pump, xruns, 1);
+			err = pump_recover(pump, err);
+			suspended = err == -EAGAIN;
+			if (suspended) {
+				/* still suspended; try again later */
+				poll(NULL, 0, timeout);
+				continue;
+			}
+		}
+		if (err < 0 && err != -EAGAIN) {
+			pump->error = err;
+			break;
+		}
+		if (err > 0) {
+			/* the FIFO is short; don't spin on the ready PCM */
+			poll(NULL, 0, idle_ms);
+			continue;
+		}
+		err = snd_pcm_wait(pcm, timeout);
+		if (err < 0 && err != -EPIPE && err != -ESTRPIPE) {
+			pump->error = err;
+			break;
+		}
+	}
+	return NULL;
+}
+
+int snd_pcm_pump_start(snd_pcm_pump_t *pump)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int err;
+
+	if (pump->running)
+		return -EBUSY;
+	pthread_attr_init(&attr);
+	if (pump->priority > 0) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = pump->priority;
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (pump->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(pump->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	pump->error = 0;
+	pump->running = 1;
+	err = pthread_create(&pump->thread, &attr, pump_thread, pump);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		pump->running = 0;
+		return -err;
+	}
+	return 0;
+}
+
+int snd_pcm_pump_stop(snd_pcm_pump_t *pump)
+{
+	if (!pump->running)
+		return 0;
+	__atomic_store_n(&pump->running, 0, __ATOMIC_RELEASE);
+	pthread_join(pump->thread, NULL);
+	return pump->error;
+}
+
+/* the fatal error of the pump thread, if any */
+int snd_pcm_pump_error(snd_pcm_pump_t *pump)
+{
+	return __atomic_load_n(&pump->error, __ATOMIC_RELAXED);
+}
+
+/* frames the application can write (playback) or read (capture) now */
+snd_pcm_uframes_t snd_pcm_pump_avail(snd_pcm_pump_t *pump)
+{
+	if (pump->pcm->stream == SND_PCM_STREAM_PLAYBACK)
+		return fifo_space(&pump->fifo);
+	return fifo_fill(&pump->fifo);
+}
+
+/* copy to the FIFO without blocking; returns the frames stored */
+snd_pcm_sframes_t snd_pcm_pump_write(snd_pcm_pump_t *pump, const void *buf,
+				     snd_pcm_uframes_t size)
+{
+	struct pump_fifo *f = &pump->fifo;
+	snd_pcm_uframes_t frames, done = 0;
+	char *ptr;
+
+	if (pump->pcm->stream != SND_PCM_STREAM_PLAYBACK)
+		return -EINVAL;
+	while (done < size) {
+		frames = fifo_space(f);
+		if (!frames) {
+			/* a short write; the caller still has the rest */
+			pump_count(pump, fifo_overruns, 1);
+			break;
+		}
+		if (frames > size - done)
+			frames = size - done;
+		ptr = fifo_write_ptr(f, &frames);
+		memcpy(ptr, (const char *)buf + done * f->frame_bytes,
+		       frames * f->frame_bytes);
+		fifo_produced(f, frames);
+		done += frames;
+	}
+	return done;
+}
+
+/* copy from the FIFO without blocking; returns the frames read */
+snd_pcm_sframes_t snd_pcm_pump_read(snd_pcm_pump_t *pump, void *buf,
+				    snd_pcm_uframes_t size)
+{
+	struct pump_fifo *f = &pump->fifo;
+	snd_pcm_uframes_t frames, done = 0;
+	char *ptr;
+
+	if (pump->pcm->stream != SND_PCM_STREAM_CAPTURE)
+		return -EINVAL;
+	while (done < size) {
+		frames = fifo_fill(f);
+		if (!frames) {
+			pump_count(pump, fifo_underruns, 1);
+			break;
+		}
+		if (frames > size - done)
+			frames = size - done;
+		ptr = fifo_read_ptr(f, &frames);
+		memcpy((char *)buf + done * f->frame_bytes, ptr,
+		       frames * f->frame_bytes);
+		fifo_consumed(f, frames);
+		done += frames;
+	}
+	return done;
+}
+
+void snd_pcm_pump_get_stats(snd_pcm_pump_t *pump, snd_pcm_pump_stats_t *stats)
+{
+	stats->xruns = __atomic_load_n(&pump->stats.xruns, __ATOMIC_RELAXED);
+	stats->fifo_underruns = __atomic_load_n(&pump->stats.fifo_underruns,
+						__ATOMIC_RELAXED);
+	stats->fifo_overruns = __atomic_load_n(&pump->stats.fifo_overruns,
+					       __ATOMIC_RELAXED);
+	stats->silence_frames = __atomic_load_n(&pump->stats.silence_frames,
+						__ATOMIC_RELAXED);
+	stats->dropped_frames = __atomic_load_n(&pump->stats.dropped_frames,
+						__ATOMIC_RELAXED);
+}
@@ -0,0 +1,355 @@
+/*
+ *  SALSA-Lib - PCM Interface - rate conversion for plughw
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcm.h"
+#include "local.h"
+#if SALSA_PLUG_RATE_FIR
+#include <math.h>
+#endif
+
+/*
+ * A polyphase resampler working on the left-justified signed 32bit
+ * samples of pcm_plug.c.
+ *
+ * The ratio is kept exact as in_step input frames per out_step output
+ * frames (the rates divided by their GCD).  Each output is computed
+ * from a window of taps input samples starting at pos, with a
+ * coefficient set picked by the sub-sample phase frac / out_step.
+ * The coefficient table is built at hw_params time: two taps for the
+ * linear interpolation, or a windowed sinc for the FIR mode.
+ *
+ * The last input samples not consumed yet are kept per channel in
+ * hist, so the conversion can be split at any point of the stream.
+ */
+
+#define RATE_CHUNK		256
+#define RATE_COEF_BITS		22
+#define RATE_LINEAR_PHASES	4096
+
+#if SALSA_PLUG_RATE_FIR
+#define RATE_FIR_TAPS		32
+#define RATE_FIR_PHASES		256
+#define RATE_MAX_TAPS		RATE_FIR_TAPS
+#else
+#define RATE_MAX_TAPS		2
+#endif
+
+struct snd_pcm_rate {
+	unsigned int channels;
+	unsigned int taps;
+	unsigned int in_step;		/* input frames ... */
+	unsigned int out_step;		/* ... per output frames */
+	unsigned int pos_step;		/* in_step / out_step */
+	unsigned int frac_step;		/* in_step % out_step */
+	u_int64_t phase_mul;		/* frac to phase index, 32.32 */
+	int32_t *coefs;			/* [phase][tap] */
+	/* stream state */
+	unsigned int hist_len;		/* samples kept per channel */
+	unsigned long pos;		/* window start of the next output */
+	unsigned int frac;		/* sub-sample phase of the next output */
+	int32_t *hist;			/* [channel][taps] */
+};
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+#if SALSA_PLUG_RATE_FIR
+/* Blackman-windowed sinc; each phase is normalized to the unity gain
+ * so that the DC level doesn't ripple over the phases
+ */
+static void rate_fir_coefs(int32_t *coefs, unsigned int phases,
+			   double cutoff)
+{
+	const int half = RATE_FIR_TAPS / 2;
+	double h[RATE_FIR_TAPS];
+	unsigned int p;
+	int j;
+
+	for (p = 0; p < phases; p++, coefs += RATE_FIR_TAPS) {
+		double d = (double)p / phases, sum = 0;
+		int32_t total = 0;
+
+		for (j = 0; j < RATE_FIR_TAPS; j++) {
+			double t = j - (half - 1) - d;
+			double x = M_PI * cutoff * t;
+
+			h[j] = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+			h[j] *= 0.42 + 0.5 * cos(M_PI * t / half) +
+				0.08 * cos(2 * M_PI * t / half);
+			sum += h[j];
+		}
+		for (j = 0; j < RATE_FIR_TAPS; j++) {
+			coefs[j] = lrint(h[j] / sum * (1 << RATE_COEF_BITS));
+			total += coefs[j];
+		}
+		coefs[half - 1] += (1 << RATE_COEF_BITS) - total;
+	}
+}
+#else
+static void rate_linear_coefs(int32_t *coefs, unsigned int phases)
+{
+	unsigned int p;
+
+	for (p = 0; p < phases; p++) {
+		coefs[2 * p + 1] = ((u_int64_t)p << RATE_COEF_BITS) / phases;
+		coefs[2 * p] = (1 << RATE_COEF_BITS) - coefs[2 * p + 1];
+	}
+}
+#endif /* SALSA_PLUG_RATE_FIR */
+
+int _snd_pcm_rate_open(struct snd_pcm_rate **ratep, unsigned int channels,
+		       unsigned int in_rate, unsigned int out_rate)
+{
+	struct snd_pcm_rate *rate;
+	unsigned int g, phases, max_phases;
+
+	if (!channels || !in_rate || !out_rate)
+		return -EINVAL;
+	rate = calloc(1, sizeof(*rate));
+	if (!rate)
+		return -ENOMEM;
+	g = gcd(in_rate, out_rate);
+	rate->channels = channels;
+	rate->in_step = in_rate / g;
+	rate->out_step = out_rate / g;
+	rate->pos_step = rate->in_step / rate->out_step;
+	rate->frac_step = rate->in_step % rate->out_step;
+#if SALSA_PLUG_RATE_FIR
+	rate->taps = RATE_FIR_TAPS;
+	max_phases = RATE_FIR_PHASES;
+#else
+	rate->taps = 2;
+	max_phases = RATE_LINEAR_PHASES;
+#endif
+	/* one coefficient set per output phase unless too many */
+	phases = rate->out_step;
+	if (phases > max_phases)
+		phases = max_phases;
+	rate->phase_mul = ((u_int64_t)phases << 32) / rate->out_step;
+
+	rate->coefs = malloc(phases * rate->taps * sizeof(int32_t));
+	rate->hist = malloc(channels * rate->taps * sizeof(int32_t));
+	if (!rate->coefs || !rate->hist) {
+		_snd_pcm_rate_close(rate);
+		return -ENOMEM;
+	}
+#if SALSA_PLUG_RATE_FIR
+	/* cut below the lower Nyquist frequency of both sides */
+	rate_fir_coefs(rate->coefs, phases,
+		       out_rate < in_rate ?
+		       0.9 * out_rate / in_rate : 0.9);
+#else
+	rate_linear_coefs(rate->coefs, phases);
+#endif
+	_snd_pcm_rate_reset(rate);
+	*ratep = rate;
+	return 0;
+}
+
+void _snd_pcm_rate_close(struct snd_pcm_rate *rate)
+{
+	if (!rate)
+		return;
+	free(rate->coefs);
+	free(rate->hist);
+	free(rate);
+}
+
+/* restart from silence; the first output is aligned to the next input */
+void _snd_pcm_rate_reset(struct snd_pcm_rate *rate)
+{
+	memset(rate->hist, 0, rate->channels * rate->taps * sizeof(int32_t));
+	rate->hist_len = rate->taps - 1;
+	rate->pos = rate->taps / 2;
+	rate->frac = 0;
+}
+
+/* input frames consumed but not reflected in the output yet */
+long _snd_pcm_rate_pending(const struct snd_pcm_rate *rate)
+{
+	return (long)rate->hist_len - (long)rate->pos - rate->taps / 2 + 1;
+}
+
+#define rate_phase(rate, frac) \
+	((unsigned int)(((u_int64_t)(frac) * (rate)->phase_mul) >> 32))
+
+#define rate_advance(rate, pos, frac)			\
+	do {						\
+		(pos) += (rate)->pos_step;		\
+		(frac) += (rate)->frac_step;		\
+		if ((frac) >= (rate)->out_step) {	\
+			(frac) -= (rate)->out_step;	\
+			(pos)++;			\
+		}					\
+	} while (0)
+
+#if SALSA_PLUG_RATE_FIR
+static inline int32_t clamp_s32(int64_t v)
+{
+	if (v > 0x7fffffffLL)
+		return 0x7fffffff;
+	if (v < -0x80000000LL)
+		return (int32_t)0x80000000;
+	return (int32_t)v;
+}
+
+static void rate_kernel(const struct snd_pcm_rate *rate, int32_t *dst,
+			const int32_t *src, unsigned long pos,
+			unsigned int frac, unsigned int n)
+{
+	unsigned int j;
+
+	for (; n > 0; n--) {
+		const int32_t *c = rate->coefs +
+			RATE_FIR_TAPS * rate_phase(rate, frac);
+		const int32_t *x = src + pos;
+		int64_t acc = 1 << (RATE_COEF_BITS - 1);
+
+		for (j = 0; j < RATE_FIR_TAPS; j++)
+			acc += (int64_t)x[j] * c[j];
+		*dst++ = clamp_s32(acc >> RATE_COEF_BITS);
+		rate_advance(rate, pos, frac);
+	}
+}
+#else
+/* a convex combination of two samples never overflows */
+static void rate_kernel(const struct snd_pcm_rate *rate, int32_t *dst,
+			const int32_t *src, unsigned long pos,
+			unsigned int frac, unsigned int n)
+{
+	for (; n > 0; n--) {
+		const int32_t *c = rate->coefs + 2 * rate_phase(rate, frac);
+		const int32_t *x = src + pos;
+
+		*dst++ = ((int64_t)x[0] * c[0] + (int64_t)x[1] * c[1] +
+			  (1 << (RATE_COEF_BITS - 1))) >> RATE_COEF_BITS;
+		rate_advance(rate, pos, frac);
+	}
+}
+#endif /* SALSA_PLUG_RATE_FIR */
+
+/* window start of the k-th output from now */
+static inline u_int64_t rate_pos(const struct snd_pcm_rate *rate,
+				 unsigned int k)
+{
+	return rate->pos +
+		((u_int64_t)k * rate->in_step + rate->frac) / rate->out_step;
+}
+
+/* number of outputs computable from len samples (kept + new) */
+static unsigned int rate_outputs(const struct snd_pcm_rate *rate,
+				 unsigned long len)
+{
+	u_int64_t d;
+
+	if (len < rate->pos + rate->taps)
+		return 0;
+	d = len - rate->taps - rate->pos + 1;
+	return (d * rate->out_step - rate->frac + rate->in_step - 1) /
+		rate->in_step;
+}
+
+/* convert up to *src_frames frames into up to *dst_frames frames;
+ * the frames actually consumed and produced are returned there
+ */
+void _snd_pcm_rate_convert(struct snd_pcm_rate *rate,
+			   const snd_pcm_channel_area_t *dst_areas,
+			   snd_pcm_uframes_t dst_offset,
+			   snd_pcm_format_t dst_format,
+			   snd_pcm_uframes_t *dst_frames,
+			   const snd_pcm_channel_area_t *src_areas,
+			   snd_pcm_uframes_t src_offset,
+			   snd_pcm_format_t src_format,
+			   snd_pcm_uframes_t *src_frames)
+{
+	int32_t work[RATE_MAX_TAPS + RATE_CHUNK], out[RATE_CHUNK];
+	snd_pcm_uframes_t in_done = 0, out_done = 0;
+	unsigned int c;
+
+	while (out_done < *dst_frames) {
+		snd_pcm_uframes_t in_left = *src_frames - in_done;
+		unsigned int n_in, n_out;
+		unsigned long len, drop;
+		u_int64_t next, need;
+
+		n_out = RATE_CHUNK;
+		if (n_out > *dst_frames - out_done)
+			n_out = *dst_frames - out_done;
+		/* take just the input needed for n_out outputs */
+		need = rate_pos(rate, n_out - 1) + rate->taps;
+		need = need > rate->hist_len ? need - rate->hist_len : 0;
+		if (need > in_left)
+			need = in_left;
+		if (need > RATE_CHUNK)
+			need = RATE_CHUNK;
+		n_in = need;
+		len = rate->hist_len + n_in;
+		if (rate_outputs(rate, len) < n_out)
+			n_out = rate_outputs(rate, len);
+		if (!n_in && !n_out)
+			break;
+
+		next = rate_pos(rate, n_out);
+		drop = next < len ? next : len;
+		for (c = 0; c < rate->channels; c++) {
+			const snd_pcm_channel_area_t *src = &src_areas[c];
+			const snd_pcm_channel_area_t *dst = &dst_areas[c];
+			int32_t *hist = rate->hist + c * rate->taps;
+
+			memcpy(work, hist, rate->hist_len * sizeof(int32_t));
+			if (src->addr)
+				_snd_pcm_plug_load(work + rate->hist_len,
+					snd_pcm_channel_area_addr(src,
+						src_offset + in_done),
+					src->step / 8, n_in, src_format);
+			else
+				memset(work + rate->hist_len, 0,
+				       n_in * sizeof(int32_t));
+			rate_kernel(rate, out, work, rate->pos, rate->frac,
+				    n_out);
+			if (dst->addr)
+				_snd_pcm_plug_store(
+					snd_pcm_channel_area_addr(dst,
+						dst_offset + out_done),
+					dst->step / 8, out, n_out, dst_format);
+			memcpy(hist, work + drop,
+			       (len - drop) * sizeof(int32_t));
+		}
+
+		rate->frac = ((u_int64_t)n_out * rate->in_step + rate->frac) %
+			rate->out_step;
+		rate->pos = next - drop;
+		rate->hist_len = len - drop;
+		in_done += n_in;
+		out_done += n_out;
+	}
+
+	*src_frames = in_done;
+	*dst_frames = out_done;
+}
@@ -0,0 +1,280 @@
+/*
+ *  SALSA-Lib - Non-blocking PCM recovery
+ *
+ *  Steps through resume, prepare, refill and restart without sleeping;
+ *  the resume retries are paced by a timerfd the caller can poll.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alloca.h>
+#include <sys/timerfd.h>
+#include "pcm.h"
+#include "local.h"
+
+#define RECOVERY_BACKOFF_MIN	5	/* msec */
+#define RECOVERY_BACKOFF_MAX	500	/* msec */
+#define RECOVERY_FILL_CHUNK	1024	/* frames per write */
+
+enum {
+	REC_IDLE,
+	REC_RESUME,
+	REC_PREPARE,
+	REC_FILL,
+	REC_START,
+};
+
+struct _snd_pcm_recovery {
+	snd_pcm_t *pcm;
+	int state;			/* REC_* */
+	int timer_fd;			/* paces the resume retries */
+	unsigned int backoff;		/* next retry interval in msec */
+	snd_pcm_recovery_fill_t fill;
+	void *private_data;
+	void *buf;			/* bounce buffer for the refill */
+	size_t buf_size;
+};
+
+int snd_pcm_recovery_open(snd_pcm_recovery_t **recp, snd_pcm_t *pcm)
+{
+	snd_pcm_recovery_t *rec;
+
+	*recp = NULL;
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return -ENOMEM;
+	rec->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (rec->timer_fd < 0) {
+		int err = -errno;
+		free(rec);
+		return err;
+	}
+	rec->pcm = pcm;
+	*recp = rec;
+	return 0;
+}
+
+int snd_pcm_recovery_close(snd_pcm_recovery_t *rec)
+{
+	close(rec->timer_fd);
+	free(rec->buf);
+	free(rec);
+	return 0;
+}
+
+void snd_pcm_recovery_set_fill(snd_pcm_recovery_t *rec,
+			       snd_pcm_recovery_fill_t fill,
+			       void *private_data)
+{
+	rec->fill = fill;
+	rec->private_data = private_data;
+}
+
+int snd_pcm_recovery_get_fd(snd_pcm_recovery_t *rec)
+{
+	return rec->timer_fd;
+}
+
+int snd_pcm_recovery_in_progress(snd_pcm_recovery_t *rec)
+{
+	return rec->state != REC_IDLE;
+}
+
+static int recovery_arm(snd_pcm_recovery_t *rec, unsigned int msec)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000L;
+	if (timerfd_settime(rec->timer_fd, 0, &its, NULL) < 0)
+		return -errno;
+	return 0;
+}
+
+static int recovery_done(snd_pcm_recovery_t *rec, int err)
+{
+	uint64_t expired;
+
+	rec->state = REC_IDLE;
+	recovery_arm(rec, 0);
+	read(rec->timer_fd, &expired, sizeof(expired));
+	return err;
+}
+
+/* write silence or the app data until start_threshold is queued */
+static int recovery_fill(snd_pcm_recovery_t *rec)
+{
+	snd_pcm_t *pcm = rec->pcm;
+	snd_pcm_channel_area_t *areas;
+	void **bufs;
+	snd_pcm_uframes_t target, queued, frames;
+	snd_pcm_sframes_t avail, n;
+	size_t size, chsize;
+	unsigned int ch;
+	int noninterleaved;
+
+	avail = snd_pcm_avail_update(pcm);
+	if (avail < 0)
+		return avail;
+	target = pcm->sw_params.start_threshold;
+	if (target > pcm->buffer_size)
+		target = pcm->buffer_size;
+	queued = pcm->buffer_size - avail;
+	if (queued >= target)
+		return 0;
+
+	noninterleaved = pcm->_access == SND_PCM_ACCESS_RW_NONINTERLEAVED ||
+		pcm->_access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+	size = snd_pcm_frames_to_bytes(pcm, RECOVERY_FILL_CHUNK);
+	chsize = snd_pcm_samples_to_bytes(pcm, RECOVERY_FILL_CHUNK);
+	if (size > rec->buf_size) {
+		void *p = realloc(rec->buf, size);
+		if (!p)
+			return -ENOMEM;
+		rec->buf = p;
+		rec->buf_size = size;
+	}
+	areas = alloca(sizeof(*areas) * pcm->channels);
+	bufs = alloca(sizeof(*bufs) * pcm->channels);
+	for (ch = 0; ch < pcm->channels; ch++) {
+		if (noninterleaved) {
+			areas[ch].addr = (char *)rec->buf + ch * chsize;
+			areas[ch].first = 0;
+			areas[ch].step = pcm->sample_bits;
+		} else {
+			areas[ch].addr = rec->buf;
+			areas[ch].first = ch * pcm->sample_bits;
+			areas[ch].step = pcm->frame_bits;
+		}
+		bufs[ch] = areas[ch].addr;
+	}
+
+	while (queued < target) {
+		frames = target - queued;
+		if (frames > RECOVERY_FILL_CHUNK)
+			frames = RECOVERY_FILL_CHUNK;
+		n = 0;
+		if (rec->fill)
+			n = rec->fill(pcm, areas, 0, frames, rec->private_data);
+		if (n < 0)
+			return n;
+		if ((snd_pcm_uframes_t)n > frames)
+			n = frames;
+		if ((snd_pcm_uframes_t)n < frames)
+			snd_pcm_areas_silence(areas, n, pcm->channels,
+					      frames - n, pcm->format);
+
+		switch (pcm->_access) {
+		case SND_PCM_ACCESS_RW_INTERLEAVED:
+			n = snd_pcm_writei(pcm, rec->buf, frames);
+			break;
+		case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+			n = snd_pcm_writen(pcm, bufs, frames);
+			break;
+		case SND_PCM_ACCESS_MMAP_NONINTERLEAVED:
+			n = snd_pcm_mmap_writen(pcm, bufs, frames);
+			break;
+		default:
+			n = snd_pcm_mmap_writei(pcm, rec->buf, frames);
+			break;
+		}
+		if (n < 0)
+			return n;
+		if (!n)
+			break;
+		queued += n;
+	}
+	return 0;
+}
+
+/* proceed the recovery; returns 0 when done, -EAGAIN when the caller
+ * should poll the fd from snd_pcm_recovery_get_fd() and call again,
+ * or another error if the stream can't be recovered
+ */
+int snd_pcm_recovery_step(snd_pcm_recovery_t *rec)
+{
+	snd_pcm_t *pcm = rec->pcm;
+	int err;
+
+	switch (rec->state) {
+	case REC_IDLE:
+		return 0;
+	case REC_RESUME:
+		err = snd_pcm_resume(pcm);
+		if (err == -EAGAIN) {
+			/* still suspended; try again later */
+			err = recovery_arm(rec, rec->backoff);
+			if (err < 0)
+				return recovery_done(rec, err);
+			rec->backoff *= 2;
+			if (rec->backoff > RECOVERY_BACKOFF_MAX)
+				rec->backoff = RECOVERY_BACKOFF_MAX;
+			return -EAGAIN;
+		}
+		if (!err)
+			return recovery_done(rec, 0);
+		/* resume not supported, prepare from scratch */
+		rec->state = REC_PREPARE;
+		/* fallthrough */
+	case REC_PREPARE:
+		err = snd_pcm_prepare(pcm);
+		if (err < 0)
+			return recovery_done(rec, err);
+		rec->state = REC_FILL;
+		/* fallthrough */
+	case REC_FILL:
+		if (pcm->stream == SND_PCM_STREAM_PLAYBACK) {
+			err = recovery_fill(rec);
+			if (err < 0)
+				return recovery_done(rec, err);
+		}
+		rec->state = REC_START;
+		/* fallthrough */
+	case REC_START:
+		err = 0;
+		/* the refill may have started the stream already */
+		if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+			err = snd_pcm_start(pcm);
+		return recovery_done(rec, err);
+	}
+	return -EINVAL;
+}
+
+/* start the recovery from the error returned by a PCM function */
+int snd_pcm_recovery_start(snd_pcm_recovery_t *rec, int err)
+{
+	if (err > 0)
+		err = -err;
+	switch (err) {
+	case -EINTR:
+		return 0;
+	case -EPIPE:
+		rec->state = REC_PREPARE;
+		break;
+	case -ESTRPIPE:
+		rec->state = REC_RESUME;
+		break;
+	default:
+		return err;
+	}
+	rec->backoff = RECOVERY_BACKOFF_MIN;
+	return snd_pcm_recovery_step(rec);
+}
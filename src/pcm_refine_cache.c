@@ -0,0 +1,461 @@
+/*
+ *  SALSA-Lib - PCM hw_params refine cache
+ *
+ *  Remembers the results of HW_REFINE ioctls per card, device,
+ *  subdevice and stream, so that the repeated negotiations on an
+ *  unchanged device don't hit the kernel.  The card's control events
+ *  invalidate the cache.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "pcm.h"
+#include "control.h"
+#include "local.h"
+
+#define REFINE_HASH_SIZE	64
+#define REFINE_MAX_ENTRIES	256	/* per card; flushed when exceeded */
+#define REFINE_FILE_MAGIC	"SALSARC2"
+
+/* the part saved to the file */
+struct refine_rec {
+	unsigned int hash;
+	int device;
+	int subdevice;
+	int stream;
+	snd_pcm_hw_params_t in;
+	snd_pcm_hw_params_t out;
+};
+
+struct refine_entry {
+	struct refine_rec rec;
+	struct refine_entry *next;
+};
+
+/* identifies the card and the kernel ABI for the saved file */
+struct refine_stamp {
+	char magic[8];
+	unsigned int pcm_version;
+	unsigned int params_size;
+	unsigned int elem_count;
+	unsigned char driver[16];
+	unsigned char name[32];
+	unsigned char mixername[80];
+	unsigned char components[128];
+};
+
+struct refine_card {
+	int card;
+	snd_ctl_t *ctl;			/* subscribed for the invalidation */
+	char id[17];
+	struct refine_stamp stamp;
+	struct refine_entry *hash[REFINE_HASH_SIZE];
+	unsigned int count;
+	unsigned int dirty:1;		/* not yet saved */
+	struct refine_card *next;
+};
+
+static struct refine_card *refine_cards;
+static char *refine_dir;
+static unsigned int refine_generation;	/* bumped at each invalidation */
+/* a sleeping lock, as the holder may open the control or do file I/O */
+static pthread_mutex_t refine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cache_lock(void)
+{
+	pthread_mutex_lock(&refine_lock);
+}
+
+static void cache_unlock(void)
+{
+	pthread_mutex_unlock(&refine_lock);
+}
+
+/* FNV-1a */
+static unsigned int refine_hash(const snd_pcm_t *pcm,
+				const snd_pcm_hw_params_t *params)
+{
+	const unsigned char *p = (const unsigned char *)params;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	h = (h ^ pcm->device) * 16777619U;
+	h = (h ^ pcm->subdevice) * 16777619U;
+	h = (h ^ pcm->stream) * 16777619U;
+	for (i = 0; i < sizeof(*params); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+static void card_clear(struct refine_card *c)
+{
+	struct refine_entry *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < REFINE_HASH_SIZE; i++) {
+		for (e = c->hash[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		c->hash[i] = NULL;
+	}
+	c->count = 0;
+	c->dirty = 0;
+}
+
+static int card_insert(struct refine_card *c, const struct refine_rec *rec)
+{
+	struct refine_entry *e;
+
+	if (c->count >= REFINE_MAX_ENTRIES)
+		card_clear(c);
+	e = malloc(sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+	e->rec = *rec;
+	e->next = c->hash[rec->hash % REFINE_HASH_SIZE];
+	c->hash[rec->hash % REFINE_HASH_SIZE] = e;
+	c->count++;
+	return 0;
+}
+
+/*
+ * on-disk copy
+ */
+
+static void card_file_name(struct refine_card *c, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/refine-%s.cache", refine_dir, c->id);
+}
+
+static void card_load(struct refine_card *c)
+{
+	char path[PATH_MAX];
+	struct refine_stamp stamp;
+	struct refine_rec rec;
+	FILE *fp;
+
+	card_file_name(c, path, sizeof(path));
+	fp = fopen(path, "re");
+	if (!fp)
+		return;
+	if (fread(&stamp, sizeof(stamp), 1, fp) != 1 ||
+	    memcmp(&stamp, &c->stamp, sizeof(stamp))) {
+		/* stale; another kernel or the card was reconfigured */
+		fclose(fp);
+		unlink(path);
+		return;
+	}
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (card_insert(c, &rec) < 0)
+			break;
+	}
+	fclose(fp);
+}
+
+static void card_save(struct refine_card *c)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	struct refine_entry *e;
+	unsigned int i;
+	FILE *fp;
+	int err = 0;
+
+	card_file_name(c, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "we");
+	if (!fp)
+		return;
+	if (fwrite(&c->stamp, sizeof(c->stamp), 1, fp) != 1)
+		err = 1;
+	for (i = 0; i < REFINE_HASH_SIZE && !err; i++) {
+		for (e = c->hash[i]; e; e = e->next) {
+			if (fwrite(&e->rec, sizeof(e->rec), 1, fp) != 1) {
+				err = 1;
+				break;
+			}
+		}
+	}
+	if (fclose(fp) || err || rename(tmp, path) < 0)
+		unlink(tmp);
+	else
+		c->dirty = 0;
+}
+
+static void card_invalidate(struct refine_card *c)
+{
+	char path[PATH_MAX];
+
+	card_clear(c);
+	refine_generation++;
+	if (refine_dir) {
+		card_file_name(c, path, sizeof(path));
+		unlink(path);
+	}
+}
+
+/*
+ * per-card state
+ */
+
+static void card_free(struct refine_card *c)
+{
+	card_clear(c);
+	if (c->ctl)
+		snd_ctl_close(c->ctl);
+	free(c);
+}
+
+static struct refine_card *card_new(int card)
+{
+	struct refine_card *c;
+	snd_ctl_card_info_t info;
+	snd_ctl_elem_list_t list;
+	char name[16];
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->card = card;
+	sprintf(name, "hw:%d", card);
+	if (snd_ctl_open(&c->ctl, name, SND_CTL_NONBLOCK | SND_CTL_READONLY))
+		goto error;
+	if (snd_ctl_subscribe_events(c->ctl, 1) < 0)
+		goto error;
+	memset(&info, 0, sizeof(info));
+	if (snd_ctl_card_info(c->ctl, &info) < 0)
+		goto error;
+	memset(&list, 0, sizeof(list));
+	if (snd_ctl_elem_list(c->ctl, &list) < 0)
+		goto error;
+
+	memcpy(c->id, info.id, sizeof(info.id));
+	memcpy(c->stamp.magic, REFINE_FILE_MAGIC, sizeof(c->stamp.magic));
+	c->stamp.pcm_version = SNDRV_PCM_VERSION;
+	c->stamp.params_size = sizeof(snd_pcm_hw_params_t);
+	c->stamp.elem_count = list.count;
+	memcpy(c->stamp.driver, info.driver, sizeof(info.driver));
+	memcpy(c->stamp.name, info.name, sizeof(info.name));
+	memcpy(c->stamp.mixername, info.mixername, sizeof(info.mixername));
+	memcpy(c->stamp.components, info.components, sizeof(info.components));
+	if (refine_dir)
+		card_load(c);
+	return c;
+
+ error:
+	/* keep it as a negative entry, not to retry at each refine */
+	if (c->ctl)
+		snd_ctl_close(c->ctl);
+	c->ctl = NULL;
+	return c;
+}
+
+/* call with the lock held; returns NULL if the card can't be cached */
+static struct refine_card *card_get(int card)
+{
+	struct refine_card *c;
+
+	for (c = refine_cards; c; c = c->next)
+		if (c->card == card)
+			break;
+	if (!c) {
+		c = card_new(card);
+		if (!c)
+			return NULL;
+		c->next = refine_cards;
+		refine_cards = c;
+	}
+	return c->ctl ? c : NULL;
+}
+
+static void card_remove(struct refine_card *c)
+{
+	struct refine_card **prevp;
+
+	for (prevp = &refine_cards; *prevp; prevp = &(*prevp)->next) {
+		if (*prevp == c) {
+			*prevp = c->next;
+			break;
+		}
+	}
+	card_free(c);
+}
+
+/* whether the event may change the hw constraints; plain value
+ * changes of mixer controls (e.g. volume) don't
+ */
+static int event_invalidates(const snd_ctl_event_t *ev)
+{
+	if (ev->type != SND_CTL_EVENT_ELEM)
+		return 0;
+	if (ev->data.elem.mask == SND_CTL_EVENT_MASK_REMOVE)
+		return 1;
+	if (ev->data.elem.mask &
+	    (SND_CTL_EVENT_MASK_ADD | SND_CTL_EVENT_MASK_INFO))
+		return 1;
+	if ((ev->data.elem.mask & SND_CTL_EVENT_MASK_VALUE) &&
+	    ev->data.elem.id.iface != SND_CTL_ELEM_IFACE_MIXER)
+		return 1;
+	return 0;
+}
+
+/*
+ * entry points
+ */
+
+/* read the pending control events; called once at each hw_params_any */
+void _snd_pcm_refine_cache_check(snd_pcm_t *pcm)
+{
+	struct refine_card *c;
+	snd_ctl_event_t ev;
+	int err, changed = 0;
+
+	cache_lock();
+	c = card_get(pcm->card);
+	if (!c)
+		goto unlock;
+	while ((err = snd_ctl_read(c->ctl, &ev)) > 0) {
+		if (event_invalidates(&ev))
+			changed = 1;
+	}
+	if (err < 0 && err != -EAGAIN) {
+		/* e.g. the card got unplugged */
+		card_invalidate(c);
+		card_remove(c);
+	} else if (changed) {
+		card_invalidate(c);
+	}
+ unlock:
+	cache_unlock();
+}
+
+/* the HW_REFINE ioctl on pcm->fd, served from the cache if possible */
+int _snd_pcm_refine_cache_ioctl(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+	struct refine_card *c;
+	struct refine_entry *e;
+	struct refine_rec rec;
+	unsigned int generation;
+
+	rec.hash = refine_hash(pcm, params);
+	rec.device = pcm->device;
+	rec.subdevice = pcm->subdevice;
+	rec.stream = pcm->stream;
+
+	cache_lock();
+	c = card_get(pcm->card);
+	if (c) {
+		for (e = c->hash[rec.hash % REFINE_HASH_SIZE]; e; e = e->next) {
+			if (e->rec.hash == rec.hash &&
+			    e->rec.device == rec.device &&
+			    e->rec.subdevice == rec.subdevice &&
+			    e->rec.stream == rec.stream &&
+			    !memcmp(&e->rec.in, params, sizeof(*params))) {
+				*params = e->rec.out;
+				cache_unlock();
+				return 0;
+			}
+		}
+	}
+	generation = refine_generation;
+	cache_unlock();
+
+	rec.in = *params;
+	if (_snd_pcm_hw_ioctl(pcm, SNDRV_PCM_IOCTL_HW_REFINE, params) < 0)
+		return -errno;
+	/* only the successes are remembered */
+	if (!c)
+		return 0;
+	rec.out = *params;
+
+	cache_lock();
+	/* the result may predate an invalidation in the meantime, or the
+	 * card may have gone
+	 */
+	if (generation != refine_generation)
+		goto unlock;
+	for (c = refine_cards; c; c = c->next) {
+		if (c->card == pcm->card && c->ctl) {
+			if (!card_insert(c, &rec))
+				c->dirty = 1;
+			break;
+		}
+	}
+ unlock:
+	cache_unlock();
+	return 0;
+}
+
+/* save the new results at the end of a negotiation */
+void _snd_pcm_refine_cache_flush(snd_pcm_t *pcm)
+{
+	struct refine_card *c;
+
+	if (!refine_dir)
+		return;
+	cache_lock();
+	for (c = refine_cards; c; c = c->next) {
+		if (c->card == pcm->card) {
+			if (c->dirty)
+				card_save(c);
+			break;
+		}
+	}
+	cache_unlock();
+}
+
+/* enable the on-disk copy in the given directory (e.g. under /run),
+ * or disable it with NULL
+ */
+int snd_pcm_refine_cache_set_dir(const char *dir)
+{
+	char *p = NULL;
+
+	if (dir) {
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+			return -errno;
+		p = strdup(dir);
+		if (!p)
+			return -ENOMEM;
+	}
+	cache_lock();
+	free(refine_dir);
+	refine_dir = p;
+	cache_unlock();
+	return 0;
+}
+
+/* drop all cached results, also closing the control handles */
+void snd_pcm_refine_cache_clear(void)
+{
+	struct refine_card *c;
+
+	cache_lock();
+	while ((c = refine_cards) != NULL) {
+		refine_cards = c->next;
+		card_free(c);
+	}
+	refine_generation++;
+	cache_unlock();
+}
@@ -0,0 +1,147 @@
+/*
+ *  SALSA-Lib - PCM telemetry counters
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pcm.h"
+#include "local.h"
+
+/*
+ * The counters are written only by the thread driving the PCM, so a
+ * plain increment is enough there.  The relaxed atomic accesses keep
+ * them from tearing when a snapshot is taken from another thread.
+ */
+#define stats_add(p, val) \
+	__atomic_store_n(p, *(p) + (val), __ATOMIC_RELAXED)
+#define stats_get(p)	__atomic_load_n(p, __ATOMIC_RELAXED)
+
+static unsigned int hist_bin(unsigned long val)
+{
+	unsigned int bin;
+
+	if (!val)
+		return 0;
+	bin = sizeof(val) * 8 - __builtin_clzl(val);
+	if (bin >= SND_PCM_STATS_HIST_BINS)
+		bin = SND_PCM_STATS_HIST_BINS - 1;
+	return bin;
+}
+
+void _snd_pcm_stats_wakeup(snd_pcm_t *pcm, snd_pcm_sframes_t avail)
+{
+	snd_pcm_stats_t *stats = &pcm->stats;
+	struct timespec ts;
+	long long nsec;
+	unsigned long usec;
+
+	stats_add(&stats->wakeups, 1);
+	if (avail >= 0)
+		stats_add(&stats->avail_hist[hist_bin(avail)], 1);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	nsec = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	if (pcm->stats_nsec) {
+		usec = (nsec - pcm->stats_nsec) / 1000;
+		stats_add(&stats->interval_hist[hist_bin(usec)], 1);
+	}
+	pcm->stats_nsec = nsec;
+}
+
+void _snd_pcm_stats_xfer(snd_pcm_t *pcm, snd_pcm_uframes_t frames)
+{
+	snd_pcm_stats_t *stats = &pcm->stats;
+
+	stats_add(&stats->xfers, 1);
+	stats_add(&stats->frames, frames);
+	stats_add(&stats->xfer_hist[hist_bin(frames)], 1);
+}
+
+/* count each xrun and suspend once until the stream is recovered */
+int _snd_pcm_stats_error(snd_pcm_t *pcm, int err)
+{
+	if (err == -EPIPE && !pcm->stats_xrun) {
+		pcm->stats_xrun = 1;
+		stats_add(&pcm->stats.xruns, 1);
+	} else if (err == -ESTRPIPE && !pcm->stats_suspend) {
+		pcm->stats_suspend = 1;
+		stats_add(&pcm->stats.suspends, 1);
+	}
+	return err;
+}
+
+/* take a snapshot; can be called from any thread */
+int snd_pcm_stats(snd_pcm_t *pcm, snd_pcm_stats_t *stats)
+{
+	const snd_pcm_stats_t *src = &pcm->stats;
+	unsigned int i;
+
+	stats->xruns = stats_get(&src->xruns);
+	stats->suspends = stats_get(&src->suspends);
+	stats->wakeups = stats_get(&src->wakeups);
+	stats->ioctls = stats_get(&src->ioctls);
+	stats->xfers = stats_get(&src->xfers);
+	stats->frames = stats_get(&src->frames);
+	for (i = 0; i < SND_PCM_STATS_HIST_BINS; i++) {
+		stats->avail_hist[i] = stats_get(&src->avail_hist[i]);
+		stats->interval_hist[i] = stats_get(&src->interval_hist[i]);
+		stats->xfer_hist[i] = stats_get(&src->xfer_hist[i]);
+	}
+	return 0;
+}
+
+/* must be called from the thread driving the PCM */
+void snd_pcm_stats_reset(snd_pcm_t *pcm)
+{
+	unsigned long *p = (unsigned long *)&pcm->stats;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(pcm->stats) / sizeof(*p); i++)
+		__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+	pcm->stats_nsec = 0;
+}
+
+/* each line shows the lower bound of the bin */
+static void dump_hist(snd_output_t *out, const char *name, const char *unit,
+		      const unsigned long *hist)
+{
+	unsigned int i;
+
+	snd_output_printf(out, "  %s:\n", name);
+	for (i = 0; i < SND_PCM_STATS_HIST_BINS; i++) {
+		if (hist[i])
+			snd_output_printf(out, "    %10lu %s: %lu\n",
+					  i ? 1UL << (i - 1) : 0UL,
+					  unit, hist[i]);
+	}
+}
+
+int snd_pcm_stats_dump(const snd_pcm_stats_t *stats, snd_output_t *out)
+{
+	snd_output_printf(out, "PCM stats:\n");
+	snd_output_printf(out, "  xruns        : %lu\n", stats->xruns);
+	snd_output_printf(out, "  suspends     : %lu\n", stats->suspends);
+	snd_output_printf(out, "  wakeups      : %lu\n", stats->wakeups);
+	snd_output_printf(out, "  ioctls       : %lu\n", stats->ioctls);
+	snd_output_printf(out, "  transfers    : %lu\n", stats->xfers);
+	snd_output_printf(out, "  frames       : %lu\n", stats->frames);
+	dump_hist(out, "avail at wakeup", "frames", stats->avail_hist);
+	dump_hist(out, "wakeup interval", "usec", stats->interval_hist);
+	dump_hist(out, "frames per transfer", "frames", stats->xfer_hist);
+	return 0;
+}
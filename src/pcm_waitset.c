@@ -0,0 +1,225 @@
+/*
+ *  SALSA-Lib - PCM wait-set
+ *
+ *  Waits for many PCM (and other) file descriptors in a single epoll
+ *  instance, and reports the ready PCMs together with their avail.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "pcm.h"
+#include "local.h"
+
+struct waitset_entry {
+	snd_pcm_t *pcm;		/* NULL for a plain fd */
+	int fd;
+	void *private_data;
+	struct waitset_entry *next;
+};
+
+struct _snd_pcm_waitset {
+	int epfd;
+	struct waitset_entry *entries;
+	struct epoll_event *events;	/* buffer for epoll_wait() */
+	unsigned int events_size;
+};
+
+int snd_pcm_waitset_open(snd_pcm_waitset_t **wsp)
+{
+	snd_pcm_waitset_t *ws;
+
+	*wsp = NULL;
+	ws = calloc(1, sizeof(*ws));
+	if (!ws)
+		return -ENOMEM;
+	ws->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ws->epfd < 0) {
+		int err = -errno;
+		free(ws);
+		return err;
+	}
+	*wsp = ws;
+	return 0;
+}
+
+int snd_pcm_waitset_close(snd_pcm_waitset_t *ws)
+{
+	struct waitset_entry *e, *next;
+
+	for (e = ws->entries; e; e = next) {
+		next = e->next;
+		free(e);
+	}
+	close(ws->epfd);
+	free(ws->events);
+	free(ws);
+	return 0;
+}
+
+static int waitset_add(snd_pcm_waitset_t *ws, snd_pcm_t *pcm, int fd,
+		       unsigned short events, void *private_data)
+{
+	struct waitset_entry *e;
+	struct epoll_event ev;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+	e->pcm = pcm;
+	e->fd = fd;
+	e->private_data = private_data;
+
+	memzero_valgrind(&ev, sizeof(ev));
+	/* POLLIN, POLLOUT, POLLERR, etc match with EPOLL* values */
+	ev.events = events;
+	ev.data.ptr = e;
+	if (epoll_ctl(ws->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		int err = -errno;
+		free(e);
+		return err;
+	}
+	e->next = ws->entries;
+	ws->entries = e;
+	return 0;
+}
+
+static int waitset_remove(snd_pcm_waitset_t *ws, snd_pcm_t *pcm, int fd)
+{
+	struct waitset_entry *e, **prevp;
+
+	for (prevp = &ws->entries; (e = *prevp) != NULL; prevp = &e->next) {
+		if (e->pcm == pcm && e->fd == fd) {
+			epoll_ctl(ws->epfd, EPOLL_CTL_DEL, fd, NULL);
+			*prevp = e->next;
+			free(e);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+int snd_pcm_waitset_add_pcm(snd_pcm_waitset_t *ws, snd_pcm_t *pcm,
+			    void *private_data)
+{
+	return waitset_add(ws, pcm, pcm->pollfd.fd, pcm->pollfd.events,
+			   private_data);
+}
+
+int snd_pcm_waitset_remove_pcm(snd_pcm_waitset_t *ws, snd_pcm_t *pcm)
+{
+	return waitset_remove(ws, pcm, pcm->pollfd.fd);
+}
+
+int snd_pcm_waitset_add_fd(snd_pcm_waitset_t *ws, int fd,
+			   unsigned short events, void *private_data)
+{
+	return waitset_add(ws, NULL, fd, events, private_data);
+}
+
+int snd_pcm_waitset_remove_fd(snd_pcm_waitset_t *ws, int fd)
+{
+	return waitset_remove(ws, NULL, fd);
+}
+
+static long long waitset_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* fill the event for a ready PCM; returns 0 if it woke up spuriously */
+static int waitset_pcm_ready(snd_pcm_waitset_event_t *ev)
+{
+	snd_pcm_t *pcm = ev->pcm;
+
+	/* read from the mmapped status; no ioctl when it's available */
+	ev->avail = snd_pcm_avail_update(pcm);
+	if (ev->revents & (POLLERR | POLLHUP | POLLNVAL))
+		return 1;
+	if (ev->avail < 0)
+		return 1;
+	/* e.g. a dmix client whose shared hw fd is ready for the others */
+	if ((snd_pcm_uframes_t)ev->avail < pcm->sw_params.avail_min)
+		return 0;
+	pcm_stats_wakeup(pcm, ev->avail);
+	return 1;
+}
+
+int snd_pcm_waitset_wait(snd_pcm_waitset_t *ws,
+			 snd_pcm_waitset_event_t *events, unsigned int space,
+			 int timeout)
+{
+	long long end = 0;
+	int i, n, count;
+
+	if (!space)
+		return -EINVAL;
+	if (space > ws->events_size) {
+		struct epoll_event *p;
+
+		p = realloc(ws->events, space * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		ws->events = p;
+		ws->events_size = space;
+	}
+	if (timeout > 0)
+		end = waitset_now_ms() + timeout;
+
+	for (;;) {
+		n = epoll_wait(ws->epfd, ws->events, space, timeout);
+		if (n < 0) {
+			if (errno != EINTR)
+				return -errno;
+			n = 0;
+		} else if (!n) {
+			return 0;
+		}
+
+		count = 0;
+		for (i = 0; i < n; i++) {
+			struct waitset_entry *e = ws->events[i].data.ptr;
+			snd_pcm_waitset_event_t *ev = &events[count];
+
+			ev->pcm = e->pcm;
+			ev->fd = e->fd;
+			ev->private_data = e->private_data;
+			ev->revents = ws->events[i].events;
+			ev->avail = 0;
+			if (e->pcm && !waitset_pcm_ready(ev))
+				continue;
+			count++;
+		}
+		if (count)
+			return count;
+
+		/* only spurious wakeups (or a signal); wait for the rest */
+		if (timeout > 0) {
+			timeout = end - waitset_now_ms();
+			if (timeout <= 0)
+				return 0;
+		} else if (!timeout) {
+			return 0;
+		}
+	}
+}
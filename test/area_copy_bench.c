@@ -0,0 +1,125 @@
+/*
+ * Compare snd_pcm_area_copy() with the former per-sample memcpy() loop
+ * for interleaved <-> non-interleaved copies of 2, 8 and 64 channels
+ *
+ * usage: area_copy_bench [frames [loops]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "asoundlib.h"
+
+/* the strided copy before the width-specialized kernels */
+static void __attribute__((noinline))
+ref_area_copy(const snd_pcm_channel_area_t *dst_area,
+	      snd_pcm_uframes_t dst_offset,
+	      const snd_pcm_channel_area_t *src_area,
+	      snd_pcm_uframes_t src_offset,
+	      unsigned int samples, int width)
+{
+	const char *src = snd_pcm_channel_area_addr(src_area, src_offset);
+	char *dst = snd_pcm_channel_area_addr(dst_area, dst_offset);
+	int src_step = src_area->step / 8;
+	int dst_step = dst_area->step / 8;
+
+	width /= 8;
+	while (samples-- > 0) {
+		memcpy(dst, src, width);
+		src += src_step;
+		dst += dst_step;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void setup(snd_pcm_channel_area_t *inter, snd_pcm_channel_area_t *non,
+		  char *ibuf, char *nbuf, unsigned int channels,
+		  unsigned int frames, int width)
+{
+	unsigned int c;
+
+	for (c = 0; c < channels; c++) {
+		inter[c].addr = ibuf;
+		inter[c].first = c * width;
+		inter[c].step = channels * width;
+		non[c].addr = nbuf + c * frames * width / 8;
+		non[c].first = 0;
+		non[c].step = width;
+	}
+}
+
+static void bench(unsigned int channels, snd_pcm_format_t format,
+		  unsigned int frames, unsigned int loops)
+{
+	int width = snd_pcm_format_physical_width(format);
+	size_t size = (size_t)channels * frames * width / 8;
+	snd_pcm_channel_area_t *inter, *non;
+	char *ibuf, *nbuf, *check;
+	double t0, t_ref, t_new;
+	unsigned int c, l;
+
+	inter = calloc(channels, sizeof(*inter));
+	non = calloc(channels, sizeof(*non));
+	ibuf = malloc(size);
+	nbuf = malloc(size);
+	check = malloc(size);
+	for (c = 0; c < size; c++)
+		ibuf[c] = rand();
+	setup(inter, non, ibuf, nbuf, channels, frames, width);
+
+	t0 = now();
+	for (l = 0; l < loops; l++)
+		for (c = 0; c < channels; c++) {
+			ref_area_copy(&non[c], 0, &inter[c], 0, frames, width);
+			ref_area_copy(&inter[c], 0, &non[c], 0, frames, width);
+		}
+	t_ref = now() - t0;
+	memcpy(check, nbuf, size);
+
+	memset(nbuf, 0, size);
+	t0 = now();
+	for (l = 0; l < loops; l++)
+		for (c = 0; c < channels; c++) {
+			snd_pcm_area_copy(&non[c], 0, &inter[c], 0, frames,
+					  format);
+			snd_pcm_area_copy(&inter[c], 0, &non[c], 0, frames,
+					  format);
+		}
+	t_new = now() - t0;
+
+	printf("%2u ch %-10s: memcpy loop %7.2f ns/sample, kernels %7.2f ns/sample (x%.2f)%s\n",
+	       channels, snd_pcm_format_name(format),
+	       t_ref * 1e9 / ((double)loops * channels * frames * 2),
+	       t_new * 1e9 / ((double)loops * channels * frames * 2),
+	       t_ref / t_new, memcmp(check, nbuf, size) ? " MISMATCH" : "");
+	free(inter);
+	free(non);
+	free(ibuf);
+	free(nbuf);
+	free(check);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int chs[] = { 2, 8, 64 };
+	static const snd_pcm_format_t fmts[] = {
+		SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_3LE,
+		SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT64_LE,
+	};
+	unsigned int frames = argc > 1 ? atoi(argv[1]) : 1024;
+	unsigned int loops = argc > 2 ? atoi(argv[2]) : 2000;
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(chs) / sizeof(*chs); i++)
+		for (j = 0; j < sizeof(fmts) / sizeof(*fmts); j++)
+			bench(chs[i], fmts[j], frames, loops / chs[i] * 2);
+	return 0;
+}
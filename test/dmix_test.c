@@ -0,0 +1,206 @@
+/*
+ * Drive the dmix mixer on an in-process fake ring: several clients,
+ * one after another and then as concurrent threads on the next lap of
+ * the ring, without clearing the sum in between, mix into a shared
+ * sum and hw ring; the ring must hold the saturated sum of all of them.
+ * A late client mixing into the passed lap must change nothing.
+ * Also prints the mixing throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "asoundlib.h"
+#include "local.h"
+
+#define RING		4096	/* hw ring frames */
+#define CHANNELS	2
+#define CLIENTS		16
+#define CHUNK		64	/* frames per mix call in threads */
+#define BENCH_FRAMES	(48000 * 20)
+
+struct fake_ring {
+	snd_pcm_format_t format;
+	uint64_t sum[RING * CHANNELS];
+	int32_t hw[RING * CHANNELS];	/* large enough for S32 */
+	snd_pcm_channel_area_t hw_areas[CHANNELS];
+};
+
+struct client {
+	struct fake_ring *ring;
+	int32_t buf[RING * CHANNELS];
+	snd_pcm_channel_area_t areas[CHANNELS];
+	pthread_t thread;
+};
+
+static struct fake_ring ring;
+static struct client clients[CLIENTS];
+static int failed;
+
+static void set_areas(snd_pcm_channel_area_t *areas, void *buf,
+		      snd_pcm_format_t format)
+{
+	unsigned int width = snd_pcm_format_physical_width(format);
+	unsigned int c;
+
+	for (c = 0; c < CHANNELS; c++) {
+		areas[c].addr = buf;
+		areas[c].first = c * width;
+		areas[c].step = CHANNELS * width;
+	}
+}
+
+static void setup(snd_pcm_format_t format)
+{
+	unsigned int i, n;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.format = format;
+	set_areas(ring.hw_areas, ring.hw, format);
+	srand(1);
+	for (n = 0; n < CLIENTS; n++) {
+		struct client *cl = &clients[n];
+
+		cl->ring = &ring;
+		set_areas(cl->areas, cl->buf, format);
+		/* loud enough that a part of the sums saturate */
+		for (i = 0; i < RING * CHANNELS; i++) {
+			int32_t v = rand() % 16000 - 8000;
+
+			if (format == SND_PCM_FORMAT_S16)
+				((int16_t *)cl->buf)[i] = v;
+			else
+				cl->buf[i] = v * 256;
+		}
+	}
+}
+
+static int32_t expected(unsigned int i)
+{
+	int32_t s = 0;
+	unsigned int n;
+
+	if (ring.format == SND_PCM_FORMAT_S16) {
+		for (n = 0; n < CLIENTS; n++)
+			s += ((int16_t *)clients[n].buf)[i];
+		return s > 0x7fff ? 0x7fff : s < -0x8000 ? -0x8000 : s;
+	}
+	for (n = 0; n < CLIENTS; n++)
+		s += clients[n].buf[i] >> 8;
+	if (s > 0x7fffff)
+		return 0x7fffffff;
+	if (s < -0x800000)
+		return -0x7fffffff - 1;
+	return s * 256;
+}
+
+static void verify(const char *what)
+{
+	unsigned int i, bad = 0;
+	int32_t v;
+
+	for (i = 0; i < RING * CHANNELS; i++) {
+		if (ring.format == SND_PCM_FORMAT_S16)
+			v = ((int16_t *)ring.hw)[i];
+		else
+			v = ring.hw[i];
+		if (v != expected(i))
+			bad++;
+	}
+	printf("%s: %s %s mix", bad ? "FAIL" : "ok  ",
+	       snd_pcm_format_name(ring.format), what);
+	if (bad)
+		printf(", %u of %u samples wrong", bad, RING * CHANNELS);
+	printf("\n");
+	if (bad)
+		failed = 1;
+}
+
+/* mix the whole ring in small chunks, from a rotated start */
+static void client_mix(struct client *cl, uint32_t lap)
+{
+	unsigned int start = (cl - clients) * RING / CLIENTS;
+	unsigned int done, ofs;
+
+	for (done = 0; done < RING; done += CHUNK) {
+		ofs = (start + done) % RING;
+		_snd_pcm_dmix_mix_areas(cl->ring->sum, cl->ring->hw_areas, ofs,
+					cl->areas, ofs, CHANNELS, CHUNK,
+					cl->ring->format, lap);
+	}
+}
+
+static void *client_thread(void *arg)
+{
+	client_mix(arg, 1);
+	return NULL;
+}
+
+static void test_format(snd_pcm_format_t format)
+{
+	unsigned int n;
+
+	setup(format);
+	for (n = 0; n < CLIENTS; n++)
+		_snd_pcm_dmix_mix_areas(ring.sum, ring.hw_areas, 0,
+					clients[n].areas, 0, CHANNELS, RING,
+					format, 0);
+	verify("sequential");
+
+	/* the next lap replaces the sums of the previous one */
+	memset(ring.hw, 0, sizeof(ring.hw));
+	for (n = 0; n < CLIENTS; n++)
+		pthread_create(&clients[n].thread, NULL, client_thread,
+			       &clients[n]);
+	for (n = 0; n < CLIENTS; n++)
+		pthread_join(clients[n].thread, NULL);
+	verify("concurrent");
+
+	client_mix(&clients[0], 0);
+	verify("late");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one client mixing period by period, lap after lap */
+static void bench(snd_pcm_format_t format)
+{
+	struct client *cl = &clients[0];
+	unsigned long done;
+	unsigned int ofs = 0;
+	uint32_t lap = 0;
+	double t;
+
+	setup(format);
+	t = now();
+	for (done = 0; done < BENCH_FRAMES; done += CHUNK) {
+		_snd_pcm_dmix_mix_areas(ring.sum, ring.hw_areas, ofs,
+					cl->areas, ofs, CHANNELS, CHUNK,
+					format, lap);
+		ofs = (ofs + CHUNK) % RING;
+		if (!ofs)
+			lap++;
+	}
+	t = now() - t;
+	printf("%s: %.1f Mframes/s, %.3f%% of a 48kHz stream\n",
+	       snd_pcm_format_name(format), BENCH_FRAMES / t / 1e6,
+	       t * 100 * 48000 / BENCH_FRAMES);
+}
+
+int main(void)
+{
+	test_format(SND_PCM_FORMAT_S16);
+	test_format(SND_PCM_FORMAT_S32);
+	bench(SND_PCM_FORMAT_S16);
+	bench(SND_PCM_FORMAT_S32);
+	return failed;
+}
@@ -0,0 +1,109 @@
+/*
+ * Load 10k synthetic controls into a hctl and compare the element
+ * lookup with the former list walk
+ *
+ * usage: hctl_bench [elements [lookups]]
+ *
+ * Built together with hcontrol.c to reach its static helpers; no
+ * control device is opened.
+ */
+
+#include <time.h>
+#include "../src/hcontrol.c"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* snd_hctl_find_elem() before the hash index */
+static snd_hctl_elem_t *ref_find_elem(snd_hctl_t *hctl,
+				      const snd_ctl_elem_id_t *id)
+{
+	snd_hctl_elem_t *elem;
+
+	for (elem = hctl->first_elem; elem; elem = elem->next) {
+		if (elem->id.iface == id->iface &&
+		    elem->id.index == id->index &&
+		    !strcmp((char *)elem->id.name, (char *)id->name))
+			return elem;
+	}
+	return NULL;
+}
+
+static double bench(snd_hctl_t *hctl, const snd_ctl_elem_id_t *ids,
+		    unsigned int count, unsigned int loops,
+		    snd_hctl_elem_t *(*find)(snd_hctl_t *,
+					     const snd_ctl_elem_id_t *))
+{
+	snd_ctl_elem_id_t id;
+	unsigned int i, missed = 0;
+	double t;
+
+	t = now();
+	for (i = 0; i < loops; i++) {
+		id = ids[(i * 7919) % count];
+		/* half as from the events (with numid), half by name */
+		if (i & 1)
+			id.numid = 0;
+		if (!find(hctl, &id))
+			missed++;
+	}
+	t = now() - t;
+	if (missed) {
+		fprintf(stderr, "%u lookups failed\n", missed);
+		exit(1);
+	}
+	return t * 1e9 / loops;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = argc > 1 ? atoi(argv[1]) : 10000;
+	unsigned int loops = argc > 2 ? atoi(argv[2]) : 1000000;
+	unsigned int i, first;
+	snd_ctl_elem_id_t *ids;
+	snd_hctl_t hctl;
+	double t;
+
+	ids = calloc(count, sizeof(*ids));
+	for (i = 0; i < count; i++) {
+		ids[i].numid = i + 1;
+		ids[i].iface = i % 16 ? SND_CTL_ELEM_IFACE_MIXER :
+			SND_CTL_ELEM_IFACE_PCM;
+		ids[i].index = i % 4;
+		snprintf((char *)ids[i].name, sizeof(ids[i].name),
+			 "Channel %u Playback Volume", i / 4);
+	}
+	memset(&hctl, 0, sizeof(hctl));
+	hctl.compare = snd_hctl_compare_default;
+
+	/* a small card first, then the rest, so the table grows with
+	 * the elements of both loads
+	 */
+	first = count / 10;
+	t = now();
+	if (load_elems(&hctl, ids, first) < 0 ||
+	    load_elems(&hctl, ids + first, count - first) < 0) {
+		fprintf(stderr, "load failed\n");
+		return 1;
+	}
+	t = now() - t;
+	printf("load %u elements: %.3f ms, hash size %u\n",
+	       count, t * 1e3, hctl.hash_size);
+
+	printf("find (hash):      %8.1f ns\n",
+	       bench(&hctl, ids, count, loops, snd_hctl_find_elem));
+	printf("find (list walk): %8.1f ns\n",
+	       bench(&hctl, ids, count, loops / 1000 + 1, ref_find_elem));
+	hash_free(&hctl);
+	printf("find (bisect):    %8.1f ns\n",
+	       bench(&hctl, ids, count, loops, snd_hctl_find_elem));
+
+	snd_hctl_free(&hctl);
+	free(ids);
+	return 0;
+}
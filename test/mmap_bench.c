@@ -0,0 +1,127 @@
+/*
+ * Compare the CPU usage and the ioctl count of snd_pcm_writei() with
+ * the mmap transfer in snd_pcm_mmap_writei() on a real device
+ *
+ * usage: mmap_bench [device [seconds]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "asoundlib.h"
+
+#define RATE		48000
+#define CHANNELS	2
+#define CHUNK		256	/* frames per write */
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int setup(snd_pcm_t *pcm, snd_pcm_access_t access)
+{
+	snd_pcm_hw_params_t *params;
+	unsigned int rate = RATE, buffer_time = 20000;
+	int err;
+
+	snd_pcm_hw_params_alloca(&params);
+	err = snd_pcm_hw_params_any(pcm, params);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_access(pcm, params, access);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_format(pcm, params, SND_PCM_FORMAT_S16_LE);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_channels(pcm, params, CHANNELS);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_rate_near(pcm, params, &rate, 0);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_params_set_buffer_time_near(pcm, params,
+						     &buffer_time, 0);
+	if (err < 0)
+		return err;
+	return snd_pcm_hw_params(pcm, params);
+}
+
+static int run(const char *dev, int mmap, unsigned int secs)
+{
+	snd_pcm_t *pcm;
+	short buf[CHUNK * CHANNELS];
+	snd_pcm_uframes_t total = 0, frames = (snd_pcm_uframes_t)RATE * secs;
+	snd_pcm_sframes_t n;
+	double cpu;
+	int err;
+
+	err = snd_pcm_open(&pcm, dev, SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0)
+		return err;
+	err = setup(pcm, mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED :
+		    SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (err < 0)
+		goto out;
+#if SALSA_HAS_STATS_SUPPORT
+	snd_pcm_stats_reset(pcm);
+#endif
+	memset(buf, 0, sizeof(buf));
+	cpu = cpu_time();
+	while (total < frames) {
+		if (mmap)
+			n = snd_pcm_mmap_writei(pcm, buf, CHUNK);
+		else
+			n = snd_pcm_writei(pcm, buf, CHUNK);
+		if (n < 0) {
+			n = snd_pcm_recover(pcm, n, 0);
+			if (n < 0) {
+				err = n;
+				goto out;
+			}
+			continue;
+		}
+		total += n;
+	}
+	cpu = cpu_time() - cpu;
+	printf("%-6s: %lu frames, cpu %.3f s (%.2f%%)",
+	       mmap ? "mmap" : "writei", total, cpu, cpu * 100 / secs);
+#if SALSA_HAS_STATS_SUPPORT
+	{
+		snd_pcm_stats_t stats;
+
+		snd_pcm_stats(pcm, &stats);
+		printf(", ioctls %lu (%.1f/s), wakeups %lu",
+		       stats.ioctls, (double)stats.ioctls / secs,
+		       stats.wakeups);
+	}
+#endif
+	printf("\n");
+	snd_pcm_drop(pcm);
+ out:
+	snd_pcm_close(pcm);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "hw:0";
+	unsigned int secs = argc > 2 ? atoi(argv[2]) : 5;
+	int err;
+
+	err = run(dev, 0, secs);
+	if (!err)
+		err = run(dev, 1, secs);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", dev, snd_strerror(err));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * Drive the pump on a fake PCM: the FIFO must pass the frames in
+ * order between the application and the pump thread, and the FIFO
+ * underruns and overruns must be counted with the silence and dropped
+ * frames.
+ *
+ * Built together with pcm_pump.c, with its PCM calls redirected to
+ * the fakes below; no sound device is opened.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include "asoundlib.h"
+#include "local.h"
+
+#define CHANNELS	2
+#define PERIOD		256
+#define BUFFER		1024
+#define FIFO		4096
+#define FRAMES		200000	/* through the pump thread */
+#define CHUNK		100	/* frames per application call */
+#define TIMEOUT		10000	/* ms */
+
+static int failed;
+
+static void check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("%s: ", ok ? "ok  " : "FAIL");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!ok)
+		failed = 1;
+}
+
+/*
+ * the fake device: frame n holds n + 1 in all channels, silence is 0
+ */
+static int state;
+static unsigned long produced;		/* capture frames made or dropped */
+static unsigned long limit;		/* capture frames to make at all */
+static unsigned long consumed;		/* playback frames received */
+static unsigned long silent;		/* playback silence received */
+static int misordered;
+
+static snd_pcm_sframes_t fake_writei(snd_pcm_t *pcm, const void *buf,
+				     snd_pcm_uframes_t frames)
+{
+	const int32_t *p = buf;
+	snd_pcm_uframes_t i;
+
+	for (i = 0; i < frames; i++, p += CHANNELS) {
+		if (!p[0] && !p[CHANNELS - 1]) {
+			silent++;
+			continue;
+		}
+		if (p[0] != consumed + 1 || p[CHANNELS - 1] != p[0])
+			misordered++;
+		consumed = p[0];
+	}
+	return frames;
+}
+
+static snd_pcm_sframes_t fake_readi(snd_pcm_t *pcm, void *buf,
+				    snd_pcm_uframes_t frames)
+{
+	int32_t *p = buf;
+	snd_pcm_uframes_t i;
+	unsigned int c;
+
+	for (i = 0; i < frames; i++) {
+		produced++;
+		for (c = 0; c < CHANNELS; c++)
+			*p++ = produced;
+	}
+	return frames;
+}
+
+static snd_pcm_sframes_t fake_forward(snd_pcm_t *pcm,
+				      snd_pcm_uframes_t frames)
+{
+	produced += frames;
+	return frames;
+}
+
+/* playback drains at once; capture has the rest of its frames */
+static snd_pcm_sframes_t fake_avail_update(snd_pcm_t *pcm)
+{
+	if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+		return pcm->buffer_size;
+	if (limit - produced < pcm->buffer_size)
+		return limit - produced;
+	return pcm->buffer_size;
+}
+
+static snd_pcm_state_t fake_state(snd_pcm_t *pcm)
+{
+	return __atomic_load_n(&state, __ATOMIC_RELAXED);
+}
+
+static int fake_start(snd_pcm_t *pcm)
+{
+	__atomic_store_n(&state, SND_PCM_STATE_RUNNING, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int fake_wait(snd_pcm_t *pcm, int timeout)
+{
+	poll(NULL, 0, 1);
+	return 1;
+}
+
+#define snd_pcm_writei		fake_writei
+#define snd_pcm_mmap_writei	fake_writei
+#define snd_pcm_readi		fake_readi
+#define snd_pcm_mmap_readi	fake_readi
+#define snd_pcm_forward		fake_forward
+#define snd_pcm_avail_update	fake_avail_update
+#define snd_pcm_state		fake_state
+#define snd_pcm_start		fake_start
+#define snd_pcm_wait		fake_wait
+#include "../src/pcm_pump.c"
+
+static void setup(snd_pcm_t *pcm, snd_pcm_stream_t stream)
+{
+	memset(pcm, 0, sizeof(*pcm));
+	pcm->stream = stream;
+	pcm->setup = 1;
+	pcm->_access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	pcm->format = SND_PCM_FORMAT_S32;
+	pcm->channels = CHANNELS;
+	pcm->sample_bits = 32;
+	pcm->frame_bits = 32 * CHANNELS;
+	pcm->period_size = PERIOD;
+	pcm->period_time = 1000;
+	pcm->buffer_size = BUFFER;
+	pcm->sw_params.start_threshold = PERIOD;
+	pcm->sw_params.avail_min = PERIOD;
+	state = SND_PCM_STATE_PREPARED;
+	produced = consumed = silent = 0;
+	misordered = 0;
+}
+
+static void fill(int32_t *buf, unsigned long first, unsigned int frames)
+{
+	unsigned int i, c;
+
+	for (i = 0; i < frames; i++)
+		for (c = 0; c < CHANNELS; c++)
+			*buf++ = first + i + 1;
+}
+
+/* the accounting, calling the pump steps by hand */
+static void test_playback_steps(void)
+{
+	static int32_t buf[FIFO * CHANNELS];
+	snd_pcm_pump_stats_t stats;
+	snd_pcm_pump_t *pump;
+	snd_pcm_t pcm;
+	int err;
+
+	setup(&pcm, SND_PCM_STREAM_PLAYBACK);
+	err = snd_pcm_pump_open(&pump, &pcm, FIFO);
+	check(!err, "playback pump open");
+	if (err)
+		return;
+	fill(buf, 0, FIFO);
+	check(snd_pcm_pump_write(pump, buf, FIFO / 2) == FIFO / 2,
+	      "write half of the FIFO");
+	check(snd_pcm_pump_write(pump, buf + FIFO / 2 * CHANNELS,
+				 FIFO) == FIFO / 2,
+	      "short write into the full FIFO");
+
+	pump_playback(pump, BUFFER);
+	check(state == SND_PCM_STATE_RUNNING && consumed == BUFFER,
+	      "start after a buffer, %lu frames played", consumed);
+	while (consumed < FIFO && !misordered)
+		pump_playback(pump, BUFFER);
+	check(consumed == FIFO && !misordered && !silent,
+	      "FIFO played in order");
+	pump_playback(pump, BUFFER - PERIOD / 2);
+	check(silent == PERIOD / 2, "dry FIFO topped up to a period, "
+	      "%lu silence frames", silent);
+
+	snd_pcm_pump_get_stats(pump, &stats);
+	check(stats.fifo_overruns == 1 && stats.fifo_underruns == 1 &&
+	      stats.silence_frames == PERIOD / 2 && !stats.dropped_frames,
+	      "playback stats: %lu overruns, %lu underruns, %lu silence",
+	      stats.fifo_overruns, stats.fifo_underruns,
+	      stats.silence_frames);
+	snd_pcm_pump_close(pump);
+}
+
+static void test_capture_steps(void)
+{
+	static int32_t buf[FIFO * CHANNELS];
+	snd_pcm_pump_stats_t stats;
+	snd_pcm_pump_t *pump;
+	snd_pcm_t pcm;
+	snd_pcm_sframes_t n;
+	int err;
+
+	setup(&pcm, SND_PCM_STREAM_CAPTURE);
+	err = snd_pcm_pump_open(&pump, &pcm, FIFO);
+	check(!err, "capture pump open");
+	if (err)
+		return;
+	state = SND_PCM_STATE_RUNNING;
+	while (fifo_space(&pump->fifo))
+		pump_capture(pump, BUFFER);
+	check(produced == FIFO, "FIFO filled, %lu frames", produced);
+	pump_capture(pump, BUFFER);
+	check(produced == FIFO + BUFFER, "full FIFO drops the avail");
+
+	n = snd_pcm_pump_read(pump, buf, FIFO + 1);
+	check(n == FIFO && buf[0] == 1 && buf[(FIFO - 1) * CHANNELS] == FIFO,
+	      "short read of the FIFO in order");
+
+	snd_pcm_pump_get_stats(pump, &stats);
+	check(stats.fifo_overruns == 1 && stats.dropped_frames == BUFFER &&
+	      stats.fifo_underruns == 1 && !stats.silence_frames,
+	      "capture stats: %lu overruns, %lu dropped, %lu underruns",
+	      stats.fifo_overruns, stats.dropped_frames,
+	      stats.fifo_underruns);
+	snd_pcm_pump_close(pump);
+}
+
+/* the application and the pump thread on both sides of the FIFO */
+static void test_playback_thread(void)
+{
+	static int32_t buf[CHUNK * CHANNELS];
+	snd_pcm_pump_stats_t stats;
+	snd_pcm_pump_t *pump;
+	snd_pcm_t pcm;
+	unsigned long done = 0;
+	unsigned int n;
+	int err, ms = 0;
+
+	setup(&pcm, SND_PCM_STREAM_PLAYBACK);
+	err = snd_pcm_pump_open(&pump, &pcm, FIFO);
+	if (!err)
+		err = snd_pcm_pump_start(pump);
+	check(!err, "playback pump thread start");
+	if (err)
+		return;
+	while (done < FRAMES && ms < TIMEOUT) {
+		n = FRAMES - done < CHUNK ? FRAMES - done : CHUNK;
+		fill(buf, done, n);
+		done += snd_pcm_pump_write(pump, buf, n);
+		if (!snd_pcm_pump_avail(pump)) {
+			poll(NULL, 0, 1);
+			ms++;
+		}
+	}
+	while (snd_pcm_pump_avail(pump) < FIFO && ms++ < TIMEOUT)
+		poll(NULL, 0, 1);
+	err = snd_pcm_pump_stop(pump);
+	snd_pcm_pump_get_stats(pump, &stats);
+	check(!err && consumed == FRAMES && !misordered,
+	      "%lu of %u frames played in order, %lu silence frames",
+	      consumed, FRAMES, silent);
+	check(stats.silence_frames == silent,
+	      "%lu underruns counted with the silence",
+	      stats.fifo_underruns);
+	snd_pcm_pump_close(pump);
+}
+
+static void test_capture_thread(void)
+{
+	static int32_t buf[CHUNK * CHANNELS];
+	snd_pcm_pump_stats_t stats;
+	snd_pcm_pump_t *pump;
+	snd_pcm_t pcm;
+	unsigned long got = 0, last = 0;
+	snd_pcm_sframes_t n, i;
+	unsigned int reads = 0;
+	int err, ms = 0;
+
+	setup(&pcm, SND_PCM_STREAM_CAPTURE);
+	limit = FRAMES;
+	err = snd_pcm_pump_open(&pump, &pcm, FIFO);
+	if (!err)
+		err = snd_pcm_pump_start(pump);
+	check(!err, "capture pump thread start");
+	if (err)
+		return;
+	for (;;) {
+		n = snd_pcm_pump_read(pump, buf, CHUNK);
+		for (i = 0; i < n; i++) {
+			if (buf[i * CHANNELS] <= last)
+				misordered++;
+			last = buf[i * CHANNELS];
+		}
+		got += n;
+		snd_pcm_pump_get_stats(pump, &stats);
+		if (got + stats.dropped_frames >= FRAMES || ms >= TIMEOUT)
+			break;
+		/* a slow reader now and then, so that the FIFO overruns */
+		if (!n || !(++reads % 256)) {
+			poll(NULL, 0, n ? 8 : 1);
+			ms++;
+		}
+	}
+	err = snd_pcm_pump_stop(pump);
+	check(!err && got + stats.dropped_frames == FRAMES && !misordered,
+	      "%lu frames read in order, %lu dropped in %lu overruns",
+	      got, stats.dropped_frames, stats.fifo_overruns);
+	snd_pcm_pump_close(pump);
+}
+
+int main(void)
+{
+	test_playback_steps();
+	test_capture_steps();
+	test_playback_thread();
+	test_capture_thread();
+	return failed;
+}
@@ -0,0 +1,62 @@
+/*
+ * CPU cost of the plughw rate converter, 44.1kHz -> 48kHz S16 stereo
+ *
+ * usage: rate_bench [seconds of audio]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "asoundlib.h"
+#include "local.h"
+
+#define IN_RATE		44100
+#define OUT_RATE	48000
+#define CHANNELS	2
+#define PERIOD		1024	/* output frames per call */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int secs = argc > 1 ? atoi(argv[1]) : 60;
+	struct snd_pcm_rate *rate;
+	short in[PERIOD * 2 * CHANNELS], out[PERIOD * CHANNELS];
+	snd_pcm_channel_area_t src[CHANNELS], dst[CHANNELS];
+	unsigned long total = 0, frames = (unsigned long)OUT_RATE * secs;
+	snd_pcm_uframes_t n_in, n_out;
+	unsigned int c;
+	double t;
+
+	for (c = 0; c < PERIOD * 2 * CHANNELS; c++)
+		in[c] = rand();
+	for (c = 0; c < CHANNELS; c++) {
+		src[c].addr = in;
+		dst[c].addr = out;
+		src[c].first = dst[c].first = c * 16;
+		src[c].step = dst[c].step = CHANNELS * 16;
+	}
+	if (_snd_pcm_rate_open(&rate, CHANNELS, IN_RATE, OUT_RATE) < 0)
+		return 1;
+	t = now();
+	while (total < frames) {
+		n_in = PERIOD * 2;
+		n_out = PERIOD;
+		_snd_pcm_rate_convert(rate, dst, 0, SND_PCM_FORMAT_S16, &n_out,
+				      src, 0, SND_PCM_FORMAT_S16, &n_in);
+		total += n_out;
+	}
+	t = now() - t;
+	_snd_pcm_rate_close(rate);
+	printf("%s: %u s of audio in %.3f s CPU (%.2f%% of realtime)\n",
+	       SALSA_PLUG_RATE_FIR ? "fir" : "linear", secs, t,
+	       t * 100 / secs);
+	return 0;
+}
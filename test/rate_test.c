@@ -0,0 +1,150 @@
+/*
+ * Check the plughw rate converter on in-memory buffers:
+ * DC gain, passband gain, channel separation and output length
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "asoundlib.h"
+#include "local.h"
+
+#define CHANNELS	2
+#define SECONDS		1
+#define CHUNK		1000	/* input frames per call */
+#define MAX_TAPS	32	/* FIR converter */
+
+static int failed;
+
+static void check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("%s: ", ok ? "ok  " : "FAIL");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!ok)
+		failed = 1;
+}
+
+static void set_areas(snd_pcm_channel_area_t *areas, short *buf)
+{
+	unsigned int c;
+
+	for (c = 0; c < CHANNELS; c++) {
+		areas[c].addr = buf;
+		areas[c].first = c * 16;
+		areas[c].step = CHANNELS * 16;
+	}
+}
+
+/* convert the whole input in chunks; returns the output frames */
+static unsigned long convert(unsigned int in_rate, unsigned int out_rate,
+			     const short *in, unsigned long in_frames,
+			     short *out, unsigned long out_space)
+{
+	struct snd_pcm_rate *rate;
+	snd_pcm_channel_area_t src[CHANNELS], dst[CHANNELS];
+	unsigned long in_done = 0, out_done = 0;
+	snd_pcm_uframes_t n_in, n_out;
+
+	if (_snd_pcm_rate_open(&rate, CHANNELS, in_rate, out_rate) < 0) {
+		check(0, "open %u -> %u", in_rate, out_rate);
+		return 0;
+	}
+	set_areas(src, (short *)in);
+	set_areas(dst, out);
+	while (in_done < in_frames && out_done < out_space) {
+		n_in = in_frames - in_done;
+		if (n_in > CHUNK)
+			n_in = CHUNK;
+		n_out = out_space - out_done;
+		_snd_pcm_rate_convert(rate, dst, out_done, SND_PCM_FORMAT_S16,
+				      &n_out, src, in_done, SND_PCM_FORMAT_S16,
+				      &n_in);
+		if (!n_in && !n_out)
+			break;
+		in_done += n_in;
+		out_done += n_out;
+	}
+	_snd_pcm_rate_close(rate);
+	return out_done;
+}
+
+static void test_rate(unsigned int in_rate, unsigned int out_rate)
+{
+	unsigned long in_frames = in_rate * SECONDS;
+	/* the converter holds back up to MAX_TAPS input frames */
+	unsigned long slack = MAX_TAPS * out_rate / in_rate + 2;
+	unsigned long out_space = out_rate * SECONDS + slack;
+	unsigned long expected = (unsigned long long)in_frames * out_rate /
+		in_rate;
+	unsigned long i, n, skip;
+	unsigned int freq;
+	short *in, *out;
+	double v, dc_min, dc_max, sum, err, sep;
+
+	in = malloc(in_frames * CHANNELS * sizeof(short));
+	out = malloc(out_space * CHANNELS * sizeof(short));
+
+	/* DC */
+	for (i = 0; i < in_frames * CHANNELS; i++)
+		in[i] = 10000;
+	n = convert(in_rate, out_rate, in, in_frames, out, out_space);
+	check(n <= expected && n + slack >= expected,
+	      "%6u -> %6u: %lu frames out, expected %lu", in_rate, out_rate,
+	      n, expected);
+	/* skip the filter delay at the head */
+	skip = slack;
+	dc_min = dc_max = out[skip * CHANNELS];
+	for (i = skip * CHANNELS; i < n * CHANNELS; i++) {
+		if (out[i] < dc_min)
+			dc_min = out[i];
+		if (out[i] > dc_max)
+			dc_max = out[i];
+	}
+	check(dc_min >= 9900 && dc_max <= 10100,
+	      "%6u -> %6u: DC gain %.4f .. %.4f", in_rate, out_rate,
+	      dc_min / 10000, dc_max / 10000);
+
+	/* a sine well inside the passband, the second channel inverted;
+	 * 1kHz, or in_rate/40 for low input rates (linear interpolation
+	 * rolls off early)
+	 */
+	freq = in_rate / 40 < 1000 ? in_rate / 40 : 1000;
+	for (i = 0; i < in_frames; i++) {
+		v = 16000 * sin(2 * M_PI * freq * i / in_rate);
+		in[i * CHANNELS] = lrint(v);
+		in[i * CHANNELS + 1] = -lrint(v);
+	}
+	n = convert(in_rate, out_rate, in, in_frames, out, out_space);
+	sum = sep = 0;
+	for (i = skip; i < n - skip; i++) {
+		v = out[i * CHANNELS];
+		sum += v * v;
+		err = v + out[i * CHANNELS + 1];
+		sep += err * err;
+	}
+	v = sqrt(sum / (n - 2 * skip)) / (16000 / M_SQRT2);
+	check(v > 0.98 && v < 1.02,
+	      "%6u -> %6u: %uHz gain %.4f", in_rate, out_rate, freq, v);
+	check(sep <= (n - 2 * skip) * 1.0,
+	      "%6u -> %6u: channels converted independently", in_rate,
+	      out_rate);
+	free(in);
+	free(out);
+}
+
+int main(void)
+{
+	test_rate(44100, 48000);
+	test_rate(48000, 44100);
+	test_rate(8000, 48000);
+	test_rate(96000, 44100);
+	test_rate(48000, 48000);
+	return failed;
+}
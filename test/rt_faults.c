@@ -0,0 +1,88 @@
+/*
+ * Count the page faults of a steady-state playback loop on a real
+ * device, with and without SND_PCM_RT_PREFAULT
+ *
+ * usage: rt_faults [device [seconds]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asoundlib.h"
+
+#define RATE		48000
+#define CHANNELS	2
+#define CHUNK		256	/* frames per write */
+#define WARMUP		1	/* secs before counting */
+
+static short buf[CHUNK * CHANNELS];
+
+static int play(snd_pcm_t *pcm, unsigned int secs)
+{
+	snd_pcm_uframes_t total = 0, frames = (snd_pcm_uframes_t)RATE * secs;
+	snd_pcm_sframes_t n;
+
+	while (total < frames) {
+		n = snd_pcm_mmap_writei(pcm, buf, CHUNK);
+		if (n < 0) {
+			n = snd_pcm_recover(pcm, n, 0);
+			if (n < 0)
+				return n;
+			continue;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+static int run(const char *dev, int mode, unsigned int secs)
+{
+	snd_pcm_t *pcm;
+	unsigned long minor0, major0, minor, major;
+	int err;
+
+	err = snd_pcm_open(&pcm, dev, SND_PCM_STREAM_PLAYBACK, mode);
+	if (err < 0)
+		return err;
+	err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+				 SND_PCM_ACCESS_MMAP_INTERLEAVED,
+				 CHANNELS, RATE, 0, 20000);
+	if (err < 0)
+		goto out;
+	/* the first laps fault in the app buffer, the stack and the
+	 * pages of a non-prefaulted ring
+	 */
+	err = play(pcm, WARMUP);
+	if (err < 0)
+		goto out;
+	snd_pcm_rt_get_faults(&minor0, &major0);
+	err = play(pcm, secs);
+	if (err < 0)
+		goto out;
+	snd_pcm_rt_get_faults(&minor, &major);
+	printf("%-8s: %u s, %lu minor / %lu major page faults\n",
+	       mode ? "prefault" : "default", secs, minor - minor0,
+	       major - major0);
+	if (mode && (minor != minor0 || major != major0))
+		err = 1;
+	snd_pcm_drop(pcm);
+ out:
+	snd_pcm_close(pcm);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "hw:0";
+	unsigned int secs = argc > 2 ? atoi(argv[2]) : 5;
+	int err;
+
+	err = run(dev, 0, secs);
+	if (!err)
+		err = run(dev, SND_PCM_RT_PREFAULT, secs);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", dev, snd_strerror(err));
+		return 1;
+	}
+	return err;
+}